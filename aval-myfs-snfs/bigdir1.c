@@ -0,0 +1,121 @@
+/*
+ * Large directory benchmark
+ *
+ * Fills one directory with many files and times, as the directory grows,
+ * the creation of more files one by one, the lookup of files spread over
+ * the directory, and the listing of the whole directory in parts of
+ * MAX_READDIR_ENTRIES entries, checking that the names come in order.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <myfs.h>
+#include <snfs_api.h>
+
+#define NUM_FILES 8192
+#define STEP 1024
+#define PROBES 256
+
+
+static double elapsed_ms(struct timeval* start)
+{
+   struct timeval now;
+   gettimeofday(&now,NULL);
+   return (now.tv_sec - start->tv_sec) * 1000.0 +
+      (now.tv_usec - start->tv_usec) / 1000.0;
+}
+
+
+// lists the whole directory, returning the number of entries or -1
+static int list_dir(snfs_fhandle_t dir)
+{
+   snfs_dir_entry_t list[MAX_READDIR_ENTRIES];
+   char cookie[MAX_FILE_NAME_SIZE] = "";
+   unsigned count;
+   int total = 0;
+   do {
+      if (snfs_readdir(dir,cookie,MAX_READDIR_ENTRIES,list,&count) !=
+         STAT_OK) {
+         return -1;
+      }
+      for (unsigned i = 0; i < count; i++) {
+         if (strcmp(list[i].name,cookie) <= 0) {
+            return -1;
+         }
+         strcpy(cookie,list[i].name);
+      }
+      total += count;
+   } while (count == MAX_READDIR_ENTRIES);
+   return total;
+}
+
+
+int main(int argc, char **argv)
+{
+   struct timeval start;
+   snfs_fhandle_t dir, file;
+   char buffer[MAX_CREATE_BATCH][MAX_FILE_NAME_SIZE];
+   char* names[MAX_CREATE_BATCH];
+   snfs_fhandle_t files[MAX_CREATE_BATCH];
+   char path[MAX_PATH_NAME_SIZE];
+   unsigned fsize;
+
+   // mandatory to init the myfs layer
+   my_init_lib();
+   if (snfs_mkdir((snfs_fhandle_t) 1,"big",&dir) != STAT_OK) {
+      printf("[test] error creating the directory.\n");
+      return -1;
+   }
+
+   for (int num = 0; num < NUM_FILES; num += STEP) {
+      // most of the step in batches, the last files one by one
+      gettimeofday(&start,NULL);
+      for (int i = num; i < num + STEP - MAX_CREATE_BATCH;
+         i += MAX_CREATE_BATCH) {
+         for (int j = 0; j < MAX_CREATE_BATCH; j++) {
+            sprintf(buffer[j],"f-%d",i + j);
+            names[j] = buffer[j];
+         }
+         if (snfs_create_batch(dir,names,MAX_CREATE_BATCH,files) != STAT_OK) {
+            printf("[test] error creating a batch of files.\n");
+            return -1;
+         }
+      }
+      double batch = elapsed_ms(&start);
+      gettimeofday(&start,NULL);
+      for (int i = num + STEP - MAX_CREATE_BATCH; i < num + STEP; i++) {
+         sprintf(buffer[0],"f-%d",i);
+         if (snfs_create(dir,buffer[0],&file) != STAT_OK) {
+            printf("[test] error creating a file.\n");
+            return -1;
+         }
+      }
+      double single = elapsed_ms(&start);
+
+      gettimeofday(&start,NULL);
+      for (int i = 0; i < PROBES; i++) {
+         sprintf(path,"/big/f-%d",(i * 7919) % (num + STEP));
+         if (snfs_lookup(path,&file,&fsize) != STAT_OK) {
+            printf("[test] error: file '%s' is missing.\n",path);
+            return -1;
+         }
+      }
+      double lookup = elapsed_ms(&start);
+
+      gettimeofday(&start,NULL);
+      int total = list_dir(dir);
+      double listing = elapsed_ms(&start);
+      if (total != num + STEP) {
+         printf("[test] error listing the directory.\n");
+         return -1;
+      }
+
+      printf("[bench] %5d files: batch %.0f ms, create %.3f ms/file, lookup "
+         "%.3f ms/file, readdir %.0f ms (%.3f ms/entry)\n", total, batch,
+         single / MAX_CREATE_BATCH, lookup / PROBES, listing,
+         listing / total);
+   }
+   return 0;
+}
@@ -0,0 +1,160 @@
+/*
+ * Block size benchmark
+ *
+ * Times two workloads on the server and reports the space they use:
+ * - a large file written and read back sequentially
+ * - many small files in one directory, written and read back
+ *
+ * The block size is chosen when the server formats its storage, so run
+ * the benchmark once against a fresh server for each size to compare:
+ *   ./server 10000 512     then   ./blocksize1
+ *   ./server 10000 4096    then   ./blocksize1
+ *   ./server 10000 65536   then   ./blocksize1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <myfs.h>
+#include <snfs_api.h>
+#include "tfuncs.h"
+
+// size of the storage of the server (see NUM_BLOCKS in snfs.c)
+#define STORAGE_SIZE (8*1024*1024)
+
+#define LARGE_SIZE (2*1024*1024)
+#define SMALL_FILES 48
+#define SMALL_MAX 3000
+#define CHUNK 1024
+
+
+static double elapsed_ms(struct timeval* start)
+{
+   struct timeval now;
+   gettimeofday(&now,NULL);
+   return (now.tv_sec - start->tv_sec) * 1000.0 +
+      (now.tv_usec - start->tv_usec) / 1000.0;
+}
+
+
+// gets the bytes used by the tree of the root and the block size
+static int space_used(unsigned* used, unsigned* block_size)
+{
+   snfs_msg_res_diskusage_t usage;
+   if (snfs_diskusage((snfs_fhandle_t) 1, 0, &usage) != STAT_OK) {
+      return -1;
+   }
+   *block_size = STORAGE_SIZE / usage.num_blocks;
+   *used = usage.tree_blocks * *block_size;
+   return 0;
+}
+
+
+static int write_file(char* name, char* data, int size)
+{
+   int fd = my_open(name,O_CREATE);
+   if (fd < 0) {
+      return -1;
+   }
+   for (int done = 0; done < size; done += CHUNK) {
+      int count = (size - done < CHUNK) ? size - done : CHUNK;
+      if (my_write(fd,&data[done],count) != count) {
+         return -1;
+      }
+   }
+   return my_close(fd);
+}
+
+
+static int read_file(char* name, char* data, int size)
+{
+   char buffer[CHUNK];
+   int fd = my_open(name,0);
+   if (fd < 0) {
+      return -1;
+   }
+   int done = 0, num;
+   while ((num = my_read(fd,buffer,sizeof(buffer))) > 0) {
+      if (done + num > size || memcmp(&data[done],buffer,num) != 0) {
+         return -1;
+      }
+      done += num;
+   }
+   if (num < 0 || done != size) {
+      return -1;
+   }
+   return my_close(fd);
+}
+
+
+int main(int argc, char **argv)
+{
+   struct timeval start;
+   unsigned used, base, block_size;
+   char name[32];
+   char* data = (char*) malloc(LARGE_SIZE);
+
+   // mandatory to init the myfs layer
+   my_init_lib();
+   gen_data_rand_bin(data,LARGE_SIZE);
+   if (space_used(&base,&block_size) < 0) {
+      printf("[test] unable to get the disk usage.\n");
+      return -1;
+   }
+   printf("[bench] block size: %u bytes\n",block_size);
+
+   // large sequential file
+   gettimeofday(&start,NULL);
+   if (write_file("/large",data,LARGE_SIZE) < 0) {
+      printf("[test] error writing the large file.\n");
+      return -1;
+   }
+   double wr = elapsed_ms(&start);
+   gettimeofday(&start,NULL);
+   if (read_file("/large",data,LARGE_SIZE) < 0) {
+      printf("[test] error reading the large file.\n");
+      return -1;
+   }
+   double rd = elapsed_ms(&start);
+   space_used(&used,&block_size);
+   printf("[bench] large file: write %.0f ms (%.1f KB/s), read %.0f ms "
+      "(%.1f KB/s), %u KB used for %u KB\n", wr, LARGE_SIZE / wr, rd,
+      LARGE_SIZE / rd, (used - base) / 1024, LARGE_SIZE / 1024);
+   base = used;
+
+   // small files
+   if (my_mkdir("/small") < 0) {
+      printf("[test] error creating the directory.\n");
+      return -1;
+   }
+   int total = 0;
+   gettimeofday(&start,NULL);
+   for (int i = 0; i < SMALL_FILES; i++) {
+      sprintf(name,"/small/f-%d",i);
+      int size = (i * 997) % SMALL_MAX + 1;
+      if (write_file(name,&data[i],size) < 0) {
+         printf("[test] error writing a small file.\n");
+         return -1;
+      }
+      total += size;
+   }
+   wr = elapsed_ms(&start);
+   gettimeofday(&start,NULL);
+   for (int i = 0; i < SMALL_FILES; i++) {
+      sprintf(name,"/small/f-%d",i);
+      if (read_file(name,&data[i],(i * 997) % SMALL_MAX + 1) < 0) {
+         printf("[test] error reading a small file.\n");
+         return -1;
+      }
+   }
+   rd = elapsed_ms(&start);
+   space_used(&used,&block_size);
+   printf("[bench] %d small files: write %.0f ms (%.1f files/s), read "
+      "%.0f ms (%.1f files/s), %u KB used for %u KB\n", SMALL_FILES, wr,
+      SMALL_FILES * 1000 / wr, rd, SMALL_FILES * 1000 / rd,
+      (used - base) / 1024, total / 1024);
+
+   free(data);
+   return 0;
+}
@@ -0,0 +1,96 @@
+/*
+ * Bulk create benchmark
+ *
+ * Times the creation of many files in one directory, first one by one
+ * with 'create', then in batches of MAX_CREATE_BATCH files with
+ * 'create_batch', and checks that the files of both are there.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <myfs.h>
+#include <snfs_api.h>
+
+#define NUM_FILES 1024
+
+
+static double elapsed_ms(struct timeval* start)
+{
+   struct timeval now;
+   gettimeofday(&now,NULL);
+   return (now.tv_sec - start->tv_sec) * 1000.0 +
+      (now.tv_usec - start->tv_usec) / 1000.0;
+}
+
+
+// checks that all the files are in the directory
+static int check_dir(char* dir)
+{
+   char path[MAX_PATH_NAME_SIZE];
+   snfs_fhandle_t file;
+   unsigned fsize;
+   for (int i = 0; i < NUM_FILES; i++) {
+      sprintf(path,"%s/f-%d",dir,i);
+      if (snfs_lookup(path,&file,&fsize) != STAT_OK) {
+         return -1;
+      }
+   }
+   return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+   struct timeval start;
+   snfs_fhandle_t dir1, dir2;
+   char buffer[MAX_CREATE_BATCH][MAX_FILE_NAME_SIZE];
+   char* names[MAX_CREATE_BATCH];
+   snfs_fhandle_t files[MAX_CREATE_BATCH];
+
+   // mandatory to init the myfs layer
+   my_init_lib();
+   if (snfs_mkdir((snfs_fhandle_t) 1,"single",&dir1) != STAT_OK ||
+      snfs_mkdir((snfs_fhandle_t) 1,"batch",&dir2) != STAT_OK) {
+      printf("[test] error creating the directories.\n");
+      return -1;
+   }
+
+   // one by one
+   gettimeofday(&start,NULL);
+   for (int i = 0; i < NUM_FILES; i++) {
+      sprintf(buffer[0],"f-%d",i);
+      if (snfs_create(dir1,buffer[0],&files[0]) != STAT_OK) {
+         printf("[test] error creating a file.\n");
+         return -1;
+      }
+   }
+   double single = elapsed_ms(&start);
+
+   // in batches
+   gettimeofday(&start,NULL);
+   for (int i = 0; i < NUM_FILES; i += MAX_CREATE_BATCH) {
+      int count = (NUM_FILES - i < MAX_CREATE_BATCH) ?
+         NUM_FILES - i : MAX_CREATE_BATCH;
+      for (int j = 0; j < count; j++) {
+         sprintf(buffer[j],"f-%d",i + j);
+         names[j] = buffer[j];
+      }
+      if (snfs_create_batch(dir2,names,count,files) != STAT_OK) {
+         printf("[test] error creating a batch of files.\n");
+         return -1;
+      }
+   }
+   double batch = elapsed_ms(&start);
+
+   if (check_dir("/single") < 0 || check_dir("/batch") < 0) {
+      printf("[test] error: a file is missing.\n");
+      return -1;
+   }
+   printf("[bench] %d files: one by one %.0f ms (%.1f files/s), in batches "
+      "of %d %.0f ms (%.1f files/s), %.1fx faster\n", NUM_FILES, single,
+      NUM_FILES * 1000 / single, MAX_CREATE_BATCH, batch,
+      NUM_FILES * 1000 / batch, single / batch);
+   return 0;
+}
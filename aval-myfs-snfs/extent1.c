@@ -0,0 +1,123 @@
+/*
+ * Free extent benchmark
+ *
+ * Fragments the free space of the server (many small files, every other
+ * one removed), reports the runs of free blocks, then times the writing
+ * of a large file over the fragmented space and reports how many pieces
+ * it took; a defragmentation follows, with the runs of free blocks left.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <myfs.h>
+#include <snfs_api.h>
+#include "tfuncs.h"
+
+#define SMALL_FILES 256
+#define SMALL_SIZE (4*1024)
+#define LARGE_SIZE (512*1024)
+#define CHUNK 4096
+
+
+static double elapsed_ms(struct timeval* start)
+{
+   struct timeval now;
+   gettimeofday(&now,NULL);
+   return (now.tv_sec - start->tv_sec) * 1000.0 +
+      (now.tv_usec - start->tv_usec) / 1000.0;
+}
+
+
+static int free_runs(char* when)
+{
+   snfs_msg_res_diskusage_t usage;
+   if (snfs_diskusage((snfs_fhandle_t) 1, 0, &usage) != STAT_OK) {
+      printf("[test] unable to get the disk usage.\n");
+      return -1;
+   }
+   printf("[bench] %s: %u free blocks in %u runs, the longest of %u "
+      "blocks\n", when, usage.free_blocks, usage.free_extents,
+      usage.largest_free);
+   return 0;
+}
+
+
+static int write_file(char* name, char* data, int size)
+{
+   int fd = my_open(name,O_CREATE);
+   if (fd < 0) {
+      return -1;
+   }
+   for (int done = 0; done < size; done += CHUNK) {
+      int count = (size - done < CHUNK) ? size - done : CHUNK;
+      if (my_write(fd,&data[done],count) != count) {
+         return -1;
+      }
+   }
+   return my_close(fd);
+}
+
+
+int main(int argc, char **argv)
+{
+   struct timeval start;
+   char name[32];
+   char* data = (char*) malloc(LARGE_SIZE);
+
+   // mandatory to init the myfs layer
+   my_init_lib();
+   gen_data_rand_bin(data,LARGE_SIZE);
+   if (free_runs("fresh") < 0) {
+      return -1;
+   }
+
+   // fragment the free space
+   for (int i = 0; i < SMALL_FILES; i++) {
+      sprintf(name,"/s-%d",i);
+      if (write_file(name,data,SMALL_SIZE) < 0) {
+         printf("[test] error writing a small file.\n");
+         return -1;
+      }
+   }
+   for (int i = 0; i < SMALL_FILES; i += 2) {
+      snfs_fhandle_t file;
+      sprintf(name,"s-%d",i);
+      if (snfs_remove((snfs_fhandle_t) 1,name,&file) != STAT_OK) {
+         printf("[test] error removing a small file.\n");
+         return -1;
+      }
+   }
+   if (free_runs("fragmented") < 0) {
+      return -1;
+   }
+
+   // a large file over the fragmented space
+   gettimeofday(&start,NULL);
+   if (write_file("/large",data,LARGE_SIZE) < 0) {
+      printf("[test] error writing the large file.\n");
+      return -1;
+   }
+   double wr = elapsed_ms(&start);
+   printf("[bench] large file: write %.0f ms (%.1f KB/s)\n", wr,
+      LARGE_SIZE / wr);
+   if (free_runs("after the large file") < 0) {
+      return -1;
+   }
+
+   gettimeofday(&start,NULL);
+   int moved = my_defrag();
+   if (moved < 0) {
+      printf("[test] error defragmenting.\n");
+      return -1;
+   }
+   printf("[bench] defrag: %d blocks moved in %.0f ms\n", moved,
+      elapsed_ms(&start));
+   if (free_runs("defragmented") < 0) {
+      return -1;
+   }
+
+   free(data);
+   return 0;
+}
@@ -100,8 +100,8 @@ void tfunc_create_file(char* file, char* data, int size)
 
 void tfunc_rewrite_file(char* file, char* data, int size)
 {
-   // open the file
-   int fd = my_open(file,0);
+   // open the file, dropping its old content
+   int fd = my_open(file,O_TRUNCATE);
    if (fd < 0) {
       printf("[test] unable to open file.\n");
       exit(-1);
@@ -22,8 +22,9 @@ typedef struct _file_desc* fd_t;
 /*
  * open flags:
  * - O_CERATE: create the file if it does not exist
+ * - O_TRUNCATE: empty the file if it exists
  */
-enum my_open_flags { O_CREATE = 1 };
+enum my_open_flags { O_CREATE = 1, O_TRUNCATE = 2 };
 
 
 /*
@@ -62,6 +63,25 @@ int my_read(int fileId, char* buffer, unsigned numBytes);
 int my_write(int fileId, char* buffer, unsigned numBytes);
 
 
+/*
+ * fallocate flags:
+ * - FA_KEEP_SIZE: leave the size of the file as it is
+ */
+enum my_fallocate_flags { FA_KEEP_SIZE = 1 };
+
+
+/*
+ * my_fallocate: allocate the blocks of a range of the file before
+ * writing it, so that the range is stored contiguously
+ * - fileId: the file id of the opened file
+ * - offset: start of the range
+ * - numBytes: length of the range
+ * - flags: fallocate flags
+ *   returns: 0 if successful or -1 if error
+ */
+int my_fallocate(int fileId, unsigned offset, unsigned numBytes, int flags);
+
+
 /*
  * my_close: close a previously opened file
  * - fileId: the file id of the file to close
@@ -83,4 +103,41 @@ int my_listdir(char* path, char **filenames, int* numFiles);
 int my_mkdir(char* dirname);
 
 
+/*
+ * my_append: append the content of file 'name2' to the end of file 'name1'
+ *   returns: the new size of 'name1' or -1 if error
+ */
+int my_append(char* name1, char* name2);
+
+
+/*
+ * my_rename: move file (or directory) 'name1' to 'name2', replacing
+ * 'name2' if it exists; no data goes through the client
+ *   returns: 0 if successful or -1 if error
+ */
+int my_rename(char* name1, char* name2);
+
+
+/*
+ * my_link: give file 'name1' the new name 'name2', which must not exist;
+ * both names refer to the same data until one of them is removed
+ *   returns: 0 if successful or -1 if error
+ */
+int my_link(char* name1, char* name2);
+
+
+/*
+ * my_defrag: defragment the file system on the server
+ *   returns: the number of blocks moved or -1 if error
+ */
+int my_defrag();
+
+
+/*
+ * my_diskusage: list the blocks used by each entry of the root directory
+ *   returns: the number of blocks used by the whole tree or -1 if error
+ */
+int my_diskusage();
+
+
 #endif 
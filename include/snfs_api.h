@@ -102,15 +102,18 @@ snfs_call_status_t snfs_mkdir(snfs_fhandle_t dir, char* name,
 
 
 /*
- * readdir: read the contents of directory 'dir'
+ * readdir: read the contents of directory 'dir' in name order, in parts
+ * of up to 'cmax' entries (fewer entries are read at the end)
  * - dir - file handle of the directory to read
+ * - cookie - the last name read in the previous part (NULL or "" to
+ *   start from the first entry)
  * - cmax - maximum number of entries that can be read
  * - list - the list of directory entries [out]
  * - count - the number of entries read [out]
  *   returns: status
  */
-snfs_call_status_t snfs_readdir(snfs_fhandle_t dir, unsigned cmax, 
-   snfs_dir_entry_t* list, unsigned* count);
+snfs_call_status_t snfs_readdir(snfs_fhandle_t dir, char* cookie,
+   unsigned cmax, snfs_dir_entry_t* list, unsigned* count);
 
 /*
  * remove: deletes file 'name' on directory 'dir' 
@@ -149,16 +152,115 @@ snfs_call_status_t snfs_append(snfs_fhandle_t dir1, char* name1, snfs_fhandle_t
 
 /*
  * defragmentation: operates the file system block defragmentation 
+ * - moved - number of blocks moved [out]
+ * - frag_before - fragmentation (%) before defragmenting [out]
+ * - frag_after - fragmentation (%) after defragmenting [out]
  *   returns: status
  */
-snfs_call_status_t snfs_defrag();
+snfs_call_status_t snfs_defrag(unsigned* moved, unsigned* frag_before,
+   unsigned* frag_after);
 
 /*
- * diskusage: dumps the file system busy blocks along with the
- * name of the files that are using them. This dumping operation takes place on the server side.
+ * diskusage: gets the number of blocks used by the entries of a
+ * directory (subtrees included), along with the totals of the directory
+ * and of the file system
+ * - dir - file handle of the directory
+ * - first - position of the first entry to report
+ * - usage - the usage of up to MAX_DISKUSAGE_ENTRIES entries [out]
+ *   returns: status
+ */
+snfs_call_status_t snfs_diskusage(snfs_fhandle_t dir, unsigned first,
+   snfs_msg_res_diskusage_t* usage);
+
+/*
+ * snapshot_create: takes a read-only snapshot of the whole file system,
+ * which is also found by looking up "/.snapshot/<name>"
+ * - name - name of the snapshot
+ * - root - file handle of the root directory of the snapshot [out]
+ *   returns: status
+ */
+snfs_call_status_t snfs_snapshot_create(char* name, snfs_fhandle_t* root);
+
+/*
+ * snapshot_delete: deletes a snapshot
+ * - name - name of the snapshot
+ *   returns: status
+ */
+snfs_call_status_t snfs_snapshot_delete(char* name);
+
+/*
+ * fallocate: allocates blocks for a range of a file ahead of the writes
+ * that fill it, in one contiguous run when possible
+ * - fhandle - file handle of the file
+ * - offset - start of the range
+ * - len - length of the range
+ * - flags - FALLOC_KEEP_SIZE leaves the size of the file as it is,
+ *   otherwise the file grows to cover the range (reading as zeros)
+ * - fsize - size of file after the allocation [out]
+ *   returns: status
+ */
+snfs_call_status_t snfs_fallocate(snfs_fhandle_t fhandle, unsigned offset,
+   unsigned len, unsigned flags, unsigned* fsize);
+
+/*
+ * truncate: sets the size of a file, freeing its blocks past the new end
+ * - fhandle - file handle of the file
+ * - size - new size of the file
+ *   returns: status
+ */
+snfs_call_status_t snfs_truncate(snfs_fhandle_t fhandle, unsigned size);
+
+/*
+ * punchhole: frees the blocks of a range of a file, which then reads as
+ * zeros, leaving the size of the file as it is
+ * - fhandle - file handle of the file
+ * - offset - start of the range
+ * - len - length of the range
+ *   returns: status
+ */
+snfs_call_status_t snfs_punchhole(snfs_fhandle_t fhandle, unsigned offset,
+   unsigned len);
+
+/*
+ * create_batch: create several files in directory 'dir' at once; either
+ * all or none are created
+ * - dir - file handle of the directory
+ * - names - names of the files to create, neither repeated nor existing
+ * - count - number of files, at most MAX_CREATE_BATCH
+ * - files - the file handles of the created files, in the order of the
+ *   names [out]
  *   returns: status
  */
-snfs_call_status_t snfs_diskusage();
+snfs_call_status_t snfs_create_batch(snfs_fhandle_t dir, char** names,
+   unsigned count, snfs_fhandle_t* files);
+
+/*
+ * rename: moves file (or directory) 'src_name' on directory 'src_dir' to
+ * 'dst_name' on directory 'dst_dir', without copying its data; an entry
+ * 'dst_name' of the same type (an empty directory) is replaced at once
+ * - src_dir - file handle of the source directory
+ * - src_name - name of the entry to move
+ * - dst_dir - file handle of the destination directory
+ * - dst_name - new name of the entry
+ * - file - the file handle of the entry moved [out]
+ *   returns: status
+ */
+snfs_call_status_t snfs_rename(snfs_fhandle_t src_dir, char* src_name,
+   snfs_fhandle_t dst_dir, char* dst_name, snfs_fhandle_t* file);
+
+/*
+ * link: gives file 'src_name' on directory 'src_dir' the new name
+ * 'dst_name' on directory 'dst_dir', sharing its data; the file is removed
+ * with the last of its names
+ * - src_dir - file handle of the directory of the file
+ * - src_name - name of the file
+ * - dst_dir - file handle of the directory of the new name
+ * - dst_name - new name of the file, which must not exist
+ * - file - the file handle of the file [out]
+ *   returns: status
+ */
+snfs_call_status_t snfs_link(snfs_fhandle_t src_dir, char* src_name,
+   snfs_fhandle_t dst_dir, char* dst_name, snfs_fhandle_t* file);
 
 /*
  * dumpcache: dumps the cache of blocks content. This dumping operation takes place on the server side.
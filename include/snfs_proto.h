@@ -40,6 +40,14 @@
 #define MAX_READDIR_ENTRIES 64
 
 
+// maximum amount of disk usage entries sent in one single message
+#define MAX_DISKUSAGE_ENTRIES 64
+
+
+// maximum amount of files created in one single message
+#define MAX_CREATE_BATCH 64
+
+
 // file handle describing a remote directory/file
 typedef int snfs_fhandle_t;
 
@@ -56,6 +64,14 @@ typedef struct {
 } snfs_dir_entry_t;
 
 
+// disk usage of a directory entry
+typedef struct {
+   char name[MAX_FILE_NAME_SIZE];
+   snfs_dir_entry_type_t type;
+   unsigned blocks;   // blocks used (by the whole subtree, if a directory)
+} snfs_usage_entry_t;
+
+
 /*
  * SNFS Message Codes
  *  - message identifier - snfs_msg_type_t
@@ -76,7 +92,14 @@ typedef enum {
    REQ_APPEND = 10,
    REQ_DEFRAG = 11,
    REQ_DISKUSAGE = 12,
-   REQ_DUMPCACHE = 13   
+   REQ_DUMPCACHE = 13,
+   REQ_SNAPSHOT = 14,
+   REQ_FALLOCATE = 15,
+   REQ_TRUNCATE = 16,
+   REQ_PUNCHHOLE = 17,
+   REQ_CREATE_BATCH = 18,
+   REQ_RENAME = 19,
+   REQ_LINK = 20
 } snfs_msg_type_t;
 
 typedef int snfs_req_serial_num_t;
@@ -209,6 +232,7 @@ typedef struct {
 typedef struct {
    snfs_fhandle_t dir;
    unsigned cmax;
+   char cookie[MAX_FILE_NAME_SIZE];   // list after this name ("" -> first)
 } snfs_msg_req_readdir_t;
 
 
@@ -273,6 +297,188 @@ typedef struct {
 } snfs_msg_res_append_t;
 
 
+/*
+ * SNFS Defrag
+ *   - request message: none
+ *   - response message: snfs_msg_res_defrag_t
+ */
+
+
+typedef struct {
+   unsigned moved;        // number of blocks moved
+   unsigned frag_before;  // fragmentation (%) before defragmenting
+   unsigned frag_after;   // fragmentation (%) after defragmenting
+} snfs_msg_res_defrag_t;
+
+
+/*
+ * SNFS Diskusage
+ *   - request message: snfs_msg_req_diskusage_t
+ *   - response message: snfs_msg_res_diskusage_t
+ */
+
+
+typedef struct {
+   snfs_fhandle_t dir;
+   unsigned first;         // position of the first entry to report
+} snfs_msg_req_diskusage_t;
+
+
+typedef struct {
+   unsigned num_blocks;    // blocks of the file system
+   unsigned free_blocks;   // free blocks of the file system
+   unsigned free_extents;  // runs of free blocks of the file system
+   unsigned largest_free;  // blocks of the longest run of free blocks
+   unsigned dir_blocks;    // blocks used by the directory itself
+   unsigned tree_blocks;   // blocks used by the directory and its subtree
+   unsigned num_entries;   // entries of the directory
+   unsigned count;         // entries in 'list'
+   snfs_usage_entry_t list[MAX_DISKUSAGE_ENTRIES];
+} snfs_msg_res_diskusage_t;
+
+
+/*
+ * SNFS Snapshot
+ *   - request message: snfs_msg_req_snapshot_t
+ *   - response message: snfs_msg_res_snapshot_t
+ */
+
+
+typedef enum {SNAPSHOT_CREATE = 1, SNAPSHOT_DELETE = 2} snfs_snapshot_op_t;
+
+
+typedef struct {
+   snfs_snapshot_op_t op;
+   char name[MAX_FILE_NAME_SIZE];
+} snfs_msg_req_snapshot_t;
+
+
+typedef struct {
+   snfs_fhandle_t root;    // root directory of the snapshot created
+} snfs_msg_res_snapshot_t;
+
+
+/*
+ * SNFS Fallocate
+ *   - request message: snfs_msg_req_fallocate_t
+ *   - response message: snfs_msg_res_fallocate_t
+ */
+
+
+// the file size is left as it is
+#define FALLOC_KEEP_SIZE 0x1
+
+
+typedef struct {
+   snfs_fhandle_t fhandle;
+   unsigned offset;        // start of the range to allocate
+   unsigned len;           // length of the range to allocate
+   unsigned flags;         // FALLOC_* flags
+} snfs_msg_req_fallocate_t;
+
+
+typedef struct {
+   unsigned fsize;         // file size after the allocation
+} snfs_msg_res_fallocate_t;
+
+
+/*
+ * SNFS Truncate
+ *   - request message: snfs_msg_req_truncate_t
+ *   - response message: snfs_msg_res_truncate_t
+ */
+
+
+typedef struct {
+   snfs_fhandle_t fhandle;
+   unsigned size;          // new size of the file
+} snfs_msg_req_truncate_t;
+
+
+typedef struct {
+   unsigned fsize;
+} snfs_msg_res_truncate_t;
+
+
+/*
+ * SNFS Punchhole
+ *   - request message: snfs_msg_req_punchhole_t
+ *   - response message: snfs_msg_res_punchhole_t
+ */
+
+
+typedef struct {
+   snfs_fhandle_t fhandle;
+   unsigned offset;        // start of the range to free
+   unsigned len;           // length of the range to free
+} snfs_msg_req_punchhole_t;
+
+
+typedef struct {
+   unsigned fsize;
+} snfs_msg_res_punchhole_t;
+
+
+/*
+ * SNFS Create Batch
+ *   - request message: snfs_msg_req_create_batch_t
+ *   - response message: snfs_msg_res_create_batch_t
+ */
+
+
+typedef struct {
+   snfs_fhandle_t dir;
+   unsigned count;         // files in 'names'
+   char names[MAX_CREATE_BATCH][MAX_FILE_NAME_SIZE];
+} snfs_msg_req_create_batch_t;
+
+
+typedef struct {
+   unsigned count;         // files created
+   snfs_fhandle_t files[MAX_CREATE_BATCH];
+} snfs_msg_res_create_batch_t;
+
+
+/*
+ * SNFS Rename
+ *   - request message: snfs_msg_req_rename_t
+ *   - response message: snfs_msg_res_rename_t
+ */
+
+
+typedef struct {
+   snfs_fhandle_t src_dir;
+   snfs_fhandle_t dst_dir;
+   char src_name[MAX_FILE_NAME_SIZE];
+   char dst_name[MAX_FILE_NAME_SIZE];   // replaced if it exists
+} snfs_msg_req_rename_t;
+
+
+typedef struct {
+   snfs_fhandle_t file;    // the entry moved
+} snfs_msg_res_rename_t;
+
+
+/*
+ * SNFS Link
+ *   - request message: snfs_msg_req_link_t
+ *   - response message: snfs_msg_res_link_t
+ */
+
+
+typedef struct {
+   snfs_fhandle_t src_dir;
+   snfs_fhandle_t dst_dir;
+   char src_name[MAX_FILE_NAME_SIZE];
+   char dst_name[MAX_FILE_NAME_SIZE];   // must not exist
+} snfs_msg_req_link_t;
+
+
+typedef struct {
+   snfs_fhandle_t file;    // the file linked
+} snfs_msg_res_link_t;
+
+
 
 /*
  * SNFS Messages
@@ -300,6 +506,14 @@ typedef struct {
     		snfs_msg_req_remove_t remove;
 		snfs_msg_req_copy_t copy;
 		snfs_msg_req_append_t append;	
+		snfs_msg_req_diskusage_t diskusage;
+		snfs_msg_req_snapshot_t snapshot;
+		snfs_msg_req_fallocate_t fallocate;
+		snfs_msg_req_truncate_t truncate;
+		snfs_msg_req_punchhole_t punchhole;
+		snfs_msg_req_create_batch_t create_batch;
+		snfs_msg_req_rename_t rename;
+		snfs_msg_req_link_t link;
   	} body;
 } snfs_msg_req_t;
 
@@ -317,6 +531,15 @@ typedef struct {
 	  	snfs_msg_res_remove_t remove;
 	  	snfs_msg_res_copy_t copy;
 	  	snfs_msg_res_append_t append;	
+	  	snfs_msg_res_defrag_t defrag;
+	  	snfs_msg_res_diskusage_t diskusage;
+	  	snfs_msg_res_snapshot_t snapshot;
+	  	snfs_msg_res_fallocate_t fallocate;
+	  	snfs_msg_res_truncate_t truncate;
+	  	snfs_msg_res_punchhole_t punchhole;
+	  	snfs_msg_res_create_batch_t create_batch;
+	  	snfs_msg_res_rename_t rename;
+	  	snfs_msg_res_link_t link;
    } body;
 } snfs_msg_res_t;
 
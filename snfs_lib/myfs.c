@@ -122,7 +122,7 @@ int my_open(char* name, int flags)
 	             dir = ( snfs_fhandle_t)  1;
 	} 
 	
-	if(flags == O_CREATE && status != STAT_OK) {
+	if((flags & O_CREATE) && status != STAT_OK) {
 		if (snfs_create(dir,newfilename,&file_fh) != STAT_OK) {
 			printf("[my_open] Error creating a file in server.\n");
 			return -1;
@@ -131,6 +131,15 @@ int my_open(char* name, int flags)
 		printf("[my_open] Error opening up file.\n");
 		return -1;
 	}
+
+	// the server frees the blocks of the old content
+	if ((flags & O_TRUNCATE) && status == STAT_OK && fsize > 0) {
+		if (snfs_truncate(file_fh, 0) != STAT_OK) {
+			printf("[my_open] Error truncating the file.\n");
+			return -1;
+		}
+		fsize = 0;
+	}
 	
 	fd_t fdesc = (fd_t) malloc(sizeof(struct _file_desc));
 	fdesc->fileId = file_fh;
@@ -214,18 +223,152 @@ int my_copy(char *name1, char *name2)
 }
 
 
+/*
+ * my_splitpath: gets the handle of the directory of a pathname and the
+ * name of the entry in that directory
+ *   returns: 0 if successful, -1 otherwise
+ */
+static int my_splitpath(char *pathname, snfs_fhandle_t *dir, char *name)
+{
+	char dirname[MAX_PATH_NAME_SIZE];
+	unsigned fsize;
+
+	if (myparse(pathname) != 0)
+		return -1;
+
+	char *last = strrchr(pathname, '/');
+	if (strlen(last + 1) + 1 > MAX_FILE_NAME_SIZE)
+		return -1;
+	strcpy(name, last + 1);
+
+	// entries of the root directory have no directory to look up
+	if (last == pathname) {
+		*dir = (snfs_fhandle_t) 1;
+		return 0;
+	}
+	memset(dirname, 0, MAX_PATH_NAME_SIZE);
+	strncpy(dirname, pathname, last - pathname);
+	if (snfs_lookup(dirname, dir, &fsize) != STAT_OK)
+		return -1;
+	return 0;
+}
+
+
 int my_append(char *name1, char *name2) 
 {
-	return 1;
+	if (!Lib_initted) {
+		printf("[my_append] Library is not initialized.\n");
+		return -1;
+	}
+
+	snfs_fhandle_t dir1, dir2;
+	char file1[MAX_FILE_NAME_SIZE];
+	char file2[MAX_FILE_NAME_SIZE];
+	if (my_splitpath(name1, &dir1, file1) < 0 ||
+		my_splitpath(name2, &dir2, file2) < 0) {
+		printf("[my_append] Malformed pathname.\n");
+		return -1;
+	}
+
+	// the server joins the files, no data goes through the client
+	unsigned fsize;
+	if (snfs_append(dir1, file1, dir2, file2, &fsize) != STAT_OK) {
+		puts("[my_append] cannot append the file in server.");
+		return -1;
+	}
+	return fsize;
+}
+
+int my_rename(char *name1, char *name2)
+{
+	if (!Lib_initted) {
+		printf("[my_rename] Library is not initialized.\n");
+		return -1;
+	}
+
+	snfs_fhandle_t dir1, dir2, file;
+	char file1[MAX_FILE_NAME_SIZE];
+	char file2[MAX_FILE_NAME_SIZE];
+	if (my_splitpath(name1, &dir1, file1) < 0 ||
+		my_splitpath(name2, &dir2, file2) < 0) {
+		printf("[my_rename] Malformed pathname.\n");
+		return -1;
+	}
+
+	if (snfs_rename(dir1, file1, dir2, file2, &file) != STAT_OK) {
+		puts("[my_rename] cannot rename the file in server.");
+		return -1;
+	}
+	return 0;
+}
+
+int my_link(char *name1, char *name2)
+{
+	if (!Lib_initted) {
+		printf("[my_link] Library is not initialized.\n");
+		return -1;
+	}
+
+	snfs_fhandle_t dir1, dir2, file;
+	char file1[MAX_FILE_NAME_SIZE];
+	char file2[MAX_FILE_NAME_SIZE];
+	if (my_splitpath(name1, &dir1, file1) < 0 ||
+		my_splitpath(name2, &dir2, file2) < 0) {
+		printf("[my_link] Malformed pathname.\n");
+		return -1;
+	}
+
+	if (snfs_link(dir1, file1, dir2, file2, &file) != STAT_OK) {
+		puts("[my_link] cannot link the file in server.");
+		return -1;
+	}
+	return 0;
 }
 
 int my_defrag()
 {
-	return 1;
+	if (!Lib_initted) {
+		printf("[my_defrag] Library is not initialized.\n");
+		return -1;
+	}
+
+	unsigned moved, frag_before, frag_after;
+	if (snfs_defrag(&moved, &frag_before, &frag_after) != STAT_OK) {
+		puts("[my_defrag] cannot defragment the server file system.");
+		return -1;
+	}
+	printf("[my_defrag] %u blocks moved, fragmentation %u%% -> %u%%.\n",
+		moved, frag_before, frag_after);
+	return moved;
 }
 
-void my_diskusage()
+int my_diskusage()
 {
+	if (!Lib_initted) {
+		printf("[my_diskusage] Library is not initialized.\n");
+		return -1;
+	}
+
+	// list the root directory, MAX_DISKUSAGE_ENTRIES at a time
+	snfs_msg_res_diskusage_t usage;
+	unsigned first = 0;
+	do {
+		if (snfs_diskusage((snfs_fhandle_t) 1, first, &usage) != STAT_OK) {
+			puts("[my_diskusage] cannot get the disk usage from server.");
+			return -1;
+		}
+		for (unsigned i = 0; i < usage.count; i++) {
+			printf("%8u %s%s\n", usage.list[i].blocks, usage.list[i].name,
+				(usage.list[i].type == SNFS_DIR) ? "/" : "");
+		}
+		first += usage.count;
+	} while (usage.count > 0 && first < usage.num_entries);
+
+	printf("%8u total (%u of %u blocks free)\n", usage.tree_blocks,
+		usage.free_blocks, usage.num_blocks);
+	printf("%8u free runs (the longest of %u blocks)\n", usage.free_extents,
+		usage.largest_free);
+	return usage.tree_blocks;
 }
 
 void my_dumpcache()
@@ -321,6 +464,30 @@ int my_write(int fileId, char* buffer, unsigned numBytes)
 	return counter;
 }
 
+int my_fallocate(int fileId, unsigned offset, unsigned numBytes, int flags)
+{
+	if (!Lib_initted) {
+		printf("[my_fallocate] Library is not initialized.\n");
+		return -1;
+	}
+	
+	fd_t fdesc = queue_node_get(Open_files_list, fileId);
+	if(fdesc == NULL) {
+		printf("[my_fallocate] File isn't in use. Open it first.\n");
+		return -1;
+	}
+	
+	unsigned fsize;
+	if (snfs_fallocate(fileId, offset, numBytes,
+		(flags & FA_KEEP_SIZE) ? FALLOC_KEEP_SIZE : 0, &fsize) != STAT_OK) {
+		printf("[my_fallocate] Error allocating the file blocks.\n");
+		return -1;
+	}
+	fdesc->size = fsize;
+	
+	return 0;
+}
+
 int my_close(int fileId)
 {
 	if (!Lib_initted) {
@@ -366,21 +533,33 @@ int my_listdir(char* path, char **filenames, int* numFiles)
 	
 	snfs_dir_entry_t list[MAX_READDIR_ENTRIES];
 	unsigned nFiles;
-	char* fnames;
-	
-	if (snfs_readdir(dir, MAX_READDIR_ENTRIES, list, &nFiles) != STAT_OK) {
-		printf("[my_listdir] Error reading directory in server.\n");
-		return -1;
-	}
-	
-	*numFiles = (int)nFiles;
-	
-	*filenames = fnames = (char*) malloc(sizeof(char)*((MAX_FILE_NAME_SIZE+1)*(*numFiles)));
-	for (int i = 0; i < *numFiles; i++) {
-		strcpy(fnames, list[i].name);
-		fnames += strlen(fnames)+1;
-	}
+	char cookie[MAX_FILE_NAME_SIZE] = "";
+	int cap = MAX_READDIR_ENTRIES, used = 0;
+	char* fnames = (char*) malloc(sizeof(char)*((MAX_FILE_NAME_SIZE+1)*cap));
+	
+	// read the directory in parts, each resuming after the last name read
+	*numFiles = 0;
+	do {
+		if (snfs_readdir(dir, cookie, MAX_READDIR_ENTRIES, list, &nFiles) != STAT_OK) {
+			printf("[my_listdir] Error reading directory in server.\n");
+			free(fnames);
+			return -1;
+		}
+		if (*numFiles + (int)nFiles > cap) {
+			cap *= 2;
+			fnames = (char*) realloc(fnames, sizeof(char)*((MAX_FILE_NAME_SIZE+1)*cap));
+		}
+		for (unsigned i = 0; i < nFiles; i++) {
+			strcpy(&fnames[used], list[i].name);
+			used += strlen(list[i].name)+1;
+		}
+		*numFiles += nFiles;
+		if (nFiles > 0) {
+			strcpy(cookie, list[nFiles-1].name);
+		}
+	} while (nFiles == MAX_READDIR_ENTRIES);
 	
+	*filenames = fnames;
 	return 0;
 	
 }
@@ -284,7 +284,7 @@ snfs_call_status_t snfs_mkdir(snfs_fhandle_t dir, char* name, snfs_fhandle_t* fi
 }
 
 
-snfs_call_status_t snfs_readdir(snfs_fhandle_t dir, unsigned cmax, snfs_dir_entry_t* list, unsigned* count)
+snfs_call_status_t snfs_readdir(snfs_fhandle_t dir, char* cookie, unsigned cmax, snfs_dir_entry_t* list, unsigned* count)
 {
 	snfs_msg_req_t req;
 	snfs_msg_res_t res;
@@ -296,6 +296,9 @@ snfs_call_status_t snfs_readdir(snfs_fhandle_t dir, unsigned cmax, snfs_dir_entr
 	req.type = REQ_READDIR;
 	req.body.readdir.dir = dir;
 	req.body.readdir.cmax = cmax;
+	if (cookie != NULL) {
+		strncpy(req.body.readdir.cookie, cookie, MAX_FILE_NAME_SIZE-1);
+	}
 	
 	int status = remote_call(&req, sizeof(req.type) + sizeof(req.body.readdir), 
 				  &res, sizeof(res));
@@ -363,24 +366,293 @@ snfs_call_status_t snfs_copy(snfs_fhandle_t src_dir, char* src_name, snfs_fhandl
 
 snfs_call_status_t snfs_append(snfs_fhandle_t dir1, char* name1, snfs_fhandle_t dir2, char* name2, unsigned int* fsize)  
 {   
-   // IMPLEMENT 
+	snfs_msg_req_t req;
+	snfs_msg_res_t res;
 
-   return STAT_ERROR;
+	memset(&req, 0, sizeof(req));
+	memset(&res, 0, sizeof(res));
+
+	// format request
+	req.type = REQ_APPEND;
+	req.body.append.dir1 = dir1;
+	req.body.append.dir2 = dir2;
+	strcpy(req.body.append.name1, name1);
+	strcpy(req.body.append.name2, name2);
+
+	int status = remote_call(&req, sizeof(req.type) + sizeof(req.body.append), &res, sizeof(res));
+
+	// format response
+	if (status < 0 || res.status != RES_OK)
+		return STAT_ERROR;
+
+	*fsize = res.body.append.fsize;
+	return STAT_OK;
 }
 
-snfs_call_status_t snfs_defrag()  
+snfs_call_status_t snfs_defrag(unsigned* moved, unsigned* frag_before,
+   unsigned* frag_after)  
 {   
-   // IMPLEMENT 
+	snfs_msg_req_t req;
+	snfs_msg_res_t res;
 
-   return STAT_ERROR;
+	memset(&req, 0, sizeof(req));
+	memset(&res, 0, sizeof(res));
+
+	// format request
+	req.type = REQ_DEFRAG;
+
+	int status = remote_call(&req, sizeof(req.type), &res, sizeof(res));
+
+	// format response
+	if (status < 0 || res.status != RES_OK)
+		return STAT_ERROR;
+
+	*moved = res.body.defrag.moved;
+	*frag_before = res.body.defrag.frag_before;
+	*frag_after = res.body.defrag.frag_after;
+	return STAT_OK;
 }
 
 
-snfs_call_status_t snfs_diskusage()  
+snfs_call_status_t snfs_diskusage(snfs_fhandle_t dir, unsigned first,
+   snfs_msg_res_diskusage_t* usage)  
 {   
-   // IMPLEMENT 
+	snfs_msg_req_t req;
+	snfs_msg_res_t res;
 
-   return STAT_ERROR;
+	memset(&req, 0, sizeof(req));
+	memset(&res, 0, sizeof(res));
+
+	// format request
+	req.type = REQ_DISKUSAGE;
+	req.body.diskusage.dir = dir;
+	req.body.diskusage.first = first;
+
+	int status = remote_call(&req, sizeof(req.type) + sizeof(req.body.diskusage),
+				  &res, sizeof(res));
+
+	// format response
+	if (status < 0 || res.status != RES_OK)
+		return STAT_ERROR;
+
+	memcpy(usage, &res.body.diskusage, sizeof(*usage));
+	return STAT_OK;
+}
+
+
+snfs_call_status_t snfs_snapshot_create(char* name, snfs_fhandle_t* root)
+{
+	snfs_msg_req_t req;
+	snfs_msg_res_t res;
+
+	memset(&req, 0, sizeof(req));
+	memset(&res, 0, sizeof(res));
+
+	// format request
+	req.type = REQ_SNAPSHOT;
+	req.body.snapshot.op = SNAPSHOT_CREATE;
+	strncpy(req.body.snapshot.name, name, MAX_FILE_NAME_SIZE-1);
+
+	int status = remote_call(&req, sizeof(req.type) + sizeof(req.body.snapshot),
+				  &res, sizeof(res));
+
+	// format response
+	if (status < 0 || res.status != RES_OK)
+		return STAT_ERROR;
+
+	*root = res.body.snapshot.root;
+	return STAT_OK;
+}
+
+
+snfs_call_status_t snfs_snapshot_delete(char* name)
+{
+	snfs_msg_req_t req;
+	snfs_msg_res_t res;
+
+	memset(&req, 0, sizeof(req));
+	memset(&res, 0, sizeof(res));
+
+	// format request
+	req.type = REQ_SNAPSHOT;
+	req.body.snapshot.op = SNAPSHOT_DELETE;
+	strncpy(req.body.snapshot.name, name, MAX_FILE_NAME_SIZE-1);
+
+	int status = remote_call(&req, sizeof(req.type) + sizeof(req.body.snapshot),
+				  &res, sizeof(res));
+
+	// format response
+	if (status < 0 || res.status != RES_OK)
+		return STAT_ERROR;
+
+	return STAT_OK;
+}
+
+
+snfs_call_status_t snfs_fallocate(snfs_fhandle_t fhandle, unsigned offset,
+   unsigned len, unsigned flags, unsigned* fsize)
+{
+	snfs_msg_req_t req;
+	snfs_msg_res_t res;
+
+	memset(&req, 0, sizeof(req));
+	memset(&res, 0, sizeof(res));
+
+	// format request
+	req.type = REQ_FALLOCATE;
+	req.body.fallocate.fhandle = fhandle;
+	req.body.fallocate.offset = offset;
+	req.body.fallocate.len = len;
+	req.body.fallocate.flags = flags;
+
+	int status = remote_call(&req, sizeof(req.type) + sizeof(req.body.fallocate),
+				  &res, sizeof(res));
+
+	// format response
+	if (status < 0 || res.status != RES_OK)
+		return STAT_ERROR;
+
+	*fsize = res.body.fallocate.fsize;
+	return STAT_OK;
+}
+
+
+snfs_call_status_t snfs_truncate(snfs_fhandle_t fhandle, unsigned size)
+{
+	snfs_msg_req_t req;
+	snfs_msg_res_t res;
+
+	memset(&req, 0, sizeof(req));
+	memset(&res, 0, sizeof(res));
+
+	// format request
+	req.type = REQ_TRUNCATE;
+	req.body.truncate.fhandle = fhandle;
+	req.body.truncate.size = size;
+
+	int status = remote_call(&req, sizeof(req.type) + sizeof(req.body.truncate),
+				  &res, sizeof(res));
+
+	// format response
+	if (status < 0 || res.status != RES_OK)
+		return STAT_ERROR;
+
+	return STAT_OK;
+}
+
+
+snfs_call_status_t snfs_punchhole(snfs_fhandle_t fhandle, unsigned offset,
+   unsigned len)
+{
+	snfs_msg_req_t req;
+	snfs_msg_res_t res;
+
+	memset(&req, 0, sizeof(req));
+	memset(&res, 0, sizeof(res));
+
+	// format request
+	req.type = REQ_PUNCHHOLE;
+	req.body.punchhole.fhandle = fhandle;
+	req.body.punchhole.offset = offset;
+	req.body.punchhole.len = len;
+
+	int status = remote_call(&req, sizeof(req.type) + sizeof(req.body.punchhole),
+				  &res, sizeof(res));
+
+	// format response
+	if (status < 0 || res.status != RES_OK)
+		return STAT_ERROR;
+
+	return STAT_OK;
+}
+
+
+snfs_call_status_t snfs_create_batch(snfs_fhandle_t dir, char** names,
+   unsigned count, snfs_fhandle_t* files)
+{
+	snfs_msg_req_t req;
+	snfs_msg_res_t res;
+
+	if (count > MAX_CREATE_BATCH)
+		return STAT_ERROR;
+
+	memset(&req, 0, sizeof(req));
+	memset(&res, 0, sizeof(res));
+
+	// format request, sending only the names used
+	req.type = REQ_CREATE_BATCH;
+	req.body.create_batch.dir = dir;
+	req.body.create_batch.count = count;
+	for (unsigned i = 0; i < count; i++)
+		strncpy(req.body.create_batch.names[i], names[i], MAX_FILE_NAME_SIZE-1);
+
+	int status = remote_call(&req, sizeof(req.type) +
+				  sizeof(req.body.create_batch) -
+				  sizeof(req.body.create_batch.names) +
+				  count * MAX_FILE_NAME_SIZE, &res, sizeof(res));
+
+	// format response
+	if (status < 0 || res.status != RES_OK || res.body.create_batch.count != count)
+		return STAT_ERROR;
+
+	memcpy(files, res.body.create_batch.files, count * sizeof(snfs_fhandle_t));
+	return STAT_OK;
+}
+
+
+snfs_call_status_t snfs_rename(snfs_fhandle_t src_dir, char* src_name,
+   snfs_fhandle_t dst_dir, char* dst_name, snfs_fhandle_t* file)
+{
+	snfs_msg_req_t req;
+	snfs_msg_res_t res;
+
+	memset(&req, 0, sizeof(req));
+	memset(&res, 0, sizeof(res));
+
+	// format request
+	req.type = REQ_RENAME;
+	req.body.rename.src_dir = src_dir;
+	req.body.rename.dst_dir = dst_dir;
+	strncpy(req.body.rename.src_name, src_name, MAX_FILE_NAME_SIZE-1);
+	strncpy(req.body.rename.dst_name, dst_name, MAX_FILE_NAME_SIZE-1);
+
+	int status = remote_call(&req, sizeof(req.type) + sizeof(req.body.rename),
+				  &res, sizeof(res));
+
+	// format response
+	if (status < 0 || res.status != RES_OK)
+		return STAT_ERROR;
+
+	*file = res.body.rename.file;
+	return STAT_OK;
+}
+
+
+snfs_call_status_t snfs_link(snfs_fhandle_t src_dir, char* src_name,
+   snfs_fhandle_t dst_dir, char* dst_name, snfs_fhandle_t* file)
+{
+	snfs_msg_req_t req;
+	snfs_msg_res_t res;
+
+	memset(&req, 0, sizeof(req));
+	memset(&res, 0, sizeof(res));
+
+	// format request
+	req.type = REQ_LINK;
+	req.body.link.src_dir = src_dir;
+	req.body.link.dst_dir = dst_dir;
+	strncpy(req.body.link.src_name, src_name, MAX_FILE_NAME_SIZE-1);
+	strncpy(req.body.link.dst_name, dst_name, MAX_FILE_NAME_SIZE-1);
+
+	int status = remote_call(&req, sizeof(req.type) + sizeof(req.body.link),
+				  &res, sizeof(res));
+
+	// format response
+	if (status < 0 || res.status != RES_OK)
+		return STAT_ERROR;
+
+	*file = res.body.link.file;
+	return STAT_OK;
 }
 
 
@@ -4,10 +4,14 @@
  * block.c
  *
  * Storage layer which offers the abstraction of a sequence of 
- * blocks of fixed size. Blocks are kept in memory.
+ * blocks of fixed size. Blocks are kept in memory, or in an image file
+ * (see block_open) read and written a block at a time.
  * 
  */
 
+// pread, pwrite and ftruncate
+#define _XOPEN_SOURCE 500
+
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -25,9 +29,16 @@ void io_delay_write_block();
 struct blocks_ {
    unsigned block_size;
    unsigned num_blocks;
+   int fd;              // the image file, -1 if the blocks are in memory
    char blocks[0];
 };
 
+// an image starts with the block size and the number of blocks
+#define IMAGE_HEADER_SZ (2 * sizeof(unsigned))
+
+#define IMAGE_OFFSET(bks,no) \
+   (IMAGE_HEADER_SZ + (off_t)(no) * (bks)->block_size)
+
 
 blocks_t* block_new(unsigned num_blocks, unsigned block_sz)
 {
@@ -38,13 +49,98 @@ blocks_t* block_new(unsigned num_blocks, unsigned block_sz)
       malloc(sizeof(blocks_t) + num_blocks * block_sz);
    bks->block_size = block_sz;
    bks->num_blocks = num_blocks;
+   bks->fd = -1;
    memset(&bks->blocks[0], 0, num_blocks * block_sz);
    return bks;
 }
 
 
+static int block_write_header(blocks_t* bks, int fd)
+{
+   unsigned header[2] = { bks->block_size, bks->num_blocks };
+   if (pwrite(fd, header, IMAGE_HEADER_SZ, 0) != IMAGE_HEADER_SZ) {
+      return -1;
+   }
+   return 0;
+}
+
+
+blocks_t* block_create(char* file, unsigned num_blocks, unsigned block_sz)
+{
+   if (file == NULL || num_blocks * block_sz == 0) {
+      return NULL;
+   }
+
+   int fd = open(file, O_RDWR|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+   if (fd < 0) {
+      return NULL;
+   }
+
+   blocks_t* bks = (blocks_t*) malloc(sizeof(blocks_t));
+   bks->block_size = block_sz;
+   bks->num_blocks = num_blocks;
+   bks->fd = fd;
+   if (block_write_header(bks, fd) < 0 ||
+      ftruncate(fd, IMAGE_OFFSET(bks, num_blocks)) < 0) {
+      close(fd);
+      free(bks);
+      return NULL;
+   }
+   return bks;
+}
+
+
+blocks_t* block_open(char* file)
+{
+   if (file == NULL) {
+      return NULL;
+   }
+
+   int fd = open(file, O_RDWR);
+   if (fd < 0) {
+      return NULL;
+   }
+
+   unsigned header[2];
+   struct stat st;
+   blocks_t* bks = (blocks_t*) malloc(sizeof(blocks_t));
+   bks->fd = fd;
+   if (pread(fd, header, IMAGE_HEADER_SZ, 0) != IMAGE_HEADER_SZ ||
+      fstat(fd, &st) < 0) {
+      block_free(bks);
+      return NULL;
+   }
+   bks->block_size = header[0];
+   bks->num_blocks = header[1];
+   if (bks->block_size * bks->num_blocks == 0 ||
+      st.st_size < IMAGE_OFFSET(bks, bks->num_blocks)) {
+      block_free(bks);
+      return NULL;
+   }
+   return bks;
+}
+
+
+int block_set_size(blocks_t* bks, unsigned block_sz)
+{
+   unsigned num_blocks = bks->num_blocks * bks->block_size / block_sz;
+   if (num_blocks == 0) {
+      return -1;
+   }
+   bks->block_size = block_sz;
+   bks->num_blocks = num_blocks;
+   if (bks->fd >= 0 && block_write_header(bks, bks->fd) < 0) {
+      return -1;
+   }
+   return 0;
+}
+
+
 void block_free(blocks_t* bks)
 {
+   if (bks != NULL && bks->fd >= 0) {
+      close(bks->fd);
+   }
    free(bks);
 }
 
@@ -68,6 +164,13 @@ int block_read(blocks_t* bks, unsigned block_no, char* block)
    }
  
    io_delay_read_block();
+   if (bks->fd >= 0) {
+      if (pread(bks->fd, block, bks->block_size,
+         IMAGE_OFFSET(bks, block_no)) != bks->block_size) {
+         return -1;
+      }
+      return 0;
+   }
    char* ptr = &bks->blocks[block_no * bks->block_size]; 
    memcpy(block,ptr,bks->block_size);
    return 0;
@@ -82,6 +185,13 @@ int block_write(blocks_t* bks, unsigned block_no, char* block)
 
 
    io_delay_write_block();
+   if (bks->fd >= 0) {
+      if (pwrite(bks->fd, block, bks->block_size,
+         IMAGE_OFFSET(bks, block_no)) != bks->block_size) {
+         return -1;
+      }
+      return 0;
+   }
    char* ptr = &bks->blocks[block_no * bks->block_size]; 
    memcpy(ptr,block,bks->block_size);
    return 0;
@@ -125,13 +235,15 @@ blocks_t* block_load(char* file)
    }
    bks->block_size = block_size;
    bks->num_blocks = num_blocks;
+   bks->fd = -1;
+   close(fd);
    return bks;
 }
 
 
 int block_store(blocks_t* bks, char* file)
 {
-   if (bks == NULL && file == NULL) {
+   if (bks == NULL || file == NULL) {
       return -1;
    }
 
@@ -140,14 +252,30 @@ int block_store(blocks_t* bks, char* file)
       return -1;
    }
 
-   unsigned size = sizeof(blocks_t) + bks->block_size * bks->num_blocks;
-
-   int status = write(fd, (char*)bks, size);
-   if (status != size) {
+   if (block_write_header(bks, fd) < 0) {
       close(fd);
       return -1;
    }
 
+   // an image file is copied a block at a time
+   char block[bks->block_size];
+   for (unsigned i = 0; i < bks->num_blocks; i++) {
+      char* ptr = &bks->blocks[i * bks->block_size];
+      if (bks->fd >= 0) {
+         ptr = block;
+         if (pread(bks->fd, block, bks->block_size,
+            IMAGE_OFFSET(bks, i)) != bks->block_size) {
+            close(fd);
+            return -1;
+         }
+      }
+      if (pwrite(fd, ptr, bks->block_size, IMAGE_OFFSET(bks, i)) !=
+         bks->block_size) {
+         close(fd);
+         return -1;
+      }
+   }
+
    close(fd);
    return 0;
 }
@@ -29,7 +29,36 @@ blocks_t* block_new(unsigned block_sz, unsigned num_blocks);
 
 
 /*
- * block_free: free the blocks
+ * block_create: create a blocks instance kept in an image file, whose
+ * blocks are read and written in place (see block_store for the format)
+ * - file: the name of the file, emptied if it exists
+ * - num_blocks: number of blocks
+ * - block_sz: the size of blocks
+ *   returns: the blocks instance or NULL if error
+ */
+blocks_t* block_create(char* file, unsigned num_blocks, unsigned block_sz);
+
+
+/*
+ * block_open: open an image file as a blocks instance, without reading
+ * its blocks
+ * - file: the name of the file
+ *   returns: the blocks instance or NULL if error
+ */
+blocks_t* block_open(char* file);
+
+
+/*
+ * block_set_size: cut the same storage into blocks of another size
+ * - bks: the blocks instance
+ * - block_sz: the new size of blocks
+ *   returns: 0 if sucessful, -1 if not
+ */
+int block_set_size(blocks_t* bks, unsigned block_sz);
+
+
+/*
+ * block_free: free the blocks, closing the image file if any
  * - bks - the blocks to free
  */
 void block_free(blocks_t* bks);
@@ -76,7 +105,8 @@ blocks_t* block_load(char* file);
 
 
 /*
- * block_store: store an image of blocks to a file
+ * block_store: store an image of blocks to a file: the block size and
+ * the number of blocks, as unsigned integers, followed by the blocks
  * - bks - the blocks instance
  * - file: the name of the file
  *   returns: 0 if sucessful, -1 if not
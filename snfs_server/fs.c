@@ -14,36 +14,133 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <sthread.h>
 #include "fs.h"
 
 
 #define dprintf if(1) printf
 
-#define BLOCK_SIZE 512
+/*
+ * Block size
+ * - chosen when formatting, between FS_MIN_BLOCK_SIZE and FS_MAX_BLOCK_SIZE
+ *   (see fs.h), and recorded in the superblock; the layouts below derive
+ *   from it at run time, so the macros need the file system in 'fs'
+ * - block buffers are kept on the stack as arrays of BLOCK_SIZE bytes; the
+ *   page types below are sized for the largest block and only used through
+ *   pointers to such buffers (FS_BLOCK_BUF)
+ */
+
+#define BLOCK_SIZE (fs->sb.block_size)
+
+#define FS_BLOCK_BUF(type,name) \
+   unsigned int name##_buf[BLOCK_SIZE / sizeof(unsigned int)]; \
+   type* name = (type*)name##_buf
 
 /*
  * Inode
- * - inode size = 64 bytes
+ * - inode size = 128 bytes
  * - num of direct block refs = 10 blocks
+ * - one single-indirect block (EXT_INODE_NUM_BLKS refs)
+ * - one double-indirect block (EXT_INODE_NUM_BLKS^2 refs)
+ * - the last block of a file may be packed as a tail (see Tail packing)
  */
 
 #define INODE_NUM_BLKS 10
 
 #define EXT_INODE_NUM_BLKS (BLOCK_SIZE / sizeof(unsigned int))
 
+// slots of 'reserved' holding the extending tables
+#define INODE_IND 0
+#define INODE_DIND 1
+
+// slot of 'reserved' holding the inode of a directory index
+#define INODE_DIDX 2
+
+// slot of 'reserved' holding the inode flags
+#define INODE_FLAGS 3
+
+// tiny files keep their data in place of the block pointers
+#define INODE_F_INLINE 0x1
+#define INODE_INLINE_SZ (INODE_NUM_BLKS * sizeof(unsigned int))
+#define INODE_INLINE(inode) ((inode)->reserved[INODE_FLAGS] & INODE_F_INLINE)
+
+// maximum number of blocks that can be mapped by one inode
+#define INODE_MAX_BLKS (INODE_NUM_BLKS + EXT_INODE_NUM_BLKS + \
+   EXT_INODE_NUM_BLKS * EXT_INODE_NUM_BLKS)
+
 typedef struct fs_inode {
    fs_itype_t type;
    unsigned int size;
    unsigned int blocks[INODE_NUM_BLKS];
-   unsigned int reserved[4]; // reserved[0] -> extending table block number
+   unsigned int reserved[4]; // reserved[0] -> single-indirect table block
+                             // reserved[1] -> double-indirect table block
+                             // reserved[2] -> directory index inode
+                             // reserved[3] -> flags
+   inodeid_t parent;         // directory holding the inode (0 -> none),
+                             // for a file with several names the one its
+                             // blocks count for (see fs_link)
+   unsigned int nblocks;     // blocks used by the inode (data and tables)
+   unsigned int tree_blocks; // blocks used by a directory and its subtree
+   unsigned int prealloc;    // blocks up to this one may be allocated past
+                             // the size of a file (0 -> none)
+   unsigned int tail;        // fragment block holding the tail (0 -> none)
+   unsigned int tail_frag;   // first fragment of the tail in that block
+   unsigned int links;       // names of a file beyond the first
+   unsigned int unused[9];
 } fs_inode_t;
 
 typedef unsigned int fs_inode_ext_t;
 
 
+/*
+ * Tail packing
+ * - the last block of a file, when its data fits in TAIL_MAX_FRAGS
+ *   fragments, may be packed along with the tails of other files in a
+ *   fragment block, as the delay buffer holding it is flushed; the block
+ *   is left unmapped and the inode refers to the fragments instead
+ * - fragments are never rewritten: a tail gets a block of its own again
+ *   (it is unpacked) before the file is changed there, and the fragment
+ *   blocks are filled one after the other, the one being filled being
+ *   recorded in the superblock
+ * - each tail holds a reference to its fragment block, and so does the
+ *   superblock while filling it (see the block reference counts), so
+ *   copies and snapshots share tails like blocks, and a fragment block
+ *   is freed with its last tail
+ * - fragment blocks are read through the indirect block cache, so the
+ *   tails of files packed together are read from one cached block
+ */
+
+#define FRAG_SIZE (FS_MIN_BLOCK_SIZE / 8)
+
+#define FRAGS_PER_BLOCK (BLOCK_SIZE / FRAG_SIZE)
+
+#define FRAGS_OF(bytes) (((bytes) + FRAG_SIZE - 1) / FRAG_SIZE)
+
+#define TAIL_MAX_FRAGS (FRAGS_PER_BLOCK * 3 / 4)
+
+#define INODE_TAIL(inode) ((inode)->tail != 0)
+
+
+/*
+ * Indirect block cache
+ * - small write-through cache of extending tables (and of fragment
+ *   blocks), so that sequential accesses do not read the same mapping
+ *   block on every request
+ * - replacement is LRU, based on a logical access clock
+ */
+
+#define ICACHE_SIZE 16
+
+typedef struct fs_icache {
+   unsigned int blkno;    // cached block number (0 -> free entry)
+   unsigned int stamp;    // last access time
+   fs_inode_ext_t* refs;  // one block, allocated on first use
+} fs_icache_t;
+
+
 /*
  * Directory entry
- * - directory entry size = 16 bytes
+ * - directory entry size = 20 bytes
  * - filename max size - 14 bytes (13 chars + '\0') defined in fs.h
  */
 
@@ -54,69 +151,331 @@ typedef struct dentry {
    inodeid_t inodeid;
 } fs_dentry_t;
 
+// directory page: the entries of a directory block (the space left at the
+// end of the block is not used)
+typedef union dpage {
+   fs_dentry_t entry[FS_MAX_BLOCK_SIZE / sizeof(fs_dentry_t)];
+   char data[FS_MAX_BLOCK_SIZE];
+} fs_dpage_t;
+
 
 /*
- * File syste structure
- * - inode table size = 64 entries (8 blocks)
- * 
- * Internal organization 
- *   - block 0        - free block bitmap
- *   - block 1        - free inode bitmap
- *   - block 2-9      - inode table (8 blocks)
- *   - block 10-(N-1) - data blocks, where N is the number of blocks
+ * Directory index
+ * - directories with more than DIR_INDEX_MIN entries get an index, kept
+ *   in a hidden inode (of type FS_DIR_INDEX) referenced by the directory
+ *   inode
+ * - the index is a B+tree of the entries keyed by name, whose nodes are
+ *   the blocks of the index inode, node 0 being the root: the leaves hold
+ *   the name, position and inode of the entries and are chained in name
+ *   order; the inner nodes hold the first name under each child (not
+ *   used for the first child)
+ * - a lookup, insert or removal reads one node per level, and the
+ *   directory is listed in name order along the leaves, resuming after
+ *   the last name listed
+ * - removals leave the emptied nodes in the tree, which is built again
+ *   once it gets sparse
  */
 
-#define ITAB_NUM_BLKS 8
+#define FS_DIR_INDEX 3
 
-#define ITAB_SIZE (ITAB_NUM_BLKS*BLOCK_SIZE / sizeof(fs_inode_t))
+#define DIR_INDEX_MIN (2 * DIR_PAGE_ENTRIES)
+
+typedef struct didx_entry {
+   char name[FS_MAX_FNAME_SZ];
+   unsigned int pos;  // leaf: position of the entry; inner node: child
+   inodeid_t ino;     // leaf: inode of the entry
+} fs_didx_entry_t;
+
+typedef struct didx_node {
+   unsigned short leaf;   // 1 -> leaf node
+   unsigned short count;  // entries used
+   unsigned int next;     // leaf: the next leaf (0 -> none)
+   fs_didx_entry_t entry[(FS_MAX_BLOCK_SIZE - 8) / sizeof(fs_didx_entry_t)];
+} fs_didx_node_t;
+
+#define DIDX_NODE_ENTRIES ((BLOCK_SIZE - 8) / sizeof(fs_didx_entry_t))
+
+// nodes filled when the index is built, leaving room for inserts
+#define DIDX_FILL (DIDX_NODE_ENTRIES * 3 / 4)
+
+// maximum height of the tree, far above what the file system can hold
+#define DIDX_MAX_DEPTH 16
 
-struct fs_ {
-   blocks_t* blocks;
-   char inode_bmap [BLOCK_SIZE];
-   char blk_bmap [BLOCK_SIZE];
-   fs_inode_t inode_tab [ITAB_SIZE];
-};
 
-#define NOT_FS_INITIALIZER  1
-                               
 /*
- * Internal functions for loading/storing file system metadata do the blocks
+ * Dentry cache
+ * - maps (directory, name) to the inode of the entry, remembering also
+ *   the names known not to exist (negative entries), so that path
+ *   resolution does not read the directories on every request
+ * - entries are chained in buckets by hash and replaced in LRU order,
+ *   based on a logical access clock
  */
-                                
-                                
-static void fsi_load_fsdata(fs_t* fs)
-{
-   blocks_t* bks = fs->blocks;
-   
-   // load free block bitmap from block 0
-   block_read(bks,0,fs->blk_bmap);
 
-   // load free inode bitmap from block 1
-   block_read(bks,1,fs->inode_bmap);
-   
-   // load inode table from blocks 2-9
-   for (int i = 0; i < ITAB_NUM_BLKS; i++) {
-      block_read(bks,i+2,&((char*)fs->inode_tab)[i*BLOCK_SIZE]);
-   }
-#define NOT_FS_INITIALIZER  1  //file system is already initialized, subsequent block acess will be delayed using a sleep function.
-}
+#define DCACHE_SIZE 256
+#define DCACHE_BUCKETS 64
 
+typedef struct fs_dcache {
+   inodeid_t dir;         // parent directory (0 -> free entry)
+   inodeid_t ino;         // inode of the entry (0 -> negative entry)
+   unsigned int stamp;    // last access time
+   unsigned int next;     // next entry of the bucket + 1 (0 -> none)
+   char name[FS_MAX_FNAME_SZ];
+} fs_dcache_t;
 
-static void fsi_store_fsdata(fs_t* fs)
-{
-   blocks_t* bks = fs->blocks;
- 
-   // store free block bitmap to block 0
-   block_write(bks,0,fs->blk_bmap);
 
-   // store free inode bitmap to block 1
-   block_write(bks,1,fs->inode_bmap);
-   
-   // store inode table to blocks 2-9
-   for (int i = 0; i < ITAB_NUM_BLKS; i++) {
-      block_write(bks,i+2,&((char*)fs->inode_tab)[i*BLOCK_SIZE]);
-   }
-}
+/*
+ * Superblock
+ * - kept in block 0, records the geometry of the file system
+ * - the inode table and the free inode bitmap are metadata files: their
+ *   inodes live in the superblock and their blocks are allocated from the
+ *   data area on demand, so the inode table grows with the number of files
+ * - so are the block reference counts, created by the first copy
+ */
+
+#define FS_MAGIC 0x53464e53 // "SNFS"
+
+typedef struct fs_super {
+   unsigned int magic;
+   unsigned int block_size;
+   unsigned int num_blocks;
+   unsigned int bmap_start;   // first block of the free block bitmap
+   unsigned int bmap_blks;    // number of blocks of the free block bitmap
+   unsigned int num_inodes;   // current size of the inode table
+   unsigned int free_blocks;
+   unsigned int free_inodes;
+   fs_inode_t itab;           // inode of the inode table
+   fs_inode_t ibmap;          // inode of the free inode bitmap
+   fs_inode_t refs;           // inode of the block reference counts
+   inodeid_t snaps;           // inode of the snapshot records (0 -> none)
+   unsigned int frag_blk;     // fragment block being filled (0 -> none)
+   unsigned int frag_used;    // fragments used in it
+} fs_super_t;
+
+
+/*
+ * Block reference counts
+ * - copies of a file share its blocks (and extending tables); each block
+ *   records how many references it has besides the first one
+ * - a shared block is copied before being modified (copy-on-write) and
+ *   only freed when its last reference goes away
+ */
+
+typedef unsigned short fs_blk_refs_t;
+
+#define REFS_BLK_ENTRIES (BLOCK_SIZE / sizeof(fs_blk_refs_t))
+
+#define REFS_MAX 0xffff
+
+// blocks copied at a time when appending a file that cannot share blocks
+#define APPEND_BATCH_BLKS 32
+
+
+/*
+ * Delayed allocation
+ * - writes past the last block of a file are kept in a buffer of the
+ *   file, in memory, and get disk blocks only when the buffer is
+ *   flushed: the blocks of the whole buffer are then allocated in one
+ *   run, following the last block of the file when possible, so that
+ *   files written in small pieces come out as contiguous as files
+ *   written at once
+ * - the blocks of a buffer (and the extending tables they may need) are
+ *   reserved as it grows, so that the flush never runs out of space; a
+ *   write that cannot reserve them is done on the disk
+ * - the blocks of a buffer count for the disk usage of the file and of
+ *   the directories above it, as if they were allocated
+ * - other allocations keep clear of the blocks that follow a file with a
+ *   buffer (its goal), while there is room elsewhere, so that the next
+ *   run of the file can go there
+ * - a buffer is flushed when it gets full, when it is the least recently
+ *   written one and another file needs a buffer, before the file is used
+ *   by anything but reads and further appending writes, and by fs_flush
+ * - the inode table on the disk keeps the size of the file before the
+ *   buffer, so that a file system left with a buffer not flushed has no
+ *   data past the blocks written
+ * - a short last block of the file is packed as a tail when flushed,
+ *   unless the file is about to be changed there; the tail is packed
+ *   before the blocks are given back, so that a fragment block taken
+ *   for it never leaves the other blocks short
+ */
+
+#define DELAY_FILES 8
+
+#define DELAY_MAX_BLKS 64
+
+// extending tables that the blocks of a buffer may need, allocated or
+// copied from a snapshot: a run of DELAY_MAX_BLKS goes through at most
+// the indirect and double-indirect tables and two tables below them
+#define DELAY_TABLE_BLKS 4
+
+typedef struct fs_delay {
+   inodeid_t ino;         // file of the buffer (0 -> free buffer)
+   unsigned int first;    // first block of the file held
+   unsigned int size;     // size of the file on the disk
+   unsigned int nblks;    // number of blocks held
+   unsigned int reserved; // blocks reserved for the flush
+   unsigned int goal;     // block following the file (0 -> none)
+   unsigned int stamp;    // last write time
+   char* data;            // DELAY_MAX_BLKS blocks
+} fs_delay_t;
+
+
+/*
+ * Snapshots
+ * - a snapshot is a read-only image of the whole file system: a copy of
+ *   the inodes of the inode table and of the free inode bitmap, taken
+ *   when every block of the file system gets one more reference, so that
+ *   the blocks are copied as the live file system writes them
+ * - each snapshot is recorded in one block of a hidden file (of type
+ *   FS_SNAPSHOTS), whose inode is referenced by the superblock
+ * - the inodes of snapshot 's' are reached through ids holding s + 1 in
+ *   the bits above FS_SNAP_SHIFT; the entries of a directory of a
+ *   snapshot are given the bits of the directory
+ */
+
+#define FS_SNAPSHOTS 4
+
+#define FS_MAX_SNAPSHOTS 16
+
+#define FS_SNAP_SHIFT 24
+#define FS_SNAP_INO_MASK ((1u << FS_SNAP_SHIFT) - 1)
+
+// snapshot of an inode id (0 -> live file system)
+#define FS_SNAP_OF(id) ((id) >> FS_SNAP_SHIFT)
+#define FS_SNAP_INO(id) ((id) & FS_SNAP_INO_MASK)
+
+// id of inode 'ino' of the snapshot (or live file system) of 'dir'
+#define FS_SNAP_CHILD(dir,ino) (((dir) & ~FS_SNAP_INO_MASK) | (ino))
+
+// id of the root directory of snapshot 's'
+#define FS_SNAP_ROOT(s) ((((s) + 1) << FS_SNAP_SHIFT) | 1)
+
+typedef struct fs_snap_rec {
+   char name[FS_MAX_FNAME_SZ];  // "" -> free slot
+   unsigned int num_inodes;
+   fs_inode_t itab;             // inode of the inode table
+   fs_inode_t ibmap;            // inode of the free inode bitmap
+} fs_snap_rec_t;
+
+typedef union snap_page {
+   fs_snap_rec_t rec;
+   char data[FS_MAX_BLOCK_SIZE];
+} fs_snap_page_t;
+
+// a snapshot in memory; the inode table is loaded on demand
+typedef struct fs_snap {
+   fs_snap_rec_t rec;
+   fs_inode_t** inode_tab;      // one chunk per block of the inode table
+   char* inode_bmap;            // rec.ibmap.size bytes
+} fs_snap_t;
+
+
+/*
+ * Concurrency
+ * - the data of a file and the entries of a directory are protected by a
+ *   reader-writer lock of the inode; the locks are striped, inode 'ino'
+ *   uses lock 'ino % FS_LOCK_STRIPES', so reads of any files (and of the
+ *   same file) run in parallel, while writes exclude everything else on
+ *   the inode
+ * - meta_lock protects the in-memory metadata: the inode table, the free
+ *   inode bitmap and the caches of extending tables and directory
+ *   entries; it is held to map blocks and to change directories, but the
+ *   data blocks of files are read and written without it
+ * - alloc_lock protects the block allocator: the free block bitmap, the
+ *   block reference counts and the free block counter
+ * - the delay buffers are protected by meta_lock, and a buffer is
+ *   flushed at once under it, so that reads find the data either in the
+ *   buffer or on the disk
+ *
+ * Lock order: inode locks, by increasing stripe, then meta_lock, then
+ * alloc_lock. Operations on several inodes (copy, append, remove of a
+ * tree, and the like) take all their inode locks at once with
+ * fsi_lock_set, after finding the inodes under meta_lock, and check
+ * again that the names still lead to the same inodes once locked.
+ */
+
+#define FS_LOCK_STRIPES 64
+
+// set of inode locks, one bit per stripe
+typedef unsigned long long fs_lockset_t;
+
+#define FS_LOCK_BIT(ino) (1ULL << ((ino) % FS_LOCK_STRIPES))
+
+typedef struct fs_rwlock {
+   sthread_mon_t mon;
+   int readers;     // readers holding the lock
+   int writer;      // a writer holds the lock
+   int waiting;     // writers waiting for the lock
+} fs_rwlock_t;
+
+
+/*
+ * Free extent tree
+ * - a tree over the free block bitmap, kept in memory, that finds the
+ *   first run of free blocks of any length in O(log n): each node covers
+ *   a power-of-two range of blocks and records the free blocks at the
+ *   start and at the end of the range and its longest free run
+ * - built from the bitmap when the file system is loaded and updated
+ *   with the bitmap, under alloc_lock, along with the number of runs of
+ *   free blocks (the free extents)
+ * - the leaves past the last block count as used
+ */
+
+typedef struct fs_extent_node {
+   unsigned int head;   // free blocks at the start of the range
+   unsigned int tail;   // free blocks at the end of the range
+   unsigned int run;    // longest run of free blocks in the range
+} fs_extent_node_t;
+
+
+/*
+ * File system structure
+ * 
+ * Internal organization 
+ *   - block 0        - superblock
+ *   - block 1-B      - free block bitmap (B depends on the number of blocks)
+ *   - block B-(N-1)  - data blocks (including the inode table and the free
+ *                      inode bitmap), where N is the number of blocks
+ *
+ * In memory, the inode table is kept in chunks of one block, loaded on
+ * first access, and the free block and inode bitmaps are loaded on first
+ * use, so mounting an image reads little more than the superblock; only
+ * the metadata blocks marked as dirty are written back.
+ */
+
+#define ITAB_BLK_INODES (BLOCK_SIZE / sizeof(fs_inode_t))
+
+#define BMAP_BLK_BITS (BLOCK_SIZE * 8)
+
+struct fs_ {
+   blocks_t* blocks;
+   fs_super_t sb;
+   int sb_dirty;
+   char* blk_bmap;             // sb.bmap_blks blocks
+   char* blk_bmap_dirty;       // one flag per block of the bitmap
+   fs_extent_node_t* free_tree; // 2 * free_leaves nodes, node 1 the root
+   unsigned int free_leaves;   // leaves of free_tree, a power of two
+   unsigned int free_extents;  // runs of free blocks
+   fs_blk_refs_t* blk_refs;    // NULL if no block was ever shared
+   char* blk_refs_dirty;       // one flag per block of the counts
+   char* inode_bmap;           // sb.ibmap.size bytes
+   char* inode_bmap_dirty;     // one flag per block of the bitmap
+   fs_inode_t** inode_tab;     // one chunk per block of the inode table
+   char* inode_tab_dirty;      // one flag per block of the inode table
+   unsigned int itab_chunks;   // number of chunk slots in inode_tab
+   unsigned int inode_hint;    // no free inodes below this one
+   fs_icache_t icache [ICACHE_SIZE];
+   unsigned int icache_clock;
+   fs_dcache_t dcache [DCACHE_SIZE];
+   unsigned int dcache_bucket [DCACHE_BUCKETS]; // first entry + 1
+   unsigned int dcache_clock;
+   fs_snap_t snaps [FS_MAX_SNAPSHOTS];
+   fs_delay_t delay [DELAY_FILES];
+   unsigned int delay_reserved; // blocks reserved by the delay buffers
+   unsigned int delay_clock;
+   fs_rwlock_t locks [FS_LOCK_STRIPES];
+   sthread_mutex_t meta_lock;
+   sthread_mutex_t alloc_lock;
+};
 
 
 /*
@@ -165,744 +524,5977 @@ static void fsi_dump_bmap(char* bmap, int size)
 #define OFFSET_TO_BLOCKS(pos) ((pos)/BLOCK_SIZE+(((pos)%BLOCK_SIZE>0)?1:0))
 
                                 
-static void fsi_inode_init(fs_inode_t* inode, fs_itype_t type)
+static void fsi_inode_init(fs_inode_t* inode, fs_itype_t type,
+   inodeid_t parent)
 {
-   int i;
-   
+   memset(inode,0,sizeof(fs_inode_t));
    inode->type = type;
-   inode->size = 0;
-   for (i = 0; i < INODE_NUM_BLKS; i++) {
-      inode->blocks[i] = 0;
-   }
-   
-   for (i = 0; i < 4; i++) {
-	   inode->reserved[i] = 0;
-   }
-}
-
-
-static int fsi_dir_search(fs_t* fs, inodeid_t dir, char* file, 
-   inodeid_t* fileid)
-{
-   fs_dentry_t page[DIR_PAGE_ENTRIES];
-   fs_inode_t* idir = &fs->inode_tab[dir];
-   int num = idir->size / sizeof(fs_dentry_t);
-   int iblock = 0;
+   inode->parent = parent;
 
-   while (num > 0) {
-      block_read(fs->blocks,idir->blocks[iblock++],(char*)page);
-      for (int i = 0; i < DIR_PAGE_ENTRIES && num > 0; i++, num--) {
-         if (strcmp(page[i].name,file) == 0) {
-            *fileid = page[i].inodeid;
-            return 0;
-         }
-      }
+   // files start inline and get blocks when they outgrow the inode
+   if (type == FS_FILE) {
+      inode->reserved[INODE_FLAGS] = INODE_F_INLINE;
    }
-   return -1;
 }
 
 
 /*
- * File system interface functions
+ * Locking functions
  */
 
-
-void io_delay_on(int disk_delay);
-
-fs_t* fs_new(unsigned num_blocks, int disk_delay)
+static void fsi_locks_init(fs_t* fs)
 {
-   fs_t* fs = (fs_t*) malloc(sizeof(fs_t));
-   fs->blocks = block_new(num_blocks,BLOCK_SIZE);
-   fsi_load_fsdata(fs);
-   io_delay_on(disk_delay);
-   return fs;
+   for (int i = 0; i < FS_LOCK_STRIPES; i++) {
+      fs->locks[i].mon = sthread_monitor_init();
+   }
+   fs->meta_lock = sthread_mutex_init();
+   fs->alloc_lock = sthread_mutex_init();
 }
 
 
-int fs_format(fs_t* fs)
+static void fsi_locks_free(fs_t* fs)
 {
-   if (fs == NULL) {
-      printf("[fs] argument is null.\n");
-      return -1;
+   for (int i = 0; i < FS_LOCK_STRIPES; i++) {
+      sthread_monitor_free(fs->locks[i].mon);
    }
+   sthread_mutex_free(fs->meta_lock);
+   sthread_mutex_free(fs->alloc_lock);
+}
 
-   // erase all blocks
-   char null_block[BLOCK_SIZE];
-   memset(null_block,0,sizeof(null_block));
-   for (int i = 0; i < block_num_blocks(fs->blocks); i++) {
-      block_write(fs->blocks,i,null_block);
-   }
 
-   // reserve file system meta data blocks
-   BMAP_SET(fs->blk_bmap,0);
-   BMAP_SET(fs->blk_bmap,1);
-   for (int i = 0; i < ITAB_NUM_BLKS; i++) {
-      BMAP_SET(fs->blk_bmap,i+2);
+// writers waiting for the lock keep new readers out, so they get in
+static void fsi_rwlock_rd(fs_rwlock_t* lock)
+{
+   sthread_monitor_enter(lock->mon);
+   while (lock->writer || lock->waiting > 0) {
+      sthread_monitor_wait(lock->mon);
    }
-
-   // reserve inodes 0 (will never be used) and 1 (the root)
-   BMAP_SET(fs->inode_bmap,0);
-   BMAP_SET(fs->inode_bmap,1);
-   fsi_inode_init(&fs->inode_tab[1],FS_DIR);
-
-   // save the file system metadata
-   fsi_store_fsdata(fs);
-   return 0;
+   lock->readers++;
+   sthread_monitor_exit(lock->mon);
 }
 
 
-
-int fs_get_attrs(fs_t* fs, inodeid_t file, fs_file_attrs_t* attrs)
+static void fsi_rwlock_wr(fs_rwlock_t* lock)
 {
-   if (fs == NULL || file >= ITAB_SIZE || attrs == NULL) {
-      dprintf("[fs_get_attrs] malformed arguments.\n");
-      return -1;
+   sthread_monitor_enter(lock->mon);
+   lock->waiting++;
+   while (lock->writer || lock->readers > 0) {
+      sthread_monitor_wait(lock->mon);
    }
+   lock->waiting--;
+   lock->writer = 1;
+   sthread_monitor_exit(lock->mon);
+}
 
-   if (!BMAP_ISSET(fs->inode_bmap,file)) {
-      dprintf("[fs_get_attrs] inode is not being used.\n");
-      return -1;
-   }
 
-   fs_inode_t* inode = &fs->inode_tab[file];
-   attrs->inodeid = file;
-   attrs->type = inode->type;
-   attrs->size = inode->size;
-   switch (inode->type) {
-      case FS_DIR:
-         attrs->num_entries = inode->size / sizeof(fs_dentry_t);
-         break;
-      case FS_FILE:
-         attrs->num_entries = -1;
-         break;
-      default:
-         dprintf("[fs_get_attrs] fatal error - invalid inode.\n");
-         exit(-1);
+static void fsi_rwlock_unlock(fs_rwlock_t* lock)
+{
+   sthread_monitor_enter(lock->mon);
+   if (lock->writer) {
+      lock->writer = 0;
+   } else {
+      lock->readers--;
    }
-   return 0;
+   sthread_monitor_signalall(lock->mon);
+   sthread_monitor_exit(lock->mon);
 }
 
 
-int fs_lookup(fs_t* fs, char* file, inodeid_t* fileid)
+/*
+ * fsi_lock_set: takes the inode locks of a set, in increasing stripe
+ * order; a stripe in both sets is taken for writing
+ * - rd: the stripes to take for reading
+ * - wr: the stripes to take for writing
+ */
+static void fsi_lock_set(fs_t* fs, fs_lockset_t rd, fs_lockset_t wr)
 {
-
-char *token;
-char line[MAX_PATH_NAME_SIZE]; 
-char *search = "/";
-int i=0;
-int dir=0;
-   if (fs==NULL || file==NULL ) {
-      dprintf("[fs_lookup] malformed arguments.\n");
-      return -1;
+   for (int i = 0; i < FS_LOCK_STRIPES; i++) {
+      if (wr & (1ULL << i)) {
+         fsi_rwlock_wr(&fs->locks[i]);
+      } else if (rd & (1ULL << i)) {
+         fsi_rwlock_rd(&fs->locks[i]);
+      }
    }
+}
 
 
-    if(file[0] != '/') {
-        dprintf("[fs_lookup] malformed pathname.\n");
-        return -1;
-    }
-
-    strcpy(line,file);
-    token = strtok(line, search);
-    
-   while(token != NULL) {
-     i++;
-     if(i==1) dir=1;  //Root directory
-     
-     if (!BMAP_ISSET(fs->inode_bmap,dir)) {
-	      dprintf("[fs_lookup] inode is not being used.\n");
-	      return -1;
-     }
-     fs_inode_t* idir = &fs->inode_tab[dir];
-     if (idir->type != FS_DIR) {
-        dprintf("[fs_lookup] inode is not a directory.\n");
-        return -1;
-     }
-     inodeid_t fid;
-     if (fsi_dir_search(fs,dir,token,&fid) < 0) {
-        dprintf("[fs_lookup] file does not exist.\n");
-        return 0;
-     }
-     *fileid = fid;
-     dir=fid;
-     token = strtok(NULL, search);
+static void fsi_unlock_set(fs_t* fs, fs_lockset_t rd, fs_lockset_t wr)
+{
+   for (int i = 0; i < FS_LOCK_STRIPES; i++) {
+      if ((rd | wr) & (1ULL << i)) {
+         fsi_rwlock_unlock(&fs->locks[i]);
+      }
    }
-
-   return 1;
 }
 
 
-int fs_read(fs_t* fs, inodeid_t file, unsigned offset, unsigned count, 
-   char* buffer, int* nread)
+static void fsi_meta_lock(fs_t* fs)
 {
-	if (fs==NULL || file >= ITAB_SIZE || buffer==NULL || nread==NULL) {
-		dprintf("[fs_read] malformed arguments.\n");
-		return -1;
-	}
+   sthread_mutex_lock(fs->meta_lock);
+}
 
-	if (!BMAP_ISSET(fs->inode_bmap,file)) {
-		dprintf("[fs_read] inode is not being used.\n");
-		return -1;
-	}
 
-	fs_inode_t* ifile = &fs->inode_tab[file];
-	if (ifile->type != FS_FILE) {
-		dprintf("[fs_read] inode is not a file.\n");
-		return -1;
-	}
+static void fsi_meta_unlock(fs_t* fs)
+{
+   sthread_mutex_unlock(fs->meta_lock);
+}
 
-	if (offset >= ifile->size) {
-		*nread = 0;
-		return 0;
-	}
-	
-   	// read the specified range
-	int pos = 0;
-	int iblock = offset/BLOCK_SIZE;
-	int blks_used = OFFSET_TO_BLOCKS(ifile->size);
-	int max = MIN(count,ifile->size-offset);
-	int tbl_pos;
-	unsigned int *blk;
-	char block[BLOCK_SIZE];
-   
-	while (pos < max && iblock < blks_used) {
-		if(iblock < INODE_NUM_BLKS) {
-			blk = ifile->blocks;
-			tbl_pos = iblock;
-		}
-		
-		block_read(fs->blocks, blk[tbl_pos], block);
 
-		int start = ((pos == 0)?(offset % BLOCK_SIZE):0);
-		int num = MIN(BLOCK_SIZE - start, max - pos);
-		memcpy(&buffer[pos],&block[start],num);
+/*
+ * Free extent tree functions
+ * - called with alloc_lock held
+ */
 
-		pos += num;
-		iblock++;
-	}
-	*nread = pos;
-	return 0;
+// sets a node from its children, each covering 'size' / 2 blocks
+static void fsi_ftree_node(fs_t* fs, unsigned n, unsigned size)
+{
+   fs_extent_node_t* l = &fs->free_tree[2 * n];
+   fs_extent_node_t* r = &fs->free_tree[2 * n + 1];
+   unsigned half = size / 2;
+
+   fs->free_tree[n].head = (l->head == half) ? half + r->head : l->head;
+   fs->free_tree[n].tail = (r->tail == half) ? half + l->tail : r->tail;
+   fs->free_tree[n].run = MAX(MAX(l->run, r->run), l->tail + r->head);
 }
 
 
-int fs_write(fs_t* fs, inodeid_t file, unsigned offset, unsigned count,
-   char* buffer)
+static void fsi_ftree_leaf(fs_t* fs, unsigned blk)
 {
-	if (fs == NULL || file >= ITAB_SIZE || buffer == NULL) {
-		dprintf("[fs_write] malformed arguments.\n");
-		return -1;
-	}
+   fs_extent_node_t* leaf = &fs->free_tree[fs->free_leaves + blk];
+   unsigned avail = (blk < fs->sb.num_blocks &&
+      !BMAP_ISSET(fs->blk_bmap,blk));
+   leaf->head = leaf->tail = leaf->run = avail;
+}
 
-	if (!BMAP_ISSET(fs->inode_bmap,file)) {
-		dprintf("[fs_write] inode is not being used.\n");
-		return -1;
-	}
 
-	fs_inode_t* ifile = &fs->inode_tab[file];
-	if (ifile->type != FS_FILE) {
-		dprintf("[fs_write] inode is not a file.\n");
-		return -1;
-	}
+// counts the free extents starting at the blocks from 'first' to 'end'
+static unsigned fsi_ftree_starts(fs_t* fs, unsigned first, unsigned end)
+{
+   unsigned num = 0;
+   for (unsigned b = first; b < end; b++) {
+      num += !BMAP_ISSET(fs->blk_bmap,b) &&
+         (b == 0 || BMAP_ISSET(fs->blk_bmap,b - 1));
+   }
+   return num;
+}
 
-	if (offset > ifile->size) {
-		offset = ifile->size;
-	}
 
-	unsigned *blk;
+// builds the tree from the bitmap
+static void fsi_ftree_build(fs_t* fs)
+{
+   if (fs->free_tree == NULL) {
+      fs->free_leaves = 1;
+      while (fs->free_leaves < fs->sb.num_blocks) {
+         fs->free_leaves *= 2;
+      }
+      fs->free_tree = (fs_extent_node_t*)
+         malloc(2 * fs->free_leaves * sizeof(fs_extent_node_t));
+   }
+   for (unsigned b = 0; b < fs->free_leaves; b++) {
+      fsi_ftree_leaf(fs,b);
+   }
+   for (unsigned n = fs->free_leaves / 2, size = 2; n >= 1;
+      n /= 2, size *= 2) {
+      for (unsigned i = n; i < 2 * n; i++) {
+         fsi_ftree_node(fs,i,size);
+      }
+   }
+   fs->free_extents = fsi_ftree_starts(fs,0,fs->sb.num_blocks);
+}
 
-	int blks_used = OFFSET_TO_BLOCKS(ifile->size);
-	int blks_req = MAX(OFFSET_TO_BLOCKS(offset+count),blks_used)-blks_used;
 
-	dprintf("[fs_write] count=%d, offset=%d, fsize=%d, bused=%d, breq=%d\n",
-		count,offset,ifile->size,blks_used,blks_req);
-	
-	if (blks_req > 0) {
-		if(blks_req > INODE_NUM_BLKS-blks_used) {
-			dprintf("[fs_write] no free block entries in inode.\n");
-			return -1;
-		}
+/*
+ * fsi_bmap_load: loads the free block bitmap, and builds the tree over
+ * it, the first time the allocator is used after the file system is
+ * loaded
+ */
+static void fsi_bmap_load(fs_t* fs)
+{
+   if (fs->blk_bmap != NULL) {
+      return;
+   }
+   fs->blk_bmap = (char*) malloc(fs->sb.bmap_blks * BLOCK_SIZE);
+   fs->blk_bmap_dirty = (char*) calloc(fs->sb.bmap_blks,1);
+   for (unsigned i = 0; i < fs->sb.bmap_blks; i++) {
+      block_read(fs->blocks,fs->sb.bmap_start+i,&fs->blk_bmap[i*BLOCK_SIZE]);
+   }
+   fsi_ftree_build(fs);
+}
 
-		dprintf("[fs_write] required %d blocks, used %d\n", blks_req, blks_used);
 
-      		// check and reserve if there are free blocks
-		for (int i = blks_used; i < blks_used + blks_req; i++) {
+/*
+ * fsi_blk_mark: marks 'len' blocks from 'first' as used or free in the
+ * bitmap, updating the tree (the leaves, then the nodes above them, one
+ * level at a time) and the number of free extents
+ */
+static void fsi_blk_mark(fs_t* fs, unsigned first, unsigned len, int used)
+{
+   unsigned end = first + len;
+   unsigned after = MIN(end + 1, fs->sb.num_blocks);
+
+   fs->free_extents -= fsi_ftree_starts(fs,first,after);
+   for (unsigned b = first; b < end; b++) {
+      if (used) {
+         BMAP_SET(fs->blk_bmap,b);
+      } else {
+         BMAP_CLR(fs->blk_bmap,b);
+      }
+      fs->blk_bmap_dirty[b / BMAP_BLK_BITS] = 1;
+      fsi_ftree_leaf(fs,b);
+   }
+   fs->free_extents += fsi_ftree_starts(fs,first,after);
+
+   unsigned l = fs->free_leaves + first, r = fs->free_leaves + end - 1;
+   for (unsigned size = 2; l > 1; size *= 2) {
+      l /= 2;
+      r /= 2;
+      for (unsigned n = l; n <= r; n++) {
+         fsi_ftree_node(fs,n,size);
+      }
+   }
+}
+
+
+// finds the first run of 'len' blocks in node 'n', which holds one
+static unsigned fsi_ftree_first(fs_t* fs, unsigned n, unsigned size,
+   unsigned lo, unsigned len)
+{
+   while (size > 1) {
+      fs_extent_node_t* l = &fs->free_tree[2 * n];
+      size /= 2;
+      if (l->run >= len) {
+         n = 2 * n;
+      } else if (l->tail + fs->free_tree[2 * n + 1].head >= len) {
+         return lo + size - l->tail;
+      } else {
+         n = 2 * n + 1;
+         lo += size;
+      }
+   }
+   return lo;
+}
+
+
+/*
+ * fsi_ftree_search: looks for the first run of 'len' free blocks from
+ * block 'from' in node 'n', covering 'size' blocks from 'lo'; only the
+ * nodes on the path to 'from' are split, the nodes past it are taken as
+ * a whole
+ * - run: the free blocks (from 'from') just before 'lo' [in/out]
+ *   returns: 1 if found, 0 otherwise
+ */
+static int fsi_ftree_search(fs_t* fs, unsigned n, unsigned size, unsigned lo,
+   unsigned from, unsigned len, unsigned* run, unsigned* start)
+{
+   fs_extent_node_t* node = &fs->free_tree[n];
+
+   if (lo + size <= from) {
+      return 0;
+   }
+   if (lo >= from) {
+      if (*run + node->head >= len) {
+         *start = lo - *run;
+         return 1;
+      }
+      if (node->run >= len) {
+         *start = fsi_ftree_first(fs,n,size,lo,len);
+         return 1;
+      }
+      *run = (node->head == size) ? *run + size : node->tail;
+      return 0;
+   }
+   return fsi_ftree_search(fs,2 * n,size / 2,lo,from,len,run,start) ||
+      fsi_ftree_search(fs,2 * n + 1,size / 2,lo + size / 2,from,len,run,
+         start);
+}
+
+
+/*
+ * fsi_ftree_find: finds the first run of 'len' free blocks from block
+ * 'from'
+ *   returns: 1 if found, 0 otherwise
+ */
+static int fsi_ftree_find(fs_t* fs, unsigned from, unsigned len,
+   unsigned* start)
+{
+   unsigned run = 0;
+   if (len == 0 || fs->free_tree[1].run < len) {
+      return 0;
+   }
+   return fsi_ftree_search(fs,1,fs->free_leaves,0,from,len,&run,start);
+}
+
+
+/*
+ * Block allocation functions
+ * - they take alloc_lock themselves
+ * - a block comes with whatever it held before, since freed blocks are
+ *   not erased and neither is the storage when formatted, so every block
+ *   allocated is written before it is read: data blocks are written
+ *   whole or zero-filled, and tables and metadata start from zeros
+ */
+
+/*
+ * fsi_blk_find: finds the first run of 'len' free blocks, keeping clear
+ * of the goals of the delay buffers unless there is no other room: a run
+ * that overlaps a goal is looked for again past the goal, so there are
+ * at most DELAY_FILES + 1 searches of the tree
+ *   returns: 1 if found, 0 otherwise
+ */
+static int fsi_blk_find(fs_t* fs, unsigned len, unsigned* start)
+{
+   unsigned from = 0;
+
+   while (fsi_ftree_find(fs,from,len,start)) {
+      unsigned skip = 0;
+      for (int i = 0; i < DELAY_FILES; i++) {
+         unsigned goal = fs->delay[i].goal;
+         if (goal != 0 && *start < goal + DELAY_MAX_BLKS &&
+            *start + len > goal) {
+            skip = MAX(skip, goal + DELAY_MAX_BLKS);
+         }
+      }
+      if (skip == 0) {
+         return 1;
+      }
+      from = skip;
+   }
+   return fsi_ftree_find(fs,0,len,start);
+}
+
+
+static int fsi_blk_alloc(fs_t* fs, unsigned* blk)
+{
+   sthread_mutex_lock(fs->alloc_lock);
+   fsi_bmap_load(fs);
+   if (fs->sb.free_blocks <= fs->delay_reserved ||
+      !fsi_blk_find(fs,1,blk)) {
+      sthread_mutex_unlock(fs->alloc_lock);
+      return -1;
+   }
+   fsi_blk_mark(fs,*blk,1,1);
+   fs->sb.free_blocks--;
+   fs->sb_dirty = 1;
+   sthread_mutex_unlock(fs->alloc_lock);
+   return 0;
+}
+
+
+/*
+ * fsi_blk_alloc_run: allocates up to 'len' contiguous blocks: at block
+ * 'hint' if they are all free there, or else at the first run that holds
+ * them, or else the longest free run there is
+ * - start: the first block allocated [out]
+ *   returns: the number of blocks allocated, 0 if there are no free
+ *   blocks
+ */
+static unsigned fsi_blk_alloc_run(fs_t* fs, unsigned len, unsigned hint,
+   unsigned* start)
+{
+   unsigned i = 0;
+
+   sthread_mutex_lock(fs->alloc_lock);
+   fsi_bmap_load(fs);
+   if (fs->sb.free_blocks <= fs->delay_reserved) {
+      sthread_mutex_unlock(fs->alloc_lock);
+      return 0;
+   }
+   len = MIN(len, fs->sb.free_blocks - fs->delay_reserved);
+   if (hint != 0 && hint + len <= fs->sb.num_blocks) {
+      while (i < len && !BMAP_ISSET(fs->blk_bmap,hint + i)) {
+         i++;
+      }
+   }
+   if (i == len && hint != 0) {
+      *start = hint;
+   } else if (!fsi_blk_find(fs,len,start)) {
+      len = fs->free_tree[1].run;
+      fsi_ftree_find(fs,0,len,start);
+   }
+   fsi_blk_mark(fs,*start,len,1);
+   fs->sb.free_blocks -= len;
+   fs->sb_dirty = 1;
+   sthread_mutex_unlock(fs->alloc_lock);
+   return len;
+}
+
+
+/*
+ * fsi_blk_reserve: reserves 'num' free blocks for a later allocation
+ * ('num' may be negative to give them back)
+ *   returns: 0 if successful, -1 if there are not enough free blocks
+ */
+static int fsi_blk_reserve(fs_t* fs, int num)
+{
+   sthread_mutex_lock(fs->alloc_lock);
+   if (num > 0 && fs->sb.free_blocks < fs->delay_reserved + num) {
+      sthread_mutex_unlock(fs->alloc_lock);
+      return -1;
+   }
+   fs->delay_reserved += num;
+   sthread_mutex_unlock(fs->alloc_lock);
+   return 0;
+}
+
+
+/*
+ * fsi_blk_take: allocates a given block
+ *   returns: 0 if successful, -1 if the block is not free (or the free
+ *   blocks are all reserved)
+ */
+static int fsi_blk_take(fs_t* fs, unsigned blk)
+{
+   sthread_mutex_lock(fs->alloc_lock);
+   fsi_bmap_load(fs);
+   if (fs->sb.free_blocks <= fs->delay_reserved ||
+      BMAP_ISSET(fs->blk_bmap,blk)) {
+      sthread_mutex_unlock(fs->alloc_lock);
+      return -1;
+   }
+   fsi_blk_mark(fs,blk,1,1);
+   fs->sb.free_blocks--;
+   fs->sb_dirty = 1;
+   sthread_mutex_unlock(fs->alloc_lock);
+   return 0;
+}
+
+
+static void fsi_blk_free(fs_t* fs, unsigned blk)
+{
+   sthread_mutex_lock(fs->alloc_lock);
+
+   // a shared block just loses one reference
+   if (fs->blk_refs != NULL && fs->blk_refs[blk] > 0) {
+      fs->blk_refs[blk]--;
+      fs->blk_refs_dirty[blk / REFS_BLK_ENTRIES] = 1;
+   } else {
+      fsi_bmap_load(fs);
+      fsi_blk_mark(fs,blk,1,0);
+      fs->sb.free_blocks++;
+      fs->sb_dirty = 1;
+   }
+   sthread_mutex_unlock(fs->alloc_lock);
+}
+
+
+/*
+ * Indirect block cache functions
+ */
+
+static fs_icache_t* fsi_icache_victim(fs_t* fs)
+{
+   fs_icache_t* victim = &fs->icache[0];
+   for (int i = 1; i < ICACHE_SIZE; i++) {
+      if (fs->icache[i].stamp < victim->stamp) {
+         victim = &fs->icache[i];
+      }
+   }
+   if (victim->refs == NULL) {
+      victim->refs = (fs_inode_ext_t*) malloc(BLOCK_SIZE);
+   }
+   return victim;
+}
+
+
+/*
+ * fsi_icache_get: gets the content of an extending table, reading it
+ * from the disk only if it is not cached
+ */
+static fs_inode_ext_t* fsi_icache_get(fs_t* fs, unsigned blkno)
+{
+   fs->icache_clock++;
+   for (int i = 0; i < ICACHE_SIZE; i++) {
+      if (fs->icache[i].blkno == blkno) {
+         fs->icache[i].stamp = fs->icache_clock;
+         return fs->icache[i].refs;
+      }
+   }
+
+   fs_icache_t* entry = fsi_icache_victim(fs);
+   block_read(fs->blocks,blkno,(char*)entry->refs);
+   entry->blkno = blkno;
+   entry->stamp = fs->icache_clock;
+   return entry->refs;
+}
+
+
+/*
+ * fsi_icache_new: gets an empty extending table for a newly allocated
+ * block, without reading it from the disk
+ */
+static fs_inode_ext_t* fsi_icache_new(fs_t* fs, unsigned blkno)
+{
+   fs->icache_clock++;
+   fs_icache_t* entry = NULL;
+   for (int i = 0; i < ICACHE_SIZE && entry == NULL; i++) {
+      if (fs->icache[i].blkno == blkno) {
+         entry = &fs->icache[i];
+      }
+   }
+   if (entry == NULL) {
+      entry = fsi_icache_victim(fs);
+   }
+   memset(entry->refs,0,BLOCK_SIZE);
+   entry->blkno = blkno;
+   entry->stamp = fs->icache_clock;
+   return entry->refs;
+}
+
+
+static void fsi_icache_put(fs_t* fs, unsigned blkno, fs_inode_ext_t* refs)
+{
+   block_write(fs->blocks,blkno,(char*)refs);
+}
+
+
+static void fsi_icache_drop(fs_t* fs, unsigned blkno)
+{
+   for (int i = 0; i < ICACHE_SIZE; i++) {
+      if (fs->icache[i].blkno == blkno) {
+         fs->icache[i].blkno = 0;
+         fs->icache[i].stamp = 0;
+      }
+   }
+}
+
+
+/*
+ * Block reference functions
+ */
+
+static int fsi_inode_map(fs_t* fs, fs_inode_t* inode, unsigned iblock,
+   int alloc, unsigned* blk);
+static void fsi_inode_trunc(fs_t* fs, fs_inode_t* inode, unsigned from);
+
+
+static int fsi_blk_shared(fs_t* fs, unsigned blk)
+{
+   return fs->blk_refs != NULL && fs->blk_refs[blk] > 0;
+}
+
+
+// creates the table of reference counts, all blocks having one reference
+static int fsi_refs_init(fs_t* fs)
+{
+   unsigned nblks = (fs->sb.num_blocks + REFS_BLK_ENTRIES - 1) /
+      REFS_BLK_ENTRIES;
+   unsigned blk;
+
+   for (unsigned i = 0; i < nblks; i++) {
+      if (fsi_inode_map(fs,&fs->sb.refs,i,1,&blk) < 0) {
+         fsi_inode_trunc(fs,&fs->sb.refs,0);
+         return -1;
+      }
+   }
+   fs->sb.refs.size = nblks * BLOCK_SIZE;
+   fs->sb_dirty = 1;
+   fs->blk_refs = (fs_blk_refs_t*) calloc(nblks,BLOCK_SIZE);
+   fs->blk_refs_dirty = (char*) malloc(nblks);
+   memset(fs->blk_refs_dirty,1,nblks);
+   return 0;
+}
+
+
+/*
+ * fsi_blk_share: adds a reference to a block
+ *   returns: 0 if successful, -1 otherwise
+ */
+static int fsi_blk_share(fs_t* fs, unsigned blk)
+{
+   // the table is created under meta_lock, it allocates blocks
+   if (fs->blk_refs == NULL && fsi_refs_init(fs) < 0) {
+      return -1;
+   }
+   sthread_mutex_lock(fs->alloc_lock);
+   if (fs->blk_refs[blk] == REFS_MAX) {
+      sthread_mutex_unlock(fs->alloc_lock);
+      return -1;
+   }
+   fs->blk_refs[blk]++;
+   fs->blk_refs_dirty[blk / REFS_BLK_ENTRIES] = 1;
+   sthread_mutex_unlock(fs->alloc_lock);
+   return 0;
+}
+
+
+/*
+ * fsi_blk_unshare: replaces the reference 'ref' to a shared block by a
+ * private copy of the block; the blocks referenced by a copied extending
+ * table get one more reference
+ *   returns: 0 if successful, -1 if there are no free blocks
+ */
+static int fsi_blk_unshare(fs_t* fs, unsigned* ref, int table)
+{
+   char block[BLOCK_SIZE];
+   unsigned blk;
+
+   if (fsi_blk_alloc(fs,&blk) < 0) {
+      return -1;
+   }
+   block_read(fs->blocks,*ref,block);
+   block_write(fs->blocks,blk,block);
+   if (table) {
+      fs_inode_ext_t* refs = (fs_inode_ext_t*)block;
+      for (unsigned i = 0; i < EXT_INODE_NUM_BLKS; i++) {
+         if (refs[i] != 0) {
+            fsi_blk_share(fs,refs[i]);
+         }
+      }
+   }
+   fsi_blk_free(fs,*ref);
+   *ref = blk;
+   return 0;
+}
+
+
+/*
+ * Block mapping functions
+ */
+
+/*
+ * fsi_inode_root: gets the reference in the inode through which a block
+ * of a file is reached, along with the number of extending tables in the
+ * way and the position of the block relative to the reference
+ */
+static unsigned* fsi_inode_root(fs_t* fs, fs_inode_t* inode,
+   unsigned* iblock, int* levels, unsigned* span)
+{
+   *span = 1;
+   if (*iblock < INODE_NUM_BLKS) {
+      *levels = 0;
+      return &inode->blocks[*iblock];
+   }
+   if (*iblock < INODE_NUM_BLKS + EXT_INODE_NUM_BLKS) {
+      *iblock -= INODE_NUM_BLKS;
+      *levels = 1;
+      return &inode->reserved[INODE_IND];
+   }
+   *iblock -= INODE_NUM_BLKS + EXT_INODE_NUM_BLKS;
+   *levels = 2;
+   *span = EXT_INODE_NUM_BLKS;
+   return &inode->reserved[INODE_DIND];
+}
+
+
+/*
+ * fsi_inode_map: maps a block of a file into a disk block
+ * - inode: the inode of the file
+ * - iblock: the number of the block inside the file
+ * - alloc: if set, the block is to be written: allocates the block (and
+ *   the extending tables needed to reach it) when it is not mapped yet,
+ *   and replaces the shared blocks in the way by private copies
+ * - blk: the disk block, 0 if the block is not mapped [out]
+ *   returns: 0 if successful, -1 otherwise
+ */
+static int fsi_inode_map(fs_t* fs, fs_inode_t* inode, unsigned iblock,
+   int alloc, unsigned* blk)
+{
+   int levels;
+   unsigned span;
+
+   if (iblock >= INODE_MAX_BLKS) {
+      return -1;
+   }
+   unsigned* ref = fsi_inode_root(fs,inode,&iblock,&levels,&span);
+
+   // walk down the tables, from the inode to the data block
+   fs_inode_ext_t* table = NULL;
+   unsigned tblk = 0;
+   while (1) {
+      if (*ref == 0) {
+         if (!alloc) {
+            *blk = 0;
+            return 0;
+         }
+         if (fsi_blk_alloc(fs,ref) < 0) {
+            return -1;
+         }
+         inode->nblocks++;
+         if (table != NULL) {
+            fsi_icache_put(fs,tblk,table);
+         }
+         if (levels > 0) {
+            fsi_icache_put(fs,*ref,fsi_icache_new(fs,*ref));
+         }
+      } else if (alloc && fsi_blk_shared(fs,*ref)) {
+         if (fsi_blk_unshare(fs,ref,levels > 0) < 0) {
+            return -1;
+         }
+         if (table != NULL) {
+            fsi_icache_put(fs,tblk,table);
+         }
+      }
+      if (levels == 0) {
+         break;
+      }
+      tblk = *ref;
+      table = fsi_icache_get(fs,tblk);
+      ref = &table[iblock / span];
+      iblock %= span;
+      span /= EXT_INODE_NUM_BLKS;
+      levels--;
+   }
+
+   *blk = *ref;
+   return 0;
+}
+
+
+/*
+ * fsi_inode_remap: points a mapped block of a file to another disk
+ * block; the extending tables stay where they are
+ */
+static void fsi_inode_remap(fs_t* fs, fs_inode_t* inode, unsigned iblock,
+   unsigned blk)
+{
+   int levels;
+   unsigned span;
+   unsigned* ref = fsi_inode_root(fs,inode,&iblock,&levels,&span);
+
+   fs_inode_ext_t* table = NULL;
+   unsigned tblk = 0;
+   while (levels > 0) {
+      tblk = *ref;
+      table = fsi_icache_get(fs,tblk);
+      ref = &table[iblock / span];
+      iblock %= span;
+      span /= EXT_INODE_NUM_BLKS;
+      levels--;
+   }
+
+   *ref = blk;
+   if (table != NULL) {
+      fsi_icache_put(fs,tblk,table);
+   }
+}
+
+
+/*
+ * fsi_inode_link: maps blocks of a file, not mapped yet, into given disk
+ * blocks (0 leaves a hole); allocates (or makes private) the extending
+ * tables in the way but no data block, and links only the blocks that
+ * are reached through the same table, so that it is written once
+ * - iblock: the number of the first block inside the file
+ * - blks: the disk blocks
+ * - count: the number of blocks
+ *   returns: the number of blocks linked, -1 if there are no free blocks
+ */
+static int fsi_inode_link(fs_t* fs, fs_inode_t* inode, unsigned iblock,
+   unsigned* blks, unsigned count)
+{
+   int levels;
+   unsigned span;
+
+   if (iblock >= INODE_MAX_BLKS) {
+      return -1;
+   }
+   unsigned first = iblock;
+   unsigned* ref = fsi_inode_root(fs,inode,&iblock,&levels,&span);
+
+   fs_inode_ext_t* table = NULL;
+   unsigned tblk = 0;
+   while (levels > 0) {
+      if (*ref == 0) {
+         if (fsi_blk_alloc(fs,ref) < 0) {
+            return -1;
+         }
+         inode->nblocks++;
+         if (table != NULL) {
+            fsi_icache_put(fs,tblk,table);
+         }
+         fsi_icache_put(fs,*ref,fsi_icache_new(fs,*ref));
+      } else if (fsi_blk_shared(fs,*ref)) {
+         if (fsi_blk_unshare(fs,ref,1) < 0) {
+            return -1;
+         }
+         if (table != NULL) {
+            fsi_icache_put(fs,tblk,table);
+         }
+      }
+      tblk = *ref;
+      table = fsi_icache_get(fs,tblk);
+      ref = &table[iblock / span];
+      iblock %= span;
+      span /= EXT_INODE_NUM_BLKS;
+      levels--;
+   }
+
+   // the blocks left in the table (or in the inode)
+   unsigned room = (table != NULL) ?
+      EXT_INODE_NUM_BLKS - (unsigned)(ref - table) : INODE_NUM_BLKS - first;
+   unsigned num = MIN(count, room);
+   for (unsigned i = 0; i < num; i++) {
+      if (blks[i] != 0) {
+         ref[i] = blks[i];
+         inode->nblocks++;
+      }
+   }
+   if (table != NULL) {
+      fsi_icache_put(fs,tblk,table);
+   }
+   return num;
+}
+
+
+// counts the blocks reached through an extending table, itself included
+static unsigned fsi_table_count(fs_t* fs, unsigned tblk, int levels)
+{
+   fs_inode_ext_t refs[EXT_INODE_NUM_BLKS];
+   unsigned count = 1;
+
+   memcpy(refs,fsi_icache_get(fs,tblk),sizeof(refs));
+   for (unsigned i = 0; i < EXT_INODE_NUM_BLKS; i++) {
+      if (refs[i] != 0) {
+         count += (levels == 1) ? 1 : fsi_table_count(fs,refs[i],levels-1);
+      }
+   }
+   return count;
+}
+
+
+/*
+ * fsi_table_trunc: frees the blocks referenced by an extending table
+ * from position 'from' up to 'to' (relative to the first block mapped by
+ * the table); the table itself is freed if it gets empty, and a shared
+ * table is copied before being changed
+ * - tref: the reference to the table, updated if the table is freed or
+ *   copied [in/out]
+ *   returns: 1 if the table was freed, 0 otherwise
+ */
+static int fsi_table_trunc(fs_t* fs, fs_inode_t* inode, unsigned* tref,
+   int levels, unsigned from, unsigned to)
+{
+   unsigned span = (levels == 2) ? EXT_INODE_NUM_BLKS : 1;
+   int used = 0, dirty = 0;
+
+   if (fsi_blk_shared(fs,*tref)) {
+      if (from == 0 && to >= span * EXT_INODE_NUM_BLKS) {
+         inode->nblocks -= fsi_table_count(fs,*tref,levels);
+         fsi_blk_free(fs,*tref);
+         *tref = 0;
+         return 1;
+      }
+      if (fsi_blk_unshare(fs,tref,1) < 0) {
+         return 0;
+      }
+   }
+
+   unsigned tblk = *tref;
+   fs_inode_ext_t* table = fsi_icache_get(fs,tblk);
+   for (unsigned i = 0; i < EXT_INODE_NUM_BLKS; i++) {
+      if (table[i] == 0) {
+         continue;
+      }
+      unsigned base = i * span;
+      if (base + span <= from || base >= to) {
+         used = 1;
+      } else if (levels == 1) {
+         fsi_blk_free(fs,table[i]);
+         inode->nblocks--;
+         table[i] = 0;
+         dirty = 1;
+      } else {
+         unsigned child = table[i];
+         int freed = fsi_table_trunc(fs,inode,&child,levels-1,
+            (from > base) ? from - base : 0,to - base);
+         table = fsi_icache_get(fs,tblk);
+         if (table[i] != child) {
+            table[i] = child;
+            dirty = 1;
+         }
+         used |= !freed;
+      }
+   }
+
+   if (!used) {
+      fsi_icache_drop(fs,tblk);
+      fsi_blk_free(fs,tblk);
+      inode->nblocks--;
+      *tref = 0;
+      return 1;
+   }
+   if (dirty) {
+      fsi_icache_put(fs,tblk,table);
+   }
+   return 0;
+}
+
+
+/*
+ * fsi_inode_punch: frees the blocks of a file from block 'from' up to
+ * block 'to', leaving a hole; the file is not inline
+ */
+static void fsi_inode_punch(fs_t* fs, fs_inode_t* inode, unsigned from,
+   unsigned to)
+{
+   for (unsigned i = from; i < MIN(to, INODE_NUM_BLKS); i++) {
+      if (inode->blocks[i] != 0) {
+         fsi_blk_free(fs,inode->blocks[i]);
+         inode->nblocks--;
+         inode->blocks[i] = 0;
+      }
+   }
+
+   unsigned* ind = &inode->reserved[INODE_IND];
+   unsigned base = INODE_NUM_BLKS;
+   if (*ind != 0 && to > base) {
+      fsi_table_trunc(fs,inode,ind,1,(from > base)?from-base:0,to-base);
+   }
+
+   unsigned* dind = &inode->reserved[INODE_DIND];
+   base += EXT_INODE_NUM_BLKS;
+   if (*dind != 0 && to > base) {
+      fsi_table_trunc(fs,inode,dind,2,(from > base)?from-base:0,to-base);
+   }
+}
+
+
+/*
+ * Tail packing functions
+ */
+
+// the block of the file the tail stands for
+static unsigned fsi_tail_block(fs_t* fs, fs_inode_t* inode)
+{
+   return (inode->size - 1) / BLOCK_SIZE;
+}
+
+
+// drops a reference to a fragment block, which leaves the cache if freed
+static void fsi_frag_release(fs_t* fs, unsigned blk)
+{
+   if (!fsi_blk_shared(fs,blk)) {
+      fsi_icache_drop(fs,blk);
+   }
+   fsi_blk_free(fs,blk);
+}
+
+
+static void fsi_tail_free(fs_t* fs, fs_inode_t* inode)
+{
+   fsi_frag_release(fs,inode->tail);
+   inode->tail = 0;
+   inode->tail_frag = 0;
+}
+
+
+// gets the block the tail stands for: the tail, then zeros
+static void fsi_tail_read(fs_t* fs, fs_inode_t* inode, char* block)
+{
+   char* frags = (char*) fsi_icache_get(fs,inode->tail);
+   unsigned len = inode->size - fsi_tail_block(fs,inode) * BLOCK_SIZE;
+   memset(block,0,BLOCK_SIZE);
+   memcpy(block,&frags[inode->tail_frag * FRAG_SIZE],len);
+}
+
+
+/*
+ * fsi_tail_pack: packs the last block of a file, which is not mapped, in
+ * the fragment block being filled, or in a new one if it has no room
+ * - data: the block, the tail followed by zeros
+ *   returns: 0 if successful, -1 otherwise (the block is to be written
+ *   as usual)
+ */
+static int fsi_tail_pack(fs_t* fs, fs_inode_t* inode, char* data)
+{
+   unsigned nfrags = FRAGS_OF(inode->size - 
+      fsi_tail_block(fs,inode) * BLOCK_SIZE);
+   if (nfrags > TAIL_MAX_FRAGS) {
+      return -1;
+   }
+
+   if (fs->sb.frag_blk == 0 ||
+      fs->sb.frag_used + nfrags > FRAGS_PER_BLOCK) {
+      unsigned blk;
+      if (fsi_blk_alloc(fs,&blk) < 0) {
+         return -1;
+      }
+      if (fs->sb.frag_blk != 0) {
+         fsi_frag_release(fs,fs->sb.frag_blk);
+      }
+      fsi_icache_new(fs,blk);
+      fs->sb.frag_blk = blk;
+      fs->sb.frag_used = 0;
+      fs->sb_dirty = 1;
+   }
+   if (fsi_blk_share(fs,fs->sb.frag_blk) < 0) {
+      return -1;
+   }
+
+   char* frags = (char*) fsi_icache_get(fs,fs->sb.frag_blk);
+   memcpy(&frags[fs->sb.frag_used * FRAG_SIZE],data,nfrags * FRAG_SIZE);
+   fsi_icache_put(fs,fs->sb.frag_blk,(fs_inode_ext_t*)frags);
+   inode->tail = fs->sb.frag_blk;
+   inode->tail_frag = fs->sb.frag_used;
+   fs->sb.frag_used += nfrags;
+   fs->sb_dirty = 1;
+   return 0;
+}
+
+
+/*
+ * fsi_tail_unpack: moves the tail of a file, if it has one, back to a
+ * block of its own
+ *   returns: 0 if successful, -1 if there are no free blocks
+ */
+static int fsi_tail_unpack(fs_t* fs, fs_inode_t* inode)
+{
+   char block[BLOCK_SIZE];
+   unsigned blk;
+
+   if (!INODE_TAIL(inode)) {
+      return 0;
+   }
+   fsi_tail_read(fs,inode,block);
+   if (fsi_inode_map(fs,inode,fsi_tail_block(fs,inode),1,&blk) < 0) {
+      return -1;
+   }
+   block_write(fs->blocks,blk,block);
+   fsi_tail_free(fs,inode);
+   return 0;
+}
+
+
+/*
+ * fsi_inode_trunc: frees all blocks of a file starting at block 'from',
+ * along with its tail if it stands for one of them
+ */
+static void fsi_inode_trunc(fs_t* fs, fs_inode_t* inode, unsigned from)
+{
+   if (INODE_INLINE(inode)) {
+      if (from == 0) {
+         memset(inode->blocks,0,INODE_INLINE_SZ);
+      }
+      return;
+   }
+   if (INODE_TAIL(inode) && from <= fsi_tail_block(fs,inode)) {
+      fsi_tail_free(fs,inode);
+   }
+   fsi_inode_punch(fs,inode,from,INODE_MAX_BLKS);
+}
+
+
+/*
+ * fsi_inode_promote: moves the inline data of a file to a data block
+ *   returns: 0 if successful, -1 if there are no free blocks
+ */
+static int fsi_inode_promote(fs_t* fs, fs_inode_t* inode)
+{
+   char block[BLOCK_SIZE];
+   unsigned blk;
+
+   memset(block,0,BLOCK_SIZE);
+   memcpy(block,inode->blocks,INODE_INLINE_SZ);
+   memset(inode->blocks,0,INODE_INLINE_SZ);
+   inode->reserved[INODE_FLAGS] &= ~INODE_F_INLINE;
+
+   if (inode->size > 0) {
+      if (fsi_inode_map(fs,inode,0,1,&blk) < 0) {
+         memcpy(inode->blocks,block,INODE_INLINE_SZ);
+         inode->reserved[INODE_FLAGS] |= INODE_F_INLINE;
+         return -1;
+      }
+      block_write(fs->blocks,blk,block);
+   }
+   return 0;
+}
+
+
+/*
+ * Inode table functions
+ */
+
+/*
+ * fsi_ibmap_load: loads the free inode bitmap on first use, once the
+ * file system is loaded
+ * - called with meta_lock held
+ */
+static void fsi_ibmap_load(fs_t* fs)
+{
+   if (fs->inode_bmap != NULL || fs->sb.ibmap.size == 0) {
+      return;
+   }
+   unsigned ibmap_blks = fs->sb.ibmap.size / BLOCK_SIZE;
+   fs->inode_bmap = (char*) malloc(fs->sb.ibmap.size);
+   fs->inode_bmap_dirty = (char*) calloc(ibmap_blks,1);
+   for (unsigned i = 0; i < ibmap_blks; i++) {
+      unsigned blk;
+      fsi_inode_map(fs,&fs->sb.ibmap,i,0,&blk);
+      block_read(fs->blocks,blk,&fs->inode_bmap[i*BLOCK_SIZE]);
+   }
+}
+
+
+static int fsi_inode_used(fs_t* fs, inodeid_t id)
+{
+   if (FS_SNAP_OF(id) != 0) {
+      unsigned s = FS_SNAP_OF(id) - 1;
+      id = FS_SNAP_INO(id);
+      return s < FS_MAX_SNAPSHOTS && fs->snaps[s].rec.name[0] != '\0' &&
+         id < fs->snaps[s].rec.num_inodes &&
+         BMAP_ISSET(fs->snaps[s].inode_bmap,id);
+   }
+   fsi_ibmap_load(fs);
+   return id < fs->sb.num_inodes && BMAP_ISSET(fs->inode_bmap,id);
+}
+
+
+/*
+ * fsi_inode: gets an inode from the inode table (of the live file system
+ * or of a snapshot), loading the block of the table where it is stored
+ * if it was not accessed before
+ */
+static fs_inode_t* fsi_inode(fs_t* fs, inodeid_t id)
+{
+   fs_inode_t** tab = fs->inode_tab;
+   fs_inode_t* itab = &fs->sb.itab;
+
+   if (FS_SNAP_OF(id) != 0) {
+      fs_snap_t* snap = &fs->snaps[FS_SNAP_OF(id) - 1];
+      tab = snap->inode_tab;
+      itab = &snap->rec.itab;
+      id = FS_SNAP_INO(id);
+   }
+
+   unsigned chunk = id / ITAB_BLK_INODES;
+   if (tab[chunk] == NULL) {
+      unsigned blk;
+      tab[chunk] = (fs_inode_t*) malloc(BLOCK_SIZE);
+      fsi_inode_map(fs,itab,chunk,0,&blk);
+      block_read(fs->blocks,blk,(char*)tab[chunk]);
+   }
+   return &tab[chunk][id % ITAB_BLK_INODES];
+}
+
+
+/*
+ * fsi_inode_dirty: marks an inode as modified, so that the block of the
+ * inode table where it is stored is written back on the next store
+ */
+static void fsi_inode_dirty(fs_t* fs, inodeid_t id)
+{
+   fs->inode_tab_dirty[id / ITAB_BLK_INODES] = 1;
+}
+
+
+static void fsi_itab_resize(fs_t* fs, unsigned chunks)
+{
+   if (chunks <= fs->itab_chunks) {
+      return;
+   }
+   unsigned num = MAX(chunks, 2 * fs->itab_chunks);
+   fs->inode_tab = (fs_inode_t**) realloc(fs->inode_tab,
+      num * sizeof(fs_inode_t*));
+   fs->inode_tab_dirty = (char*) realloc(fs->inode_tab_dirty, num);
+   for (unsigned i = fs->itab_chunks; i < num; i++) {
+      fs->inode_tab[i] = NULL;
+      fs->inode_tab_dirty[i] = 0;
+   }
+   fs->itab_chunks = num;
+}
+
+
+/*
+ * fsi_itab_grow: adds one block of inodes to the inode table, and one
+ * block to the free inode bitmap when it is full
+ *   returns: 0 if successful, -1 otherwise
+ */
+static int fsi_itab_grow(fs_t* fs)
+{
+   unsigned chunk = fs->sb.num_inodes / ITAB_BLK_INODES;
+   unsigned blk;
+
+   // the bits above the inode number tell the snapshot
+   if (fs->sb.num_inodes + ITAB_BLK_INODES > FS_SNAP_INO_MASK) {
+      return -1;
+   }
+   if (fsi_inode_map(fs,&fs->sb.itab,chunk,1,&blk) < 0) {
+      return -1;
+   }
+
+   fsi_ibmap_load(fs);
+   if (fs->sb.num_inodes + ITAB_BLK_INODES > fs->sb.ibmap.size * 8) {
+      unsigned iblock = fs->sb.ibmap.size / BLOCK_SIZE;
+      if (fsi_inode_map(fs,&fs->sb.ibmap,iblock,1,&blk) < 0) {
+         fsi_inode_trunc(fs,&fs->sb.itab,chunk);
+         return -1;
+      }
+      fs->inode_bmap = (char*) realloc(fs->inode_bmap,
+         fs->sb.ibmap.size + BLOCK_SIZE);
+      fs->inode_bmap_dirty = (char*) realloc(fs->inode_bmap_dirty,
+         iblock + 1);
+      memset(&fs->inode_bmap[fs->sb.ibmap.size],0,BLOCK_SIZE);
+      fs->inode_bmap_dirty[iblock] = 1;
+      fs->sb.ibmap.size += BLOCK_SIZE;
+   }
+
+   fsi_itab_resize(fs,chunk + 1);
+   fs->inode_tab[chunk] = (fs_inode_t*) calloc(1,BLOCK_SIZE);
+   fs->inode_tab_dirty[chunk] = 1;
+   fs->sb.itab.size += BLOCK_SIZE;
+   fs->sb.num_inodes += ITAB_BLK_INODES;
+   fs->sb.free_inodes += ITAB_BLK_INODES;
+   fs->sb_dirty = 1;
+   return 0;
+}
+
+
+static int fsi_ino_alloc(fs_t* fs, unsigned* ino)
+{
+   unsigned n = fs->sb.num_inodes - fs->inode_hint;
+   fsi_ibmap_load(fs);
+   if (fs->sb.free_inodes == 0 ||
+      !fsi_bmap_find_free(&fs->inode_bmap[fs->inode_hint / 8],n,ino)) {
+      *ino = fs->sb.num_inodes;
+      if (fsi_itab_grow(fs) < 0) {
+         return -1;
+      }
+   } else {
+      *ino += fs->inode_hint;
+   }
+   BMAP_SET(fs->inode_bmap,*ino);
+   fs->inode_bmap_dirty[*ino / BMAP_BLK_BITS] = 1;
+   fs->inode_hint = *ino - *ino % 8;
+   fs->sb.free_inodes--;
+   fs->sb_dirty = 1;
+   return 0;
+}
+
+
+static void fsi_ino_free(fs_t* fs, unsigned ino)
+{
+   fsi_ibmap_load(fs);
+   BMAP_CLR(fs->inode_bmap,ino);
+   fs->inode_bmap_dirty[ino / BMAP_BLK_BITS] = 1;
+   fs->inode_hint = MIN(fs->inode_hint, ino - ino % 8);
+   fs->sb.free_inodes++;
+   fs->sb_dirty = 1;
+}
+
+
+/*
+ * Internal functions for loading/storing file system metadata do the blocks
+ */
+
+
+// releases the memory of a snapshot, leaving its slot free
+static void fsi_snap_free(fs_t* fs, fs_snap_t* snap)
+{
+   if (snap->inode_tab != NULL) {
+      for (unsigned i = 0; i < snap->rec.itab.size / BLOCK_SIZE; i++) {
+         free(snap->inode_tab[i]);
+      }
+   }
+   free(snap->inode_tab);
+   free(snap->inode_bmap);
+   memset(snap,0,sizeof(fs_snap_t));
+}
+
+
+static void fsi_free_fsdata(fs_t* fs)
+{
+   for (unsigned i = 0; i < fs->itab_chunks; i++) {
+      free(fs->inode_tab[i]);
+   }
+   for (int i = 0; i < FS_MAX_SNAPSHOTS; i++) {
+      fsi_snap_free(fs,&fs->snaps[i]);
+   }
+   for (int i = 0; i < DELAY_FILES; i++) {
+      free(fs->delay[i].data);
+   }
+   memset(fs->delay,0,sizeof(fs->delay));
+   fs->delay_reserved = 0;
+   free(fs->inode_tab);
+   free(fs->inode_tab_dirty);
+   free(fs->inode_bmap);
+   free(fs->inode_bmap_dirty);
+   free(fs->blk_bmap);
+   free(fs->blk_bmap_dirty);
+   free(fs->free_tree);
+   free(fs->blk_refs);
+   free(fs->blk_refs_dirty);
+   fs->inode_tab = NULL;
+   fs->inode_tab_dirty = NULL;
+   fs->inode_bmap = NULL;
+   fs->inode_bmap_dirty = NULL;
+   fs->blk_bmap = NULL;
+   fs->blk_bmap_dirty = NULL;
+   fs->free_tree = NULL;
+   fs->free_leaves = 0;
+   fs->free_extents = 0;
+   fs->blk_refs = NULL;
+   fs->blk_refs_dirty = NULL;
+   fs->itab_chunks = 0;
+   fs->inode_hint = 0;
+   for (int i = 0; i < ICACHE_SIZE; i++) {
+      free(fs->icache[i].refs);
+   }
+   memset(fs->icache,0,sizeof(fs->icache));
+   memset(fs->dcache,0,sizeof(fs->dcache));
+   memset(fs->dcache_bucket,0,sizeof(fs->dcache_bucket));
+}
+
+
+/*
+ * fsi_snap_load: sets up a snapshot in memory from its record, loading
+ * its free inode bitmap
+ */
+static void fsi_snap_load(fs_t* fs, fs_snap_t* snap, fs_snap_rec_t* rec)
+{
+   snap->rec = *rec;
+   snap->inode_tab = (fs_inode_t**) calloc(rec->itab.size / BLOCK_SIZE,
+      sizeof(fs_inode_t*));
+   snap->inode_bmap = (char*) malloc(rec->ibmap.size);
+   for (unsigned i = 0; i < rec->ibmap.size / BLOCK_SIZE; i++) {
+      unsigned blk;
+      fsi_inode_map(fs,&snap->rec.ibmap,i,0,&blk);
+      block_read(fs->blocks,blk,&snap->inode_bmap[i*BLOCK_SIZE]);
+   }
+}
+
+
+/*
+ * fsi_load_fsdata: loads and checks the superblock, then the block
+ * reference counts and the snapshots; the bitmaps and the inode table
+ * are loaded on demand (see fsi_bmap_load, fsi_ibmap_load and fsi_inode)
+ *   returns: 0 if successful, -1 if the blocks do not hold a file system
+ */
+static int fsi_load_fsdata(fs_t* fs)
+{
+   blocks_t* bks = fs->blocks;
+   unsigned num_blocks = block_num_blocks(bks);
+   char block[block_size(bks)];
+
+   fsi_free_fsdata(fs);
+
+   // load the superblock from block 0, which must match the storage
+   block_read(bks,0,block);
+   memcpy(&fs->sb,block,sizeof(fs->sb));
+   if (fs->sb.magic != FS_MAGIC || fs->sb.block_size != block_size(bks) ||
+      fs->sb.num_blocks != num_blocks || fs->sb.bmap_start != 1 ||
+      fs->sb.bmap_blks != (num_blocks + BMAP_BLK_BITS - 1) / BMAP_BLK_BITS ||
+      fs->sb.free_blocks > num_blocks ||
+      fs->sb.free_inodes > fs->sb.num_inodes ||
+      fs->sb.itab.size / BLOCK_SIZE * ITAB_BLK_INODES != fs->sb.num_inodes ||
+      fs->sb.ibmap.size * 8 < fs->sb.num_inodes ||
+      fs->sb.snaps >= fs->sb.num_inodes || fs->sb.frag_blk >= num_blocks ||
+      fs->sb.frag_used > FRAGS_PER_BLOCK) {
+      memset(&fs->sb,0,sizeof(fs->sb));
+      return -1;
+   }
+   fs->sb_dirty = 0;
+
+   // load the block reference counts, if any block was ever shared
+   unsigned refs_blks = fs->sb.refs.size / BLOCK_SIZE;
+   if (refs_blks > 0) {
+      fs->blk_refs = (fs_blk_refs_t*) malloc(fs->sb.refs.size);
+      fs->blk_refs_dirty = (char*) calloc(refs_blks,1);
+      for (unsigned i = 0; i < refs_blks; i++) {
+         unsigned blk;
+         fsi_inode_map(fs,&fs->sb.refs,i,0,&blk);
+         block_read(bks,blk,(char*)fs->blk_refs + i*BLOCK_SIZE);
+      }
+   }
+
+   fsi_itab_resize(fs,fs->sb.itab.size / BLOCK_SIZE);
+
+   // load the snapshots, but not their inode tables
+   if (fs->sb.snaps != 0) {
+      fs_inode_t* isnaps = fsi_inode(fs,fs->sb.snaps);
+      for (unsigned i = 0; i < isnaps->size / BLOCK_SIZE; i++) {
+         FS_BLOCK_BUF(fs_snap_page_t,page);
+         unsigned blk;
+         fsi_inode_map(fs,isnaps,i,0,&blk);
+         if (blk == 0) {
+            continue;
+         }
+         block_read(bks,blk,page->data);
+         if (page->rec.name[0] != '\0') {
+            fsi_snap_load(fs,&fs->snaps[i],&page->rec);
+         }
+      }
+   }
+   return 0;
+}
+
+
+// writes block 'chunk' of the inode table, where the files with a delay
+// buffer keep the size they have on the disk
+static void fsi_itab_write(fs_t* fs, unsigned chunk, unsigned blk)
+{
+   FS_BLOCK_BUF(fs_inode_t,tab);
+   memcpy(tab,fs->inode_tab[chunk],BLOCK_SIZE);
+   for (int i = 0; i < DELAY_FILES; i++) {
+      inodeid_t ino = fs->delay[i].ino;
+      if (ino != 0 && ino / ITAB_BLK_INODES == chunk) {
+         tab[ino % ITAB_BLK_INODES].size = fs->delay[i].size;
+      }
+   }
+   block_write(fs->blocks,blk,(char*)tab);
+}
+
+
+/*
+ * fsi_store_fsdata: writes back the metadata blocks that were modified
+ */
+static void fsi_store_fsdata(fs_t* fs)
+{
+   blocks_t* bks = fs->blocks;
+   unsigned blk;
+ 
+   // store the inode table; the blocks shared with snapshots are copied,
+   // and stay dirty if there is no room to do it
+   for (unsigned i = 0; i < fs->sb.itab.size / BLOCK_SIZE; i++) {
+      if (fs->inode_tab_dirty[i] &&
+         fsi_inode_map(fs,&fs->sb.itab,i,1,&blk) == 0) {
+         fsi_itab_write(fs,i,blk);
+         fs->inode_tab_dirty[i] = 0;
+      }
+   }
+
+   // store free inode bitmap
+   for (unsigned i = 0; fs->inode_bmap != NULL &&
+      i < fs->sb.ibmap.size / BLOCK_SIZE; i++) {
+      if (fs->inode_bmap_dirty[i] &&
+         fsi_inode_map(fs,&fs->sb.ibmap,i,1,&blk) == 0) {
+         block_write(bks,blk,&fs->inode_bmap[i*BLOCK_SIZE]);
+         fs->inode_bmap_dirty[i] = 0;
+      }
+   }
+
+   // store the block allocator state
+   sthread_mutex_lock(fs->alloc_lock);
+   for (unsigned i = 0; i < fs->sb.refs.size / BLOCK_SIZE; i++) {
+      if (fs->blk_refs_dirty[i]) {
+         fsi_inode_map(fs,&fs->sb.refs,i,0,&blk);
+         block_write(bks,blk,(char*)fs->blk_refs + i*BLOCK_SIZE);
+         fs->blk_refs_dirty[i] = 0;
+      }
+   }
+
+   // store free block bitmap
+   for (unsigned i = 0; fs->blk_bmap != NULL && i < fs->sb.bmap_blks; i++) {
+      if (fs->blk_bmap_dirty[i]) {
+         block_write(bks,fs->sb.bmap_start+i,&fs->blk_bmap[i*BLOCK_SIZE]);
+         fs->blk_bmap_dirty[i] = 0;
+      }
+   }
+
+   // store the superblock to block 0
+   if (fs->sb_dirty) {
+      char block[BLOCK_SIZE];
+      memset(block,0,sizeof(block));
+      memcpy(block,&fs->sb,sizeof(fs->sb));
+      block_write(bks,0,block);
+      fs->sb_dirty = 0;
+   }
+   sthread_mutex_unlock(fs->alloc_lock);
+}
+
+
+/*
+ * Disk usage functions
+ */
+
+/*
+ * fsi_usage_add: accounts 'delta' blocks to the subtree of directory
+ * 'dir' and of all the directories above it
+ */
+static void fsi_usage_add(fs_t* fs, inodeid_t dir, int delta)
+{
+   while (delta != 0 && dir != 0) {
+      fs_inode_t* idir = fsi_inode(fs,dir);
+      idir->tree_blocks += delta;
+      fsi_inode_dirty(fs,dir);
+      dir = idir->parent;
+   }
+}
+
+
+/*
+ * Delayed allocation functions
+ */
+
+static fs_delay_t* fsi_delay_find(fs_t* fs, inodeid_t ino)
+{
+   for (int i = 0; i < DELAY_FILES; i++) {
+      if (fs->delay[i].ino == ino) {
+         return &fs->delay[i];
+      }
+   }
+   return NULL;
+}
+
+
+// counts the blocks held by the delay buffers of inode 'ino', or of the
+// files below it if it is a directory
+static unsigned fsi_delay_usage(fs_t* fs, inodeid_t ino)
+{
+   unsigned blocks = 0;
+
+   for (int i = 0; i < DELAY_FILES; i++) {
+      inodeid_t up = fs->delay[i].ino;
+      while (up != 0 && up != ino) {
+         up = fsi_inode(fs,up)->parent;
+      }
+      if (up != 0) {
+         blocks += fs->delay[i].nblks;
+      }
+   }
+   return blocks;
+}
+
+
+// releases a delay buffer, along with its reserved blocks
+static void fsi_delay_drop(fs_t* fs, fs_delay_t* d)
+{
+   fsi_blk_reserve(fs,-(int)d->reserved);
+   free(d->data);
+   memset(d,0,sizeof(fs_delay_t));
+}
+
+
+/*
+ * fsi_delay_flush: writes the blocks of a delay buffer to one run of
+ * free blocks, following the last block of the file when possible (or
+ * else to the fewest runs that hold them), and releases the buffer
+ * - pack: if set, the last block of the file, when short, is packed as
+ *   a tail
+ *   returns: 0 if successful, -1 otherwise, which the blocks reserved
+ *   for the buffer rule out (the file would be cut at the first block of
+ *   the buffer)
+ */
+static int fsi_delay_flush(fs_t* fs, fs_delay_t* d, int pack)
+{
+   fs_inode_t* ifile = fsi_inode(fs,d->ino);
+   unsigned used = ifile->nblocks;
+   unsigned hint = 0, start;
+   int status = 0;
+
+   // the last block of the file is packed unless preallocated, while the
+   // blocks of the buffer are still reserved (or else it goes with them)
+   unsigned nblks = d->nblks, blk = 0;
+   if (pack && ifile->size % BLOCK_SIZE != 0 &&
+      OFFSET_TO_BLOCKS(ifile->size) == d->first + nblks &&
+      fsi_inode_map(fs,ifile,d->first + nblks - 1,0,&blk) == 0 && blk == 0 &&
+      fsi_tail_pack(fs,ifile,&d->data[(nblks - 1) * BLOCK_SIZE]) == 0) {
+      nblks--;
+   }
+
+   if (d->first > 0) {
+      fsi_inode_map(fs,ifile,d->first - 1,0,&hint);
+      hint += (hint != 0);
+   }
+   fsi_blk_reserve(fs,-(int)d->reserved);
+   d->reserved = 0;
+   d->goal = 0;
+
+   unsigned blks[DELAY_MAX_BLKS];
+   for (unsigned i = 0; i < nblks && status == 0; ) {
+      unsigned num = fsi_blk_alloc_run(fs,nblks - i,hint,&start);
+      if (num == 0) {
+         status = -1;
+         break;
+      }
+      for (unsigned j = i; j < i + num; j++) {
+         blks[j] = start + j - i;
+         block_write(fs->blocks,blks[j],&d->data[j * BLOCK_SIZE]);
+      }
+      for (unsigned j = i; j < i + num; ) {
+         int linked = fsi_inode_link(fs,ifile,d->first + j,&blks[j],
+            i + num - j);
+         if (linked < 0) {
+            for (; j < i + num; j++) {
+               fsi_blk_free(fs,blks[j]);
+            }
+            status = -1;
+            break;
+         }
+         j += linked;
+      }
+      i += num;
+      hint = start + num;
+   }
+
+   if (status < 0) {
+      dprintf("[fs_flush] there are no free blocks, data is lost.\n");
+      fsi_inode_trunc(fs,ifile,d->first);
+      ifile->size = MIN(ifile->size, d->first * BLOCK_SIZE);
+   }
+   fsi_inode_dirty(fs,d->ino);
+   fsi_usage_add(fs,ifile->parent,ifile->nblocks - used);
+   fsi_delay_drop(fs,d);
+   return status;
+}
+
+
+// flushes the delay buffer of a file, if it has one (see fsi_delay_flush)
+static int fsi_delay_sync(fs_t* fs, inodeid_t ino, int pack)
+{
+   fs_delay_t* d = fsi_delay_find(fs,ino);
+   return (d != NULL) ? fsi_delay_flush(fs,d,pack) : 0;
+}
+
+
+// returns a free delay buffer, flushing the least recently written one
+// (NULL if that flush fails)
+static fs_delay_t* fsi_delay_slot(fs_t* fs)
+{
+   fs_delay_t* lru = &fs->delay[0];
+
+   for (int i = 0; i < DELAY_FILES; i++) {
+      if (fs->delay[i].ino == 0) {
+         return &fs->delay[i];
+      }
+      if ((int)(fs->delay[i].stamp - lru->stamp) < 0) {
+         lru = &fs->delay[i];
+      }
+   }
+   return (fsi_delay_flush(fs,lru,1) == 0) ? lru : NULL;
+}
+
+
+/*
+ * fsi_delay_write: keeps a write in the delay buffer of a file when it
+ * goes past the last block of the file (or of the buffer), flushing the
+ * buffer first if it cannot hold the write
+ *   returns: 0 if the write was buffered, 1 if it is to be done on the
+ *   disk, -1 if a flush failed
+ */
+static int fsi_delay_write(fs_t* fs, inodeid_t file, fs_inode_t* ifile,
+   unsigned offset, unsigned count, char* buffer)
+{
+   unsigned first = offset / BLOCK_SIZE;
+   unsigned end = OFFSET_TO_BLOCKS(offset + count);
+   fs_delay_t* d = fsi_delay_find(fs,file);
+
+   if (d != NULL) {
+      unsigned grow = (end > d->first + d->nblks) ?
+         end - d->first - d->nblks : 0;
+      if (first < d->first || end - d->first > DELAY_MAX_BLKS ||
+         fsi_blk_reserve(fs,grow) < 0) {
+         if (fsi_delay_flush(fs,d,0) < 0) {
+            return -1;
+         }
+         d = NULL;
+      } else {
+         d->reserved += grow;
+      }
+   }
+
+   if (d == NULL) {
+      unsigned reserve = end - first + DELAY_TABLE_BLKS;
+      if (count == 0 || first < OFFSET_TO_BLOCKS(ifile->size) ||
+         ifile->prealloc != 0 || end - first > DELAY_MAX_BLKS ||
+         fsi_blk_reserve(fs,reserve) < 0) {
+         return 1;
+      }
+      d = fsi_delay_slot(fs);
+      if (d == NULL) {
+         fsi_blk_reserve(fs,-(int)reserve);
+         return -1;
+      }
+      d->ino = file;
+      d->first = first;
+      d->size = ifile->size;
+      d->reserved = reserve;
+      d->data = (char*) malloc(DELAY_MAX_BLKS * BLOCK_SIZE);
+      if (first > 0) {
+         fsi_inode_map(fs,ifile,first - 1,0,&d->goal);
+         d->goal += (d->goal != 0);
+      }
+   }
+   d->stamp = fs->delay_clock++;
+
+   // blocks new to the buffer start as zeros
+   if (end > d->first + d->nblks) {
+      memset(&d->data[d->nblks * BLOCK_SIZE],0,
+         (end - d->first - d->nblks) * BLOCK_SIZE);
+      d->nblks = end - d->first;
+   }
+   memcpy(&d->data[offset - d->first * BLOCK_SIZE],buffer,count);
+   ifile->size = MAX(offset + count, ifile->size);
+   return 0;
+}
+
+
+/*
+ * Directory index functions
+ */
+
+static unsigned fsi_name_hash(char* name)
+{
+   unsigned hash = 2166136261u;
+   for (; *name != '\0'; name++) {
+      hash ^= (unsigned char)*name;
+      hash *= 16777619u;
+   }
+   return hash;
+}
+
+
+// the index inode of a directory (which may be in a snapshot)
+static fs_inode_t* fsi_didx_inode(fs_t* fs, inodeid_t dir)
+{
+   return fsi_inode(fs,FS_SNAP_CHILD(dir,fsi_inode(fs,dir)->reserved[INODE_DIDX]));
+}
+
+
+static void fsi_didx_read(fs_t* fs, inodeid_t dir, unsigned id,
+   fs_didx_node_t* node)
+{
+   unsigned blk;
+   fsi_inode_map(fs,fsi_didx_inode(fs,dir),id,0,&blk);
+   block_read(fs->blocks,blk,(char*)node);
+}
+
+
+// writes a node, whose block may be shared with a snapshot
+static int fsi_didx_write(fs_t* fs, inodeid_t dir, unsigned id,
+   fs_didx_node_t* node)
+{
+   inodeid_t idx = fsi_inode(fs,dir)->reserved[INODE_DIDX];
+   unsigned blk;
+   if (fsi_inode_map(fs,fsi_inode(fs,idx),id,1,&blk) < 0) {
+      return -1;
+   }
+   block_write(fs->blocks,blk,(char*)node);
+   fsi_inode_dirty(fs,idx);
+   return 0;
+}
+
+
+// adds a node at the end of the index
+static int fsi_didx_node_new(fs_t* fs, inodeid_t dir, unsigned* id)
+{
+   inodeid_t idx = fsi_inode(fs,dir)->reserved[INODE_DIDX];
+   fs_inode_t* iidx = fsi_inode(fs,idx);
+   unsigned used = iidx->nblocks, blk;
+
+   *id = iidx->size / BLOCK_SIZE;
+   if (fsi_inode_map(fs,iidx,*id,1,&blk) < 0) {
+      fsi_inode_trunc(fs,iidx,*id);
+      return -1;
+   }
+   iidx->size += BLOCK_SIZE;
+   fsi_inode_dirty(fs,idx);
+   fsi_usage_add(fs,dir,iidx->nblocks - used);
+   return 0;
+}
+
+
+// finds the slot of a name in a node: in a leaf, the first entry not
+// below the name; in an inner node, the child whose subtree holds it
+static unsigned fsi_didx_search(fs_didx_node_t* node, char* name)
+{
+   unsigned lo = 0, hi = node->count;
+   while (lo < hi) {
+      unsigned mid = (lo + hi) / 2;
+      if (strcmp(node->entry[mid].name,name) < 0) {
+         lo = mid + 1;
+      } else {
+         hi = mid;
+      }
+   }
+   if (node->leaf ||
+      (lo < node->count && strcmp(node->entry[lo].name,name) == 0)) {
+      return lo;
+   }
+   return (lo > 0) ? lo - 1 : 0;
+}
+
+
+/*
+ * fsi_didx_descend: goes down the tree to the leaf where a name is (or
+ * would be), left in 'node'
+ * - path, slots: the nodes and the slots taken on the way [out]
+ *   returns: the depth of the leaf
+ */
+static int fsi_didx_descend(fs_t* fs, inodeid_t dir, char* name,
+   fs_didx_node_t* node, unsigned* path, unsigned* slots)
+{
+   int depth = 0;
+   path[0] = 0;
+   while (1) {
+      fsi_didx_read(fs,dir,path[depth],node);
+      slots[depth] = fsi_didx_search(node,name);
+      if (node->leaf || node->count == 0 || depth + 1 == DIDX_MAX_DEPTH) {
+         return depth;
+      }
+      path[depth + 1] = node->entry[slots[depth]].pos;
+      depth++;
+   }
+}
+
+
+/*
+ * fsi_didx_find: finds the leaf entry of a name
+ * - node: the leaf [out]
+ * - id: the node of the leaf [out]
+ *   returns: the slot of the entry in the leaf, -1 if it does not exist
+ */
+static int fsi_didx_find(fs_t* fs, inodeid_t dir, char* name,
+   fs_didx_node_t* node, unsigned* id)
+{
+   unsigned path[DIDX_MAX_DEPTH], slots[DIDX_MAX_DEPTH];
+   int depth = fsi_didx_descend(fs,dir,name,node,path,slots);
+   unsigned k = slots[depth];
+
+   *id = path[depth];
+   if (k < node->count && strcmp(node->entry[k].name,name) == 0) {
+      return k;
+   }
+   return -1;
+}
+
+
+static int fsi_didx_lookup(fs_t* fs, inodeid_t dir, char* name,
+   fs_didx_entry_t* entry)
+{
+   FS_BLOCK_BUF(fs_didx_node_t,node);
+   unsigned id;
+   int k = fsi_didx_find(fs,dir,name,node,&id);
+   if (k < 0) {
+      return -1;
+   }
+   *entry = node->entry[k];
+   return 0;
+}
+
+
+/*
+ * fsi_didx_insert: adds an entry to the index, splitting the full nodes
+ * on the way up; the root stays in node 0, its halves going to new nodes
+ *   returns: 0 if successful, -1 otherwise (the index is to be dropped)
+ */
+static int fsi_didx_insert(fs_t* fs, inodeid_t dir, char* name,
+   unsigned pos, inodeid_t ino)
+{
+   FS_BLOCK_BUF(fs_didx_node_t,node);
+   FS_BLOCK_BUF(fs_didx_node_t,right);
+   unsigned path[DIDX_MAX_DEPTH], slots[DIDX_MAX_DEPTH];
+   int depth = fsi_didx_descend(fs,dir,name,node,path,slots);
+   unsigned k = slots[depth];
+
+   fs_didx_entry_t e;
+   memset(&e,0,sizeof(e));
+   strcpy(e.name,name);
+   e.pos = pos;
+   e.ino = ino;
+
+   while (node->count == DIDX_NODE_ENTRIES) {
+      unsigned lid = path[depth], rid;
+      if (fsi_didx_node_new(fs,dir,&rid) < 0 ||
+         (depth == 0 && fsi_didx_node_new(fs,dir,&lid) < 0)) {
+         return -1;
+      }
+
+      // the upper half of the entries (with the new one) goes right
+      unsigned num = node->count + 1, half = num / 2;
+      memset(right,0,BLOCK_SIZE);
+      for (unsigned i = half; i < num; i++) {
+         right->entry[i - half] = (i < k) ? node->entry[i] :
+            (i == k) ? e : node->entry[i - 1];
+      }
+      if (k < half) {
+         memmove(&node->entry[k + 1],&node->entry[k],
+            (half - 1 - k) * sizeof(fs_didx_entry_t));
+         node->entry[k] = e;
+      }
+      right->leaf = node->leaf;
+      right->count = num - half;
+      node->count = half;
+      if (node->leaf) {
+         right->next = node->next;
+         node->next = rid;
+      }
+      if (fsi_didx_write(fs,dir,lid,node) < 0 ||
+         fsi_didx_write(fs,dir,rid,right) < 0) {
+         return -1;
+      }
+
+      memset(&e,0,sizeof(e));
+      strcpy(e.name,right->entry[0].name);
+      e.pos = rid;
+      if (depth == 0) {
+         // a new root above both halves
+         memset(node,0,BLOCK_SIZE);
+         node->count = 2;
+         node->entry[0].pos = lid;
+         node->entry[1] = e;
+         return fsi_didx_write(fs,dir,0,node);
+      }
+      depth--;
+      fsi_didx_read(fs,dir,path[depth],node);
+      k = slots[depth] + 1;
+   }
+
+   memmove(&node->entry[k + 1],&node->entry[k],
+      (node->count - k) * sizeof(fs_didx_entry_t));
+   node->entry[k] = e;
+   node->count++;
+   return fsi_didx_write(fs,dir,path[depth],node);
+}
+
+
+/*
+ * fsi_didx_remove: removes the entry of a name from the index
+ *   returns: 0 if successful, -1 otherwise (the index is to be dropped)
+ */
+static int fsi_didx_remove(fs_t* fs, inodeid_t dir, char* name)
+{
+   FS_BLOCK_BUF(fs_didx_node_t,node);
+   unsigned id;
+   int k = fsi_didx_find(fs,dir,name,node,&id);
+   if (k < 0) {
+      return -1;
+   }
+   memmove(&node->entry[k],&node->entry[k + 1],
+      (node->count - k - 1) * sizeof(fs_didx_entry_t));
+   node->count--;
+   return fsi_didx_write(fs,dir,id,node);
+}
+
+
+/*
+ * fsi_didx_move: records the new position of an entry moved inside the
+ * directory
+ *   returns: 0 if successful, -1 otherwise (the index is to be dropped)
+ */
+static int fsi_didx_move(fs_t* fs, inodeid_t dir, char* name, unsigned pos)
+{
+   FS_BLOCK_BUF(fs_didx_node_t,node);
+   unsigned id;
+   int k = fsi_didx_find(fs,dir,name,node,&id);
+   if (k < 0) {
+      return -1;
+   }
+   node->entry[k].pos = pos;
+   return fsi_didx_write(fs,dir,id,node);
+}
+
+
+/*
+ * fsi_didx_relink: records the new inode of an entry replaced in place
+ *   returns: 0 if successful, -1 otherwise (the index is to be dropped)
+ */
+static int fsi_didx_relink(fs_t* fs, inodeid_t dir, char* name,
+   inodeid_t ino)
+{
+   FS_BLOCK_BUF(fs_didx_node_t,node);
+   unsigned id;
+   int k = fsi_didx_find(fs,dir,name,node,&id);
+   if (k < 0) {
+      return -1;
+   }
+   node->entry[k].ino = ino;
+   return fsi_didx_write(fs,dir,id,node);
+}
+
+
+/*
+ * fsi_didx_list: lists the entries of the index in name order, starting
+ * after the name 'after' ("" -> from the first)
+ *   returns: the number of entries written to 'list'
+ */
+static int fsi_didx_list(fs_t* fs, inodeid_t dir, char* after,
+   fs_didx_entry_t* list, int max)
+{
+   FS_BLOCK_BUF(fs_didx_node_t,node);
+   unsigned path[DIDX_MAX_DEPTH], slots[DIDX_MAX_DEPTH];
+   int depth = fsi_didx_descend(fs,dir,after,node,path,slots);
+   unsigned k = slots[depth];
+   int num = 0;
+
+   if (k < node->count && strcmp(node->entry[k].name,after) == 0) {
+      k++;
+   }
+   while (num < max) {
+      if (k < node->count) {
+         list[num++] = node->entry[k++];
+      } else if (node->next != 0) {
+         fsi_didx_read(fs,dir,node->next,node);
+         k = 0;
+      } else {
+         break;
+      }
+   }
+   return num;
+}
+
+
+// checks if the index has much more nodes than its entries need
+static int fsi_didx_sparse(fs_t* fs, inodeid_t dir, unsigned factor)
+{
+   unsigned num = fsi_inode(fs,dir)->size / sizeof(fs_dentry_t);
+   return fsi_didx_inode(fs,dir)->size / BLOCK_SIZE >
+      factor * (num / DIDX_FILL + 1);
+}
+
+
+static void fsi_didx_drop(fs_t* fs, inodeid_t dir)
+{
+   fs_inode_t* idir = fsi_inode(fs,dir);
+   inodeid_t idx = idir->reserved[INODE_DIDX];
+
+   if (idx != 0) {
+      fsi_usage_add(fs,dir,-(int)fsi_inode(fs,idx)->nblocks);
+      fsi_inode_trunc(fs,fsi_inode(fs,idx),0);
+      fsi_inode_dirty(fs,idx);
+      fsi_ino_free(fs,idx);
+      idir->reserved[INODE_DIDX] = 0;
+      fsi_inode_dirty(fs,dir);
+   }
+}
+
+
+static int fsi_didx_cmp(const void* a, const void* b)
+{
+   return strcmp(((fs_didx_entry_t*)a)->name,((fs_didx_entry_t*)b)->name);
+}
+
+
+/*
+ * fsi_didx_build: (re)builds the index of a directory from its entries,
+ * sorted in memory; the nodes are filled up to DIDX_FILL entries, the
+ * leaves first, then each level of inner nodes up to the root
+ *   returns: 0 if successful, -1 otherwise (the directory is left
+ *   without index)
+ */
+static int fsi_didx_build(fs_t* fs, inodeid_t dir)
+{
+   fs_inode_t* idir = fsi_inode(fs,dir);
+   inodeid_t idx = idir->reserved[INODE_DIDX];
+   unsigned num = idir->size / sizeof(fs_dentry_t);
+   unsigned blk;
+
+   // the number of nodes of each level and where each level starts, the
+   // root being node 0
+   unsigned count[DIDX_MAX_DEPTH], base[DIDX_MAX_DEPTH], nodes = 0;
+   int top = 0;
+   count[0] = MAX((num + DIDX_FILL - 1) / DIDX_FILL, 1);
+   while (count[top] > 1) {
+      count[top + 1] = (count[top] + DIDX_FILL - 1) / DIDX_FILL;
+      top++;
+   }
+   base[top] = nodes++;
+   for (int l = 0; l < top; l++) {
+      base[l] = nodes;
+      nodes += count[l];
+   }
+
+   if (idx == 0) {
+      if (fsi_ino_alloc(fs,&idx) < 0) {
+         return -1;
+      }
+      fsi_inode_init(fsi_inode(fs,idx),FS_DIR_INDEX,dir);
+      idir->reserved[INODE_DIDX] = idx;
+      fsi_inode_dirty(fs,dir);
+   }
+
+   fs_inode_t* iidx = fsi_inode(fs,idx);
+   fsi_usage_add(fs,dir,-(int)iidx->nblocks);
+   fsi_inode_trunc(fs,iidx,0);
+   iidx->size = 0;
+   fsi_inode_dirty(fs,idx);
+   for (unsigned i = 0; i < nodes; i++) {
+      if (fsi_inode_map(fs,iidx,i,1,&blk) < 0) {
+         fsi_usage_add(fs,dir,iidx->nblocks);
+         fsi_didx_drop(fs,dir);
+         return -1;
+      }
+   }
+   iidx->size = nodes * BLOCK_SIZE;
+   fsi_usage_add(fs,dir,iidx->nblocks);
+
+   // the entries, in name order
+   fs_didx_entry_t* all = (fs_didx_entry_t*)
+      calloc(MAX(num,1),sizeof(fs_didx_entry_t));
+   FS_BLOCK_BUF(fs_dpage_t,page);
+   for (unsigned pos = 0; pos < num; pos++) {
+      if (pos % DIR_PAGE_ENTRIES == 0) {
+         fsi_inode_map(fs,idir,pos / DIR_PAGE_ENTRIES,0,&blk);
+         block_read(fs->blocks,blk,page->data);
+      }
+      strcpy(all[pos].name,page->entry[pos % DIR_PAGE_ENTRIES].name);
+      all[pos].pos = pos;
+      all[pos].ino = page->entry[pos % DIR_PAGE_ENTRIES].inodeid;
+   }
+   qsort(all,num,sizeof(fs_didx_entry_t),fsi_didx_cmp);
+
+   // fill in the nodes, each written once; 'first' keeps the first entry
+   // under each node of the level below
+   FS_BLOCK_BUF(fs_didx_node_t,node);
+   unsigned* first = (unsigned*) malloc(count[0] * sizeof(unsigned));
+   for (int l = 0; l <= top; l++) {
+      unsigned below = (l == 0) ? num : count[l - 1];
+      for (unsigned j = 0; j < count[l]; j++) {
+         memset(node,0,BLOCK_SIZE);
+         node->leaf = (l == 0);
+         node->count = MIN(DIDX_FILL, below - j * DIDX_FILL);
+         for (unsigned i = 0; i < node->count; i++) {
+            unsigned c = j * DIDX_FILL + i;
+            if (l == 0) {
+               node->entry[i] = all[c];
+            } else {
+               strcpy(node->entry[i].name,all[first[c]].name);
+               node->entry[i].pos = base[l - 1] + c;
+            }
+         }
+         if (l == 0 && j + 1 < count[0]) {
+            node->next = base[0] + j + 1;
+         }
+         first[j] = (l == 0) ? j * DIDX_FILL : first[j * DIDX_FILL];
+         fsi_inode_map(fs,iidx,base[l] + j,0,&blk);
+         block_write(fs->blocks,blk,(char*)node);
+      }
+   }
+   free(first);
+   free(all);
+   return 0;
+}
+
+
+/*
+ * Dentry cache functions
+ */
+
+static unsigned fsi_dcache_hash(inodeid_t dir, char* name)
+{
+   return (fsi_name_hash(name) ^ (dir * 2654435761u)) % DCACHE_BUCKETS;
+}
+
+
+static fs_dcache_t* fsi_dcache_find(fs_t* fs, inodeid_t dir, char* name)
+{
+   unsigned i = fs->dcache_bucket[fsi_dcache_hash(dir,name)];
+   while (i != 0) {
+      fs_dcache_t* entry = &fs->dcache[i - 1];
+      if (entry->dir == dir && strcmp(entry->name,name) == 0) {
+         entry->stamp = ++fs->dcache_clock;
+         return entry;
+      }
+      i = entry->next;
+   }
+   return NULL;
+}
+
+
+static void fsi_dcache_unlink(fs_t* fs, fs_dcache_t* entry)
+{
+   unsigned* ref = &fs->dcache_bucket[fsi_dcache_hash(entry->dir,entry->name)];
+   while (&fs->dcache[*ref - 1] != entry) {
+      ref = &fs->dcache[*ref - 1].next;
+   }
+   *ref = entry->next;
+   entry->dir = 0;
+   entry->stamp = 0;
+}
+
+
+/*
+ * fsi_dcache_set: records that 'name' in 'dir' is inode 'ino' (or does
+ * not exist, if 'ino' is 0), replacing the least recently used entry
+ */
+static void fsi_dcache_set(fs_t* fs, inodeid_t dir, char* name, inodeid_t ino)
+{
+   fs_dcache_t* entry = fsi_dcache_find(fs,dir,name);
+   if (entry != NULL) {
+      entry->ino = ino;
+      return;
+   }
+
+   entry = &fs->dcache[0];
+   for (int i = 1; i < DCACHE_SIZE && entry->dir != 0; i++) {
+      if (fs->dcache[i].stamp < entry->stamp) {
+         entry = &fs->dcache[i];
+      }
+   }
+   if (entry->dir != 0) {
+      fsi_dcache_unlink(fs,entry);
+   }
+
+   unsigned* head = &fs->dcache_bucket[fsi_dcache_hash(dir,name)];
+   entry->dir = dir;
+   entry->ino = ino;
+   strcpy(entry->name,name);
+   entry->stamp = ++fs->dcache_clock;
+   entry->next = *head;
+   *head = entry - fs->dcache + 1;
+}
+
+
+// drops the entries of a directory being removed
+static void fsi_dcache_purge(fs_t* fs, inodeid_t dir)
+{
+   for (int i = 0; i < DCACHE_SIZE; i++) {
+      if (fs->dcache[i].dir == dir) {
+         fsi_dcache_unlink(fs,&fs->dcache[i]);
+      }
+   }
+}
+
+
+/*
+ * Directory functions
+ */
+
+static int fsi_dir_search(fs_t* fs, inodeid_t dir, char* file, 
+   inodeid_t* fileid)
+{
+   FS_BLOCK_BUF(fs_dpage_t,page);
+   fs_inode_t* idir = fsi_inode(fs,dir);
+   int num = idir->size / sizeof(fs_dentry_t);
+   unsigned iblock = 0, blk;
+
+   fs_dcache_t* entry = fsi_dcache_find(fs,dir,file);
+   if (entry != NULL) {
+      if (entry->ino == 0) {
+         return -1;
+      }
+      *fileid = entry->ino;
+      return 0;
+   }
+
+   if (idir->reserved[INODE_DIDX] != 0) {
+      fs_didx_entry_t found;
+      if (fsi_didx_lookup(fs,dir,file,&found) < 0) {
+         fsi_dcache_set(fs,dir,file,0);
+         return -1;
+      }
+      *fileid = FS_SNAP_CHILD(dir,found.ino);
+      fsi_dcache_set(fs,dir,file,*fileid);
+      return 0;
+   }
+
+   while (num > 0) {
+      fsi_inode_map(fs,idir,iblock++,0,&blk);
+      block_read(fs->blocks,blk,page->data);
+      for (int i = 0; i < DIR_PAGE_ENTRIES && num > 0; i++, num--) {
+         if (strcmp(page->entry[i].name,file) == 0) {
+            *fileid = FS_SNAP_CHILD(dir,page->entry[i].inodeid);
+            fsi_dcache_set(fs,dir,file,*fileid);
+            return 0;
+         }
+      }
+   }
+   fsi_dcache_set(fs,dir,file,0);
+   return -1;
+}
+
+
+/*
+ * fsi_dir_add: adds an entry to a directory, augmenting the directory
+ * with a new page if the last one is full; the index of the directory is
+ * built when the directory gets large
+ *   returns: 0 if successful, -1 otherwise
+ */
+static int fsi_dir_add(fs_t* fs, inodeid_t dir, char* name, inodeid_t ino)
+{
+   FS_BLOCK_BUF(fs_dpage_t,page);
+   fs_inode_t* idir = fsi_inode(fs,dir);
+   unsigned num = idir->size / sizeof(fs_dentry_t);
+   unsigned iblock = num / DIR_PAGE_ENTRIES, blk;
+
+   if (num % DIR_PAGE_ENTRIES == 0) {
+      unsigned used = idir->nblocks;
+      if (fsi_inode_map(fs,idir,iblock,1,&blk) < 0) {
+         fsi_inode_trunc(fs,idir,iblock);
+         return -1;
+      }
+      fsi_usage_add(fs,dir,idir->nblocks - used);
+      memset(page,0,BLOCK_SIZE);
+   } else {
+      // the page may be shared with a snapshot
+      if (fsi_inode_map(fs,idir,iblock,1,&blk) < 0) {
+         return -1;
+      }
+      block_read(fs->blocks,blk,page->data);
+   }
+
+   fs_dentry_t* entry = &page->entry[num % DIR_PAGE_ENTRIES];
+   strcpy(entry->name,name);
+   entry->inodeid = ino;
+   block_write(fs->blocks,blk,page->data);
+   idir->size += sizeof(fs_dentry_t);
+   fsi_inode_dirty(fs,dir);
+   fsi_dcache_set(fs,dir,name,ino);
+
+   // keep the index up to date
+   if (idir->reserved[INODE_DIDX] != 0) {
+      if (fsi_didx_insert(fs,dir,name,num,ino) < 0) {
+         fsi_didx_drop(fs,dir);
+      }
+   } else if (num + 1 > DIR_INDEX_MIN) {
+      fsi_didx_build(fs,dir);
+   }
+   return 0;
+}
+
+
+/*
+ * fsi_dir_find: finds an entry of a directory, through its index when it
+ * has one
+ * - page: the page holding the entry [out]
+ * - blk: the block of that page [out]
+ *   returns: the position of the entry, -1 if it does not exist
+ */
+static int fsi_dir_find(fs_t* fs, inodeid_t dir, char* name,
+   fs_dpage_t* page, unsigned* blk)
+{
+   fs_inode_t* idir = fsi_inode(fs,dir);
+   int num = idir->size / sizeof(fs_dentry_t);
+
+   if (idir->reserved[INODE_DIDX] != 0) {
+      fs_didx_entry_t found;
+      if (fsi_didx_lookup(fs,dir,name,&found) < 0) {
+         return -1;
+      }
+      fsi_inode_map(fs,idir,found.pos / DIR_PAGE_ENTRIES,0,blk);
+      block_read(fs->blocks,*blk,page->data);
+      return found.pos;
+   }
+
+   for (unsigned iblock = 0; iblock * DIR_PAGE_ENTRIES < num; iblock++) {
+      fsi_inode_map(fs,idir,iblock,0,blk);
+      block_read(fs->blocks,*blk,page->data);
+      for (int i = 0; i < DIR_PAGE_ENTRIES &&
+            iblock * DIR_PAGE_ENTRIES + i < num; i++) {
+         if (strcmp(page->entry[i].name,name) == 0) {
+            return iblock * DIR_PAGE_ENTRIES + i;
+         }
+      }
+   }
+   return -1;
+}
+
+
+/*
+ * fsi_dir_del: removes an entry from a directory; the last entry of the
+ * directory takes the place of the removed one and the last page is
+ * released when it gets empty
+ * - ino: the inode of the removed entry [out]
+ *   returns: 0 if successful, -1 if the entry does not exist (or the
+ *   page holding it cannot be copied)
+ */
+static int fsi_dir_del(fs_t* fs, inodeid_t dir, char* name, inodeid_t* ino)
+{
+   FS_BLOCK_BUF(fs_dpage_t,page);
+   FS_BLOCK_BUF(fs_dpage_t,last);
+   fs_inode_t* idir = fsi_inode(fs,dir);
+   int num = idir->size / sizeof(fs_dentry_t);
+   int indexed = (idir->reserved[INODE_DIDX] != 0);
+   unsigned blk;
+
+   int pos = fsi_dir_find(fs,dir,name,page,&blk);
+   if (pos < 0) {
+      return -1;
+   }
+
+   // the page changed may be shared with a snapshot
+   if (pos != num - 1 &&
+      fsi_inode_map(fs,idir,pos / DIR_PAGE_ENTRIES,1,&blk) < 0) {
+      return -1;
+   }
+   *ino = page->entry[pos % DIR_PAGE_ENTRIES].inodeid;
+   fsi_dcache_set(fs,dir,name,0);
+
+   // move the last entry to the position of the removed one
+   int lastpos = num - 1;
+   fs_dentry_t moved;
+   if (pos != lastpos) {
+      unsigned lastblk;
+      fsi_inode_map(fs,idir,lastpos / DIR_PAGE_ENTRIES,0,&lastblk);
+      if (lastblk == blk) {
+         moved = page->entry[lastpos % DIR_PAGE_ENTRIES];
+      } else {
+         block_read(fs->blocks,lastblk,last->data);
+         moved = last->entry[lastpos % DIR_PAGE_ENTRIES];
+      }
+      page->entry[pos % DIR_PAGE_ENTRIES] = moved;
+      block_write(fs->blocks,blk,page->data);
+   }
+
+   idir->size -= sizeof(fs_dentry_t);
+   if (lastpos % DIR_PAGE_ENTRIES == 0) {
+      unsigned used = idir->nblocks;
+      fsi_inode_trunc(fs,idir,lastpos / DIR_PAGE_ENTRIES);
+      fsi_usage_add(fs,dir,idir->nblocks - used);
+   }
+   fsi_inode_dirty(fs,dir);
+
+   // keep the index up to date
+   if (indexed && lastpos == 0) {
+      fsi_didx_drop(fs,dir);
+   } else if (indexed) {
+      if (fsi_didx_remove(fs,dir,name) < 0 || (pos != lastpos &&
+         fsi_didx_move(fs,dir,moved.name,pos) < 0)) {
+         fsi_didx_drop(fs,dir);
+      } else if (fsi_didx_sparse(fs,dir,4)) {
+         fsi_didx_build(fs,dir);
+      }
+   }
+   return 0;
+}
+
+
+/*
+ * fsi_dir_set: rewrites an entry of a directory in place, as 'newname'
+ * for inode 'ino', writing only the page holding it
+ *   returns: 0 if successful, -1 if the entry does not exist (or the
+ *   page holding it cannot be copied)
+ */
+static int fsi_dir_set(fs_t* fs, inodeid_t dir, char* name, char* newname,
+   inodeid_t ino)
+{
+   FS_BLOCK_BUF(fs_dpage_t,page);
+   fs_inode_t* idir = fsi_inode(fs,dir);
+   unsigned blk;
+
+   int pos = fsi_dir_find(fs,dir,name,page,&blk);
+   if (pos < 0) {
+      return -1;
+   }
+
+   // the page changed may be shared with a snapshot
+   if (fsi_inode_map(fs,idir,pos / DIR_PAGE_ENTRIES,1,&blk) < 0) {
+      return -1;
+   }
+   fs_dentry_t* entry = &page->entry[pos % DIR_PAGE_ENTRIES];
+   strcpy(entry->name,newname);
+   entry->inodeid = ino;
+   block_write(fs->blocks,blk,page->data);
+   fsi_dcache_set(fs,dir,name,0);
+   fsi_dcache_set(fs,dir,newname,ino);
+
+   // keep the index up to date
+   if (idir->reserved[INODE_DIDX] != 0) {
+      int status = (strcmp(name,newname) == 0) ?
+         fsi_didx_relink(fs,dir,name,ino) :
+         (fsi_didx_remove(fs,dir,name) < 0) ? -1 :
+         fsi_didx_insert(fs,dir,newname,pos,ino);
+      if (status < 0) {
+         fsi_didx_drop(fs,dir);
+      }
+   }
+   return 0;
+}
+
+
+/*
+ * Snapshot functions
+ */
+
+// finds a snapshot by name, returning its slot or -1
+static int fsi_snap_find(fs_t* fs, char* name)
+{
+   for (int i = 0; i < FS_MAX_SNAPSHOTS; i++) {
+      if (fs->snaps[i].rec.name[0] != '\0' &&
+         strcmp(fs->snaps[i].rec.name,name) == 0) {
+         return i;
+      }
+   }
+   return -1;
+}
+
+
+/*
+ * File system interface functions
+ */
+
+
+void io_delay_on(int disk_delay);
+
+fs_t* fs_new(char* image, unsigned num_blocks, int disk_delay)
+{
+   blocks_t* bks = (image == NULL) ?
+      block_new(num_blocks,FS_MIN_BLOCK_SIZE) :
+      block_create(image,num_blocks,FS_MIN_BLOCK_SIZE);
+   if (bks == NULL) {
+      dprintf("[fs_new] unable to create the storage.\n");
+      return NULL;
+   }
+   fs_t* fs = (fs_t*) calloc(1,sizeof(fs_t));
+   fs->blocks = bks;
+   fsi_locks_init(fs);
+   io_delay_on(disk_delay);
+   return fs;
+}
+
+
+fs_t* fs_mount(char* image, int disk_delay)
+{
+   if (image == NULL) {
+      dprintf("[fs_mount] malformed arguments.\n");
+      return NULL;
+   }
+
+   blocks_t* bks = block_open(image);
+   if (bks == NULL) {
+      dprintf("[fs_mount] unable to open the image '%s'.\n",image);
+      return NULL;
+   }
+   fs_t* fs = (fs_t*) calloc(1,sizeof(fs_t));
+   fs->blocks = bks;
+   fsi_locks_init(fs);
+   io_delay_on(disk_delay);
+
+   if (fsi_load_fsdata(fs) < 0) {
+      dprintf("[fs_mount] the image holds no file system.\n");
+      fsi_free_fsdata(fs);
+      fsi_locks_free(fs);
+      block_free(bks);
+      free(fs);
+      return NULL;
+   }
+   return fs;
+}
+
+
+int fs_format(fs_t* fs, unsigned block_sz)
+{
+   if (fs == NULL) {
+      printf("[fs] argument is null.\n");
+      return -1;
+   }
+
+   if (block_sz < FS_MIN_BLOCK_SIZE || block_sz > FS_MAX_BLOCK_SIZE ||
+      (block_sz & (block_sz - 1)) != 0) {
+      printf("[fs] invalid block size %u.\n",block_sz);
+      return -1;
+   }
+
+   // the storage keeps its size, cut into blocks of the new size
+   blocks_t* bks = fs->blocks;
+   unsigned capacity = block_num_blocks(bks) * block_size(bks);
+   if (block_size(bks) != block_sz) {
+      if (capacity / block_sz < 2 || block_set_size(bks,block_sz) < 0) {
+         printf("[fs] storage too small for blocks of %u bytes.\n",block_sz);
+         return -1;
+      }
+   }
+
+   // fill in the superblock; only the metadata is written, the data
+   // blocks are left as they are (see the block allocation functions)
+   unsigned num_blocks = block_num_blocks(fs->blocks);
+   fsi_free_fsdata(fs);
+   memset(&fs->sb,0,sizeof(fs->sb));
+   fs->sb.magic = FS_MAGIC;
+   fs->sb.block_size = block_sz;
+   fs->sb.num_blocks = num_blocks;
+   fs->sb.bmap_start = 1;
+   fs->sb.bmap_blks = (num_blocks + BMAP_BLK_BITS - 1) / BMAP_BLK_BITS;
+   fs->sb_dirty = 1;
+
+   // reserve file system meta data blocks
+   fs->blk_bmap = (char*) calloc(fs->sb.bmap_blks,BLOCK_SIZE);
+   fs->blk_bmap_dirty = (char*) malloc(fs->sb.bmap_blks);
+   memset(fs->blk_bmap_dirty,1,fs->sb.bmap_blks);
+   for (unsigned i = 0; i < fs->sb.bmap_start + fs->sb.bmap_blks; i++) {
+      BMAP_SET(fs->blk_bmap,i);
+   }
+   fs->sb.free_blocks = num_blocks - fs->sb.bmap_start - fs->sb.bmap_blks;
+   fsi_ftree_build(fs);
+
+   // create the inode table and reserve inodes 0 (will never be used)
+   // and 1 (the root)
+   unsigned ino;
+   if (fsi_itab_grow(fs) < 0 || fsi_ino_alloc(fs,&ino) < 0 ||
+      fsi_ino_alloc(fs,&ino) < 0) {
+      printf("[fs] unable to create the inode table.\n");
+      return -1;
+   }
+   fsi_inode_init(fsi_inode(fs,1),FS_DIR,0);
+   fsi_inode_dirty(fs,1);
+
+   // save the file system metadata
+   fsi_store_fsdata(fs);
+   return 0;
+}
+
+
+
+int fs_get_attrs(fs_t* fs, inodeid_t file, fs_file_attrs_t* attrs)
+{
+   if (fs == NULL || attrs == NULL) {
+      dprintf("[fs_get_attrs] malformed arguments.\n");
+      return -1;
+   }
+
+   fsi_meta_lock(fs);
+   if (!fsi_inode_used(fs,file)) {
+      fsi_meta_unlock(fs);
+      dprintf("[fs_get_attrs] inode is not being used.\n");
+      return -1;
+   }
+
+   fs_inode_t* inode = fsi_inode(fs,file);
+   attrs->inodeid = file;
+   attrs->type = inode->type;
+   attrs->size = inode->size;
+   switch (inode->type) {
+      case FS_DIR:
+         attrs->num_entries = inode->size / sizeof(fs_dentry_t);
+         break;
+      case FS_FILE:
+         attrs->num_entries = -1;
+         break;
+      default:
+         dprintf("[fs_get_attrs] fatal error - invalid inode.\n");
+         exit(-1);
+   }
+   fsi_meta_unlock(fs);
+   return 0;
+}
+
+
+static int fsi_lookup(fs_t* fs, char* file, inodeid_t* fileid)
+{
+   if (fs == NULL || file == NULL || fileid == NULL) {
+      dprintf("[fs_lookup] malformed arguments.\n");
+      return -1;
+   }
+
+   if (file[0] != '/') {
+      dprintf("[fs_lookup] malformed pathname.\n");
+      return -1;
+   }
+
+   // walk the path one component at a time, without modifying it
+   char name[FS_MAX_FNAME_SZ];
+   inodeid_t dir = 1;  // root directory
+   int snapdir = 0;    // set after FS_SNAP_DIR, in the root
+   char* p = file;
+   while (1) {
+      while (*p == '/') {
+         p++;
+      }
+      if (*p == '\0') {
+         break;
+      }
+      size_t len = strcspn(p,"/");
+      if (len + 1 > FS_MAX_FNAME_SZ) {
+         dprintf("[fs_lookup] file does not exist.\n");
+         return 0;
+      }
+      memcpy(name,p,len);
+      name[len] = '\0';
+      p += len;
+
+      // the snapshots appear by name in FS_SNAP_DIR
+      if (snapdir) {
+         int s = fsi_snap_find(fs,name);
+         if (s < 0) {
+            dprintf("[fs_lookup] file does not exist.\n");
+            return 0;
+         }
+         dir = FS_SNAP_ROOT(s);
+         snapdir = 0;
+         continue;
+      }
+      if (dir == 1 && strcmp(name,FS_SNAP_DIR) == 0) {
+         snapdir = 1;
+         continue;
+      }
+
+      if (!fsi_inode_used(fs,dir)) {
+         dprintf("[fs_lookup] inode is not being used.\n");
+         return -1;
+      }
+      if (fsi_inode(fs,dir)->type != FS_DIR) {
+         dprintf("[fs_lookup] inode is not a directory.\n");
+         return -1;
+      }
+      if (fsi_dir_search(fs,dir,name,&dir) < 0) {
+         dprintf("[fs_lookup] file does not exist.\n");
+         return 0;
+      }
+   }
+   if (snapdir) {
+      dprintf("[fs_lookup] file does not exist.\n");
+      return 0;
+   }
+
+   *fileid = dir;
+   return 1;
+}
+
+
+// the walk only goes through the directory entry caches and pages, under
+// meta_lock, which every change of a directory holds
+int fs_lookup(fs_t* fs, char* file, inodeid_t* fileid)
+{
+   if (fs == NULL) {
+      dprintf("[fs_lookup] malformed arguments.\n");
+      return -1;
+   }
+   fsi_meta_lock(fs);
+   int status = fsi_lookup(fs,file,fileid);
+   fsi_meta_unlock(fs);
+   return status;
+}
+
+
+/*
+ * fsi_read: reads from a file whose lock is held (for reading); the data
+ * blocks are read without meta_lock
+ */
+static int fsi_read(fs_t* fs, inodeid_t file, unsigned offset,
+   unsigned count, char* buffer, int* nread)
+{
+	fsi_meta_lock(fs);
+	if (!fsi_inode_used(fs,file)) {
+		fsi_meta_unlock(fs);
+		dprintf("[fs_read] inode is not being used.\n");
+		return -1;
+	}
+
+	fs_inode_t* ifile = fsi_inode(fs,file);
+	fsi_meta_unlock(fs);
+	if (ifile->type != FS_FILE) {
+		dprintf("[fs_read] inode is not a file.\n");
+		return -1;
+	}
+
+	if (offset >= ifile->size) {
+		*nread = 0;
+		return 0;
+	}
+
+	// inline data needs no block access
+	if (INODE_INLINE(ifile)) {
+		*nread = MIN(count, ifile->size - offset);
+		memcpy(buffer, (char*)ifile->blocks + offset, *nread);
+		return 0;
+	}
+	
+   	// read the specified range
+	int pos = 0;
+	unsigned iblock = offset/BLOCK_SIZE;
+	int max = MIN(count,ifile->size-offset);
+	unsigned blk;
+	char block[BLOCK_SIZE];
+   
+	while (pos < max) {
+		fsi_meta_lock(fs);
+		fs_delay_t* d = fsi_delay_find(fs, file);
+		if (d != NULL && iblock >= d->first &&
+			iblock < d->first + d->nblks) {
+			// blocks not flushed yet are read from the delay buffer
+			memcpy(block, &d->data[(iblock - d->first) * BLOCK_SIZE],
+				BLOCK_SIZE);
+			fsi_meta_unlock(fs);
+		} else if (INODE_TAIL(ifile) &&
+			iblock == fsi_tail_block(fs, ifile)) {
+			// a packed tail is read from its fragment block
+			fsi_tail_read(fs, ifile, block);
+			fsi_meta_unlock(fs);
+		} else {
+			int status = fsi_inode_map(fs, ifile, iblock, 0, &blk);
+			fsi_meta_unlock(fs);
+			if (status < 0) {
+				dprintf("[fs_read] block %u cannot be mapped.\n", iblock);
+				return -1;
+			}
+
+			// blocks that were never written read as zeros
+			if (blk == 0) {
+				memset(block, 0, BLOCK_SIZE);
+			} else {
+				block_read(fs->blocks, blk, block);
+			}
+		}
+
+		int start = ((pos == 0)?(offset % BLOCK_SIZE):0);
+		int num = MIN(BLOCK_SIZE - start, max - pos);
+		memcpy(&buffer[pos],&block[start],num);
+
+		pos += num;
+		iblock++;
+	}
+	*nread = pos;
+	return 0;
+}
+
+
+int fs_read(fs_t* fs, inodeid_t file, unsigned offset, unsigned count, 
+   char* buffer, int* nread)
+{
+	if (fs==NULL || buffer==NULL || nread==NULL) {
+		dprintf("[fs_read] malformed arguments.\n");
+		return -1;
+	}
+
+	fsi_lock_set(fs, FS_LOCK_BIT(file), 0);
+	int status = fsi_read(fs, file, offset, count, buffer, nread);
+	fsi_unlock_set(fs, FS_LOCK_BIT(file), 0);
+	return status;
+}
+
+
+/*
+ * fsi_write: writes to a file whose lock is held (for writing); the
+ * blocks are mapped under meta_lock, but written without it
+ */
+static int fsi_write(fs_t* fs, inodeid_t file, unsigned offset,
+   unsigned count, char* buffer)
+{
+	fsi_meta_lock(fs);
+	if (!fsi_inode_used(fs,file)) {
+		fsi_meta_unlock(fs);
+		dprintf("[fs_write] inode is not being used.\n");
+		return -1;
+	}
+
+	fs_inode_t* ifile = fsi_inode(fs,file);
+	if (ifile->type != FS_FILE) {
+		fsi_meta_unlock(fs);
+		dprintf("[fs_write] inode is not a file.\n");
+		return -1;
+	}
+
+	if (FS_SNAP_OF(file) != 0) {
+		fsi_meta_unlock(fs);
+		dprintf("[fs_write] snapshots are read-only.\n");
+		return -1;
+	}
+
+	if (offset > ifile->size) {
+		offset = ifile->size;
+	}
+	unsigned used = ifile->nblocks;
+
+	// tiny files are written in the inode, until they outgrow it
+	if (INODE_INLINE(ifile)) {
+		if (offset + count <= INODE_INLINE_SZ) {
+			memcpy((char*)ifile->blocks + offset, buffer, count);
+			ifile->size = MAX(offset + count, ifile->size);
+			fsi_inode_dirty(fs, file);
+			fsi_store_fsdata(fs);
+			fsi_meta_unlock(fs);
+			return 0;
+		}
+		if (fsi_inode_promote(fs, ifile) < 0) {
+			fsi_meta_unlock(fs);
+			dprintf("[fs_write] there are no free blocks.\n");
+			return -1;
+		}
+	}
+
+	// a packed tail gets its block back before it is written over
+	if (INODE_TAIL(ifile) &&
+		offset + count > fsi_tail_block(fs, ifile) * BLOCK_SIZE &&
+		fsi_tail_unpack(fs, ifile) < 0) {
+		fsi_meta_unlock(fs);
+		dprintf("[fs_write] there are no free blocks.\n");
+		return -1;
+	}
+
+	unsigned blk;
+
+	unsigned blks_used = OFFSET_TO_BLOCKS(ifile->size);
+	unsigned blks_end = OFFSET_TO_BLOCKS(offset+count);
+
+	dprintf("[fs_write] count=%d, offset=%d, fsize=%d, bused=%d, bend=%d\n",
+		count,offset,ifile->size,blks_used,blks_end);
+	
+	if (blks_end > INODE_MAX_BLKS) {
+		fsi_meta_unlock(fs);
+		dprintf("[fs_write] no free block entries in inode.\n");
+		return -1;
+	}
+
+	// writes past the last block stay in memory until flushed, the
+	// others go to the disk after the data kept in memory (the flush
+	// accounts for the blocks it allocates)
+	unsigned flushed = ifile->nblocks;
+	int delayed = fsi_delay_write(fs, file, ifile, offset, count, buffer);
+	used += ifile->nblocks - flushed;
+	if (delayed <= 0) {
+		fsi_inode_dirty(fs, file);
+		fsi_usage_add(fs, ifile->parent, ifile->nblocks - used);
+		fsi_store_fsdata(fs);
+		fsi_meta_unlock(fs);
+		if (delayed < 0) {
+			dprintf("[fs_write] there are no free blocks.\n");
+		}
+		return delayed;
+	}
+
+	// map the blocks (and extending tables) before writing anything,
+	// allocating the new ones and copying the shared ones, so that the
+	// write remains atomic if the disk gets full; the holes of the file
+	// that get blocks are noted, their old content is not to be read
+	unsigned first = offset/BLOCK_SIZE;
+	unsigned char* holes = (unsigned char*) calloc((blks_end-first)/8 + 1, 1);
+	for (unsigned i = first; i < blks_end; i++) {
+		fsi_inode_map(fs, ifile, i, 0, &blk);
+		if (blk == 0)
+			BMAP_SET(holes, i - first);
+		if (fsi_inode_map(fs, ifile, i, 1, &blk) < 0) {
+			dprintf("[fs_write] there are no free blocks.\n");
+			for (unsigned j = first; j < MIN(i, blks_used); j++) {
+				if (BMAP_ISSET(holes, j - first))
+					fsi_inode_punch(fs, ifile, j, j + 1);
+			}
+			free(holes);
+			fsi_inode_trunc(fs, ifile, blks_used);
+			ifile->prealloc = 0;
+			fsi_inode_dirty(fs, file);
+			fsi_usage_add(fs, ifile->parent, ifile->nblocks - used);
+			fsi_store_fsdata(fs);
+			fsi_meta_unlock(fs);
+			return -1;
+		}
+	}
+	fsi_meta_unlock(fs);
+
+	char block[BLOCK_SIZE];
+	unsigned num = 0;
+	unsigned iblock = first;
+
+	while (num < count) {
+		fsi_meta_lock(fs);
+		fsi_inode_map(fs, ifile, iblock, 0, &blk);
+		fsi_meta_unlock(fs);
+
+		int start = ((num == 0)?(offset % BLOCK_SIZE):0);
+		int len = MIN(BLOCK_SIZE - start, count - num);
+
+		// partially written blocks keep their previous content
+		if (len < BLOCK_SIZE) {
+			if (iblock < blks_used && !BMAP_ISSET(holes, iblock - first)) {
+				block_read(fs->blocks, blk, block);
+			} else {
+				memset(block, 0, BLOCK_SIZE);
+			}
+		}
+		memcpy(&block[start], &buffer[num], len);
+		block_write(fs->blocks, blk, block);
+
+		num += len;
+		iblock++;
+	}
+	free(holes);
+
+	fsi_meta_lock(fs);
+	ifile->size = MAX(offset + count, ifile->size);
+	if (OFFSET_TO_BLOCKS(ifile->size) >= ifile->prealloc) {
+		ifile->prealloc = 0;
+	}
+	fsi_inode_dirty(fs, file);
+	fsi_usage_add(fs, ifile->parent, ifile->nblocks - used);
+
+   	// update the inode in disk
+	fsi_store_fsdata(fs);
+	fsi_meta_unlock(fs);
+
+	dprintf("[fs_write] written %d bytes, file size %d.\n", count, ifile->size);
+	return 0;
+}
+
+
+int fs_write(fs_t* fs, inodeid_t file, unsigned offset, unsigned count,
+   char* buffer)
+{
+	if (fs == NULL || buffer == NULL) {
+		dprintf("[fs_write] malformed arguments.\n");
+		return -1;
+	}
+
+	fsi_lock_set(fs, 0, FS_LOCK_BIT(file));
+	int status = fsi_write(fs, file, offset, count, buffer);
+	fsi_unlock_set(fs, 0, FS_LOCK_BIT(file));
+	return status;
+}
+
+
+/*
+ * fsi_block_zero: zeros the bytes of a file block from 'from' up to 'to'
+ * (offsets inside the block), copying the block first if it is shared;
+ * a hole is left as it is
+ *   returns: 0 if successful, -1 if there are no free blocks
+ */
+static int fsi_block_zero(fs_t* fs, fs_inode_t* inode, unsigned iblock,
+   unsigned from, unsigned to)
+{
+   char block[BLOCK_SIZE];
+   unsigned blk;
+
+   fsi_inode_map(fs,inode,iblock,0,&blk);
+   if (blk == 0 || from >= to) {
+      return 0;
+   }
+   if (fsi_inode_map(fs,inode,iblock,1,&blk) < 0) {
+      return -1;
+   }
+   block_read(fs->blocks,blk,block);
+   memset(&block[from],0,to - from);
+   block_write(fs->blocks,blk,block);
+   return 0;
+}
+
+
+// checks that a file can be changed, under meta_lock
+static int fsi_file_check(fs_t* fs, inodeid_t file, char* op)
+{
+   if (!fsi_inode_used(fs,file)) {
+      dprintf("[%s] inode is not being used.\n",op);
+      return -1;
+   }
+
+   if (fsi_inode(fs,file)->type != FS_FILE) {
+      dprintf("[%s] inode is not a file.\n",op);
+      return -1;
+   }
+
+   if (FS_SNAP_OF(file) != 0) {
+      dprintf("[%s] snapshots are read-only.\n",op);
+      return -1;
+   }
+
+   // the blocks kept in memory get theirs first
+   if (fsi_delay_sync(fs,file,0) < 0) {
+      dprintf("[%s] there are no free blocks.\n",op);
+      return -1;
+   }
+   return 0;
+}
+
+
+/*
+ * fsi_fallocate: allocates the blocks of a range of a file that are not
+ * mapped yet, in one run following the previous block of the file when
+ * there is one free; the blocks that come to be inside the file are
+ * written with zeros, the others are left for the writes to fill
+ *   returns: 0 if successful, -1 otherwise
+ */
+static int fsi_fallocate(fs_t* fs, inodeid_t file, unsigned offset,
+   unsigned len, int keep_size)
+{
+   if (fsi_file_check(fs,file,"fs_fallocate") < 0) {
+      return -1;
+   }
+
+   if (len == 0 || offset + len < offset ||
+      OFFSET_TO_BLOCKS(offset + len) > INODE_MAX_BLKS) {
+      dprintf("[fs_fallocate] invalid range.\n");
+      return -1;
+   }
+
+   fs_inode_t* ifile = fsi_inode(fs,file);
+   unsigned used = ifile->nblocks;
+   if ((INODE_INLINE(ifile) && fsi_inode_promote(fs,ifile) < 0) ||
+      fsi_tail_unpack(fs,ifile) < 0) {
+      dprintf("[fs_fallocate] there are no free blocks.\n");
+      fsi_usage_add(fs,ifile->parent,ifile->nblocks - used);
+      return -1;
+   }
+
+   // a file that grows gets the blocks between its end and the range too
+   unsigned size = keep_size ? ifile->size : MAX(ifile->size, offset + len);
+   unsigned old_blks = OFFSET_TO_BLOCKS(ifile->size);
+   unsigned new_blks = OFFSET_TO_BLOCKS(size);
+   unsigned first = keep_size ? offset / BLOCK_SIZE :
+      MIN(offset / BLOCK_SIZE, old_blks);
+   unsigned end = OFFSET_TO_BLOCKS(offset + len);
+
+   // count the missing blocks, checking that they (and their tables) fit;
+   // the allocations are serialized by meta_lock, so they remain free
+   unsigned missing = 0, blk;
+   for (unsigned i = first; i < end; i++) {
+      fsi_inode_map(fs,ifile,i,0,&blk);
+      missing += (blk == 0);
+   }
+   if (missing > 0) {
+      int need = missing + missing / EXT_INODE_NUM_BLKS + 2;
+      if (fsi_blk_reserve(fs,need) < 0) {
+         dprintf("[fs_fallocate] there are no free blocks.\n");
+         return -1;
+      }
+      fsi_blk_reserve(fs,-need);
+   }
+
+   // the missing blocks come from one run, or else from the fewest runs
+   // that hold them
+   unsigned hint = 0, start = 0, run = 0;
+   if (first > 0) {
+      fsi_inode_map(fs,ifile,first - 1,0,&hint);
+      hint += (hint != 0);
+   }
+   if (missing > 0) {
+      run = fsi_blk_alloc_run(fs,missing,hint,&start);
+   }
+
+   char zeros[BLOCK_SIZE];
+   unsigned blks[EXT_INODE_NUM_BLKS];
+   int status = 0;
+   memset(zeros,0,BLOCK_SIZE);
+   for (unsigned i = first; i < end && status == 0; ) {
+      unsigned num = MIN(end - i, EXT_INODE_NUM_BLKS);
+      int linking = 0;
+      for (unsigned j = 0; j < num; j++) {
+         fsi_inode_map(fs,ifile,i + j,0,&blk);
+         int fresh = (blk == 0);
+         if (fresh && run == 0) {
+            run = fsi_blk_alloc_run(fs,missing,start,&start);
+         }
+         if (fresh && run == 0) {
+            num = j;
+            status = -1;
+            break;
+         } else if (fresh) {
+            blk = start++;
+            run--;
+            missing--;
+         }
+         if (i + j < new_blks && (fresh || i + j >= old_blks)) {
+            block_write(fs->blocks,blk,zeros);
+         }
+         blks[j] = fresh ? blk : 0;
+         linking |= fresh;
+      }
+      for (unsigned j = 0; j < num && linking; ) {
+         int linked = fsi_inode_link(fs,ifile,i + j,&blks[j],num - j);
+         if (linked < 0) {
+            for (; j < num; j++) {
+               if (blks[j] != 0) {
+                  fsi_blk_free(fs,blks[j]);
+               }
+            }
+            status = -1;
+            break;
+         }
+         j += linked;
+      }
+      i += num;
+   }
+   // the blocks of the run that were not linked
+   for (; run > 0; run--) {
+      fsi_blk_free(fs,start++);
+   }
+
+   if (status == 0) {
+      ifile->size = size;
+   }
+   ifile->prealloc = MAX(ifile->prealloc, end);
+   if (OFFSET_TO_BLOCKS(ifile->size) >= ifile->prealloc) {
+      ifile->prealloc = 0;
+   }
+   fsi_inode_dirty(fs,file);
+   fsi_usage_add(fs,ifile->parent,ifile->nblocks - used);
+   fsi_store_fsdata(fs);
+   if (status < 0) {
+      dprintf("[fs_fallocate] there are no free blocks.\n");
+   }
+   return status;
+}
+
+
+int fs_fallocate(fs_t* fs, inodeid_t file, unsigned offset, unsigned len,
+   int keep_size)
+{
+   if (fs == NULL) {
+      dprintf("[fs_fallocate] malformed arguments.\n");
+      return -1;
+   }
+
+   fsi_lock_set(fs,0,FS_LOCK_BIT(file));
+   fsi_meta_lock(fs);
+   int status = fsi_fallocate(fs,file,offset,len,keep_size);
+   fsi_meta_unlock(fs);
+   fsi_unlock_set(fs,0,FS_LOCK_BIT(file));
+   return status;
+}
+
+
+/*
+ * fsi_truncate: sets the size of a file, freeing the blocks past the new
+ * end; the rest of the last block is zeroed, and a file that grows reads
+ * as zeros past its previous end
+ *   returns: 0 if successful, -1 otherwise
+ */
+static int fsi_truncate(fs_t* fs, inodeid_t file, unsigned size)
+{
+   if (fsi_file_check(fs,file,"fs_truncate") < 0) {
+      return -1;
+   }
+
+   if (OFFSET_TO_BLOCKS(size) > INODE_MAX_BLKS) {
+      dprintf("[fs_truncate] no free block entries in inode.\n");
+      return -1;
+   }
+
+   fs_inode_t* ifile = fsi_inode(fs,file);
+   unsigned used = ifile->nblocks;
+
+   // inline data past the end is cleared, as it would be read if the
+   // file grew again
+   if (INODE_INLINE(ifile) && size <= INODE_INLINE_SZ) {
+      if (size < ifile->size) {
+         memset((char*)ifile->blocks + size,0,ifile->size - size);
+      }
+      ifile->size = size;
+      fsi_inode_dirty(fs,file);
+      fsi_store_fsdata(fs);
+      return 0;
+   }
+   if (INODE_INLINE(ifile) && fsi_inode_promote(fs,ifile) < 0) {
+      dprintf("[fs_truncate] there are no free blocks.\n");
+      return -1;
+   }
+
+   // a tail that is kept gets its block back, the others are freed below
+   if (INODE_TAIL(ifile) && size > fsi_tail_block(fs,ifile) * BLOCK_SIZE &&
+      fsi_tail_unpack(fs,ifile) < 0) {
+      dprintf("[fs_truncate] there are no free blocks.\n");
+      return -1;
+   }
+
+   unsigned old_blks = OFFSET_TO_BLOCKS(ifile->size);
+   unsigned new_blks = OFFSET_TO_BLOCKS(size);
+   if (size < ifile->size && size % BLOCK_SIZE != 0 &&
+      fsi_block_zero(fs,ifile,size / BLOCK_SIZE,size % BLOCK_SIZE,
+         BLOCK_SIZE) < 0) {
+      dprintf("[fs_truncate] there are no free blocks.\n");
+      fsi_usage_add(fs,ifile->parent,ifile->nblocks - used);
+      return -1;
+   }
+   fsi_inode_trunc(fs,ifile,new_blks);
+
+   // the blocks allocated past the previous end hold no data yet
+   if (ifile->prealloc != 0) {
+      char zeros[BLOCK_SIZE];
+      unsigned blk;
+      memset(zeros,0,BLOCK_SIZE);
+      for (unsigned i = old_blks; i < MIN(new_blks, ifile->prealloc); i++) {
+         fsi_inode_map(fs,ifile,i,0,&blk);
+         if (blk != 0) {
+            block_write(fs->blocks,blk,zeros);
+         }
+      }
+      ifile->prealloc = 0;
+   }
+
+   ifile->size = size;
+   fsi_inode_dirty(fs,file);
+   fsi_usage_add(fs,ifile->parent,ifile->nblocks - used);
+   fsi_store_fsdata(fs);
+   return 0;
+}
+
+
+int fs_truncate(fs_t* fs, inodeid_t file, unsigned size)
+{
+   if (fs == NULL) {
+      dprintf("[fs_truncate] malformed arguments.\n");
+      return -1;
+   }
+
+   fsi_lock_set(fs,0,FS_LOCK_BIT(file));
+   fsi_meta_lock(fs);
+   int status = fsi_truncate(fs,file,size);
+   fsi_meta_unlock(fs);
+   fsi_unlock_set(fs,0,FS_LOCK_BIT(file));
+   return status;
+}
+
+
+/*
+ * fsi_punch_hole: frees the blocks of a file range, which then reads as
+ * zeros; the parts of the blocks at the edges of the range are zeroed,
+ * and the size of the file is left as it is
+ *   returns: 0 if successful, -1 otherwise
+ */
+static int fsi_punch_hole(fs_t* fs, inodeid_t file, unsigned offset,
+   unsigned len)
+{
+   if (fsi_file_check(fs,file,"fs_punch_hole") < 0) {
+      return -1;
+   }
+
+   if (len == 0 || offset + len < offset) {
+      dprintf("[fs_punch_hole] invalid range.\n");
+      return -1;
+   }
+
+   fs_inode_t* ifile = fsi_inode(fs,file);
+   unsigned end = offset + len;
+   if (INODE_INLINE(ifile)) {
+      if (offset < ifile->size) {
+         memset((char*)ifile->blocks + offset,0,
+            MIN(end, ifile->size) - offset);
+         fsi_inode_dirty(fs,file);
+         fsi_store_fsdata(fs);
+      }
+      return 0;
+   }
+
+   // whole blocks are freed, so is the block holding the end of the file
+   // when the range covers it
+   unsigned used = ifile->nblocks;
+   unsigned from = OFFSET_TO_BLOCKS(offset);
+   unsigned to = (end >= ifile->size) ? OFFSET_TO_BLOCKS(end) :
+      end / BLOCK_SIZE;
+   to = MIN(to, INODE_MAX_BLKS);
+   int status = 0;
+
+   // so is a packed tail the range covers, one it overlaps is unpacked
+   if (INODE_TAIL(ifile) && offset < ifile->size &&
+      end > fsi_tail_block(fs,ifile) * BLOCK_SIZE) {
+      if (offset <= fsi_tail_block(fs,ifile) * BLOCK_SIZE &&
+         end >= ifile->size) {
+         fsi_tail_free(fs,ifile);
+      } else {
+         status = fsi_tail_unpack(fs,ifile);
+      }
+   }
+   if (status == 0 && offset % BLOCK_SIZE != 0 && offset < ifile->size) {
+      unsigned iblock = offset / BLOCK_SIZE;
+      status = fsi_block_zero(fs,ifile,iblock,offset % BLOCK_SIZE,
+         MIN(BLOCK_SIZE, end - iblock * BLOCK_SIZE));
+   }
+   if (status == 0 && end % BLOCK_SIZE != 0 && end < ifile->size &&
+      end / BLOCK_SIZE >= from) {
+      status = fsi_block_zero(fs,ifile,end / BLOCK_SIZE,0,end % BLOCK_SIZE);
+   }
+   if (status == 0 && from < to) {
+      fsi_inode_punch(fs,ifile,from,to);
+      if (from <= OFFSET_TO_BLOCKS(ifile->size) && to >= ifile->prealloc) {
+         ifile->prealloc = 0;
+      }
+   }
+
+   fsi_inode_dirty(fs,file);
+   fsi_usage_add(fs,ifile->parent,ifile->nblocks - used);
+   fsi_store_fsdata(fs);
+   if (status < 0) {
+      dprintf("[fs_punch_hole] there are no free blocks.\n");
+   }
+   return status;
+}
+
+
+int fs_punch_hole(fs_t* fs, inodeid_t file, unsigned offset, unsigned len)
+{
+   if (fs == NULL) {
+      dprintf("[fs_punch_hole] malformed arguments.\n");
+      return -1;
+   }
+
+   fsi_lock_set(fs,0,FS_LOCK_BIT(file));
+   fsi_meta_lock(fs);
+   int status = fsi_punch_hole(fs,file,offset,len);
+   fsi_meta_unlock(fs);
+   fsi_unlock_set(fs,0,FS_LOCK_BIT(file));
+   return status;
+}
+
+
+/*
+ * fsi_entry_new: creates an inode as a new entry of a directory; the
+ * metadata is left for the caller to store
+ * - op: the operation, for the error messages
+ *   returns: 0 if successful, -1 otherwise
+ */
+static int fsi_entry_new(fs_t* fs, inodeid_t dir, char* name,
+   fs_itype_t type, inodeid_t* id, char* op)
+{
+   // reserve a free inode
+   unsigned finode;
+   if (fsi_ino_alloc(fs,&finode) < 0) {
+      dprintf("[%s] there are no free inodes.\n",op);
+      return -1;
+   }
+
+   // add the entry to the directory
+   if (fsi_dir_add(fs,dir,name,finode) < 0) {
+      dprintf("[%s] no free blocks to augment directory.\n",op);
+      fsi_ino_free(fs,finode);
+      return -1;
+   }
+
+   // init the new inode
+   fsi_inode_init(fsi_inode(fs,finode),type,dir);
+   fsi_inode_dirty(fs,finode);
+
+   *id = finode;
+   return 0;
+}
+
+
+static int fsi_create(fs_t* fs, inodeid_t dir, char* file,
+   inodeid_t* fileid)
+{	
+   if (fs == NULL || file == NULL || fileid == NULL) {
+      printf("[fs_create] malformed arguments.\n");
+      return -1;
+   }
+
+   if (strlen(file) == 0 || strlen(file)+1 > FS_MAX_FNAME_SZ){
+      dprintf("[fs_create] file name size error.\n");
+      return -1;
+   }
+
+   if (!fsi_inode_used(fs,dir)) {
+      dprintf("[fs_create] inode is not being used.\n");
+      return -1;
+   }
+
+   fs_inode_t* idir = fsi_inode(fs,dir);
+   if (idir->type != FS_DIR) {
+      dprintf("[fs_create] inode is not a directory.\n");
+      return -1;
+   }
+
+   if (FS_SNAP_OF(dir) != 0) {
+      dprintf("[fs_create] snapshots are read-only.\n");
+      return -1;
+   }
+
+   if (dir == 1 && strcmp(file,FS_SNAP_DIR) == 0) {
+      dprintf("[fs_create] file name is reserved.\n");
+      return -1;
+   }
+
+   if (fsi_dir_search(fs,dir,file,fileid) == 0) {
+      dprintf("[fs_create] file already exists.\n");
+      return -1;
+   }
+
+   if (fsi_entry_new(fs,dir,file,FS_FILE,fileid,"fs_create") < 0) {
+      return -1;
+   }
+
+   // save the file system metadata
+   fsi_store_fsdata(fs);
+   return 0;
+}
+
+
+int fs_create(fs_t* fs, inodeid_t dir, char* file, inodeid_t* fileid)
+{
+   if (fs == NULL) {
+      printf("[fs_create] malformed arguments.\n");
+      return -1;
+   }
+
+   fsi_lock_set(fs,0,FS_LOCK_BIT(dir));
+   fsi_meta_lock(fs);
+   int status = fsi_create(fs,dir,file,fileid);
+   fsi_meta_unlock(fs);
+   fsi_unlock_set(fs,0,FS_LOCK_BIT(dir));
+   return status;
+}
+
+// finds the slot of a name in a table of names, the first free one if
+// the name is not there
+static unsigned fsi_names_slot(char** names, int* table, unsigned nslots,
+   char* name)
+{
+   unsigned k = fsi_name_hash(name) & (nslots - 1);
+   while (table[k] >= 0 && strcmp(names[table[k]],name) != 0) {
+      k = (k + 1) & (nslots - 1);
+   }
+   return k;
+}
+
+
+/*
+ * fsi_create_many: creates several files in a directory at once; the
+ * names are checked against the directory together, the new entries fill
+ * the directory pages in memory, each page being written once, and the
+ * metadata is stored once
+ */
+static int fsi_create_many(fs_t* fs, inodeid_t dir, char** names, int count,
+   inodeid_t* fileids)
+{
+   if (fs == NULL || names == NULL || fileids == NULL || count < 0) {
+      dprintf("[fs_create_many] malformed arguments.\n");
+      return -1;
+   }
+
+   if (!fsi_inode_used(fs,dir)) {
+      dprintf("[fs_create_many] inode is not being used.\n");
+      return -1;
+   }
+
+   fs_inode_t* idir = fsi_inode(fs,dir);
+   if (idir->type != FS_DIR) {
+      dprintf("[fs_create_many] inode is not a directory.\n");
+      return -1;
+   }
+
+   if (FS_SNAP_OF(dir) != 0) {
+      dprintf("[fs_create_many] snapshots are read-only.\n");
+      return -1;
+   }
+
+   if (count == 0) {
+      return 0;
+   }
+
+   // the names, hashed to find the repeated and the existing ones
+   unsigned nslots = 1;
+   while (nslots < 2 * (unsigned)count) {
+      nslots *= 2;
+   }
+   int* table = (int*) malloc(nslots * sizeof(int));
+   memset(table,-1,nslots * sizeof(int));
+   for (int i = 0; i < count; i++) {
+      if (names[i] == NULL || strlen(names[i]) == 0 ||
+         strlen(names[i]) + 1 > FS_MAX_FNAME_SZ) {
+         dprintf("[fs_create_many] file name size error.\n");
+         free(table);
+         return -1;
+      }
+      if (dir == 1 && strcmp(names[i],FS_SNAP_DIR) == 0) {
+         dprintf("[fs_create_many] file name is reserved.\n");
+         free(table);
+         return -1;
+      }
+      unsigned k = fsi_names_slot(names,table,nslots,names[i]);
+      if (table[k] >= 0) {
+         dprintf("[fs_create_many] file name repeated.\n");
+         free(table);
+         return -1;
+      }
+      table[k] = i;
+   }
+
+   // the existing names: looked up through the index when there are fewer
+   // names than directory pages, found in one scan of the pages otherwise
+   FS_BLOCK_BUF(fs_dpage_t,page);
+   unsigned num = idir->size / sizeof(fs_dentry_t);
+   unsigned first = num / DIR_PAGE_ENTRIES, blk;
+   int exists = 0;
+   if (idir->reserved[INODE_DIDX] != 0 &&
+      (unsigned)count < (num + DIR_PAGE_ENTRIES - 1) / DIR_PAGE_ENTRIES) {
+      for (int i = 0; i < count && !exists; i++) {
+         exists = (fsi_dir_search(fs,dir,names[i],&fileids[i]) == 0);
+      }
+   } else {
+      for (unsigned pos = 0; pos < num && !exists; pos++) {
+         if (pos % DIR_PAGE_ENTRIES == 0) {
+            fsi_inode_map(fs,idir,pos / DIR_PAGE_ENTRIES,0,&blk);
+            block_read(fs->blocks,blk,page->data);
+         }
+         char* name = page->entry[pos % DIR_PAGE_ENTRIES].name;
+         exists = (table[fsi_names_slot(names,table,nslots,name)] >= 0);
+      }
+   }
+   free(table);
+   if (exists) {
+      dprintf("[fs_create_many] file already exists.\n");
+      return -1;
+   }
+
+   // check the room beforehand, so that a batch too large does not grow
+   // the inode table in vain: the blocks of the new directory pages and
+   // of the inode table (not those of the extending tables)
+   unsigned need = (num + count + DIR_PAGE_ENTRIES - 1) / DIR_PAGE_ENTRIES -
+      (num + DIR_PAGE_ENTRIES - 1) / DIR_PAGE_ENTRIES;
+   if ((unsigned)count > fs->sb.free_inodes) {
+      need += (count - fs->sb.free_inodes + ITAB_BLK_INODES - 1) /
+         ITAB_BLK_INODES;
+   }
+   if (need > fs->sb.free_blocks - fs->delay_reserved) {
+      dprintf("[fs_create_many] no free blocks for the files.\n");
+      return -1;
+   }
+
+   // reserve the free inodes
+   for (int i = 0; i < count; i++) {
+      if (fsi_ino_alloc(fs,&fileids[i]) < 0) {
+         dprintf("[fs_create_many] there are no free inodes.\n");
+         while (i-- > 0) {
+            fsi_ino_free(fs,fileids[i]);
+         }
+         return -1;
+      }
+   }
+
+   // map the pages to fill, the last one (if not full) and the new ones
+   unsigned npages = (num + count - 1) / DIR_PAGE_ENTRIES - first + 1;
+   unsigned used = idir->nblocks;
+   unsigned* blks = (unsigned*) malloc(npages * sizeof(unsigned));
+   for (unsigned i = 0; i < npages; i++) {
+      if (fsi_inode_map(fs,idir,first + i,1,&blks[i]) < 0) {
+         dprintf("[fs_create_many] no free blocks to augment directory.\n");
+         fsi_inode_trunc(fs,idir,first + (num % DIR_PAGE_ENTRIES != 0));
+         for (int j = 0; j < count; j++) {
+            fsi_ino_free(fs,fileids[j]);
+         }
+         free(blks);
+         return -1;
+      }
+   }
+   fsi_usage_add(fs,dir,idir->nblocks - used);
+
+   // fill in the pages
+   for (unsigned i = 0, pos = num; i < npages; i++) {
+      if (i == 0 && num % DIR_PAGE_ENTRIES != 0) {
+         block_read(fs->blocks,blks[i],page->data);
+      } else {
+         memset(page,0,BLOCK_SIZE);
+      }
+      for (; pos < num + count && pos / DIR_PAGE_ENTRIES == first + i; pos++) {
+         fs_dentry_t* entry = &page->entry[pos % DIR_PAGE_ENTRIES];
+         strcpy(entry->name,names[pos - num]);
+         entry->inodeid = fileids[pos - num];
+      }
+      block_write(fs->blocks,blks[i],page->data);
+   }
+   free(blks);
+   idir->size += count * sizeof(fs_dentry_t);
+   fsi_inode_dirty(fs,dir);
+
+   // init the new inodes
+   for (int i = 0; i < count; i++) {
+      fsi_inode_init(fsi_inode(fs,fileids[i]),FS_FILE,dir);
+      fsi_inode_dirty(fs,fileids[i]);
+      fsi_dcache_set(fs,dir,names[i],fileids[i]);
+   }
+
+   // keep the index up to date: a few entries are inserted in the index,
+   // while many entries are sorted with the others to build it again
+   unsigned total = num + count;
+   if (idir->reserved[INODE_DIDX] != 0 && 8 * (unsigned)count < num) {
+      for (int i = 0; i < count; i++) {
+         if (fsi_didx_insert(fs,dir,names[i],num + i,fileids[i]) < 0) {
+            fsi_didx_drop(fs,dir);
+            break;
+         }
+      }
+   } else if (idir->reserved[INODE_DIDX] != 0 || total > DIR_INDEX_MIN) {
+      fsi_didx_build(fs,dir);
+   }
+
+   // save the file system metadata
+   fsi_store_fsdata(fs);
+   return 0;
+}
+
+
+int fs_create_many(fs_t* fs, inodeid_t dir, char** names, int count,
+   inodeid_t* fileids)
+{
+   if (fs == NULL) {
+      dprintf("[fs_create_many] malformed arguments.\n");
+      return -1;
+   }
+
+   fsi_lock_set(fs,0,FS_LOCK_BIT(dir));
+   fsi_meta_lock(fs);
+   int status = fsi_create_many(fs,dir,names,count,fileids);
+   fsi_meta_unlock(fs);
+   fsi_unlock_set(fs,0,FS_LOCK_BIT(dir));
+   return status;
+}
+
+
+static int fsi_mkdir(fs_t* fs, inodeid_t dir, char* newdir,
+   inodeid_t* newdirid)
+{
+	if (fs==NULL || newdir==NULL || newdirid==NULL) {
+		printf("[fs_mkdir] malformed arguments.\n");
+		return -1;
+	}
+
+	if (strlen(newdir) == 0 || strlen(newdir)+1 > FS_MAX_FNAME_SZ){
+		dprintf("[fs_mkdir] directory size error.\n");
+		return -1;
+	}
+
+	if (!fsi_inode_used(fs,dir)) {
+		dprintf("[fs_mkdir] inode is not being used.\n");
+		return -1;
+	}
+
+	fs_inode_t* idir = fsi_inode(fs,dir);
+	if (idir->type != FS_DIR) {
+		dprintf("[fs_mkdir] inode is not a directory.\n");
+		return -1;
+	}
+
+	if (FS_SNAP_OF(dir) != 0) {
+		dprintf("[fs_mkdir] snapshots are read-only.\n");
+		return -1;
+	}
+
+	if (dir == 1 && strcmp(newdir,FS_SNAP_DIR) == 0) {
+		dprintf("[fs_mkdir] directory name is reserved.\n");
+		return -1;
+	}
+
+	if (fsi_dir_search(fs,dir,newdir,newdirid) == 0) {
+		dprintf("[fs_mkdir] directory already exists.\n");
+		return -1;
+	}
+
+	if (fsi_entry_new(fs,dir,newdir,FS_DIR,newdirid,"fs_mkdir") < 0)
+		return -1;
+
+	// save the file system metadata
+	fsi_store_fsdata(fs);
+	return 0;
+}
+
+
+int fs_mkdir(fs_t* fs, inodeid_t dir, char* newdir, inodeid_t* newdirid)
+{
+	if (fs == NULL) {
+		printf("[fs_mkdir] malformed arguments.\n");
+		return -1;
+	}
+
+	fsi_lock_set(fs, 0, FS_LOCK_BIT(dir));
+	fsi_meta_lock(fs);
+	int status = fsi_mkdir(fs, dir, newdir, newdirid);
+	fsi_meta_unlock(fs);
+	fsi_unlock_set(fs, 0, FS_LOCK_BIT(dir));
+	return status;
+}
+
+
+static int fsi_readdir(fs_t* fs, inodeid_t dir, char* cookie,
+   fs_file_name_t* entries, int maxentries, int* numentries)
+{
+   if (fs == NULL || entries == NULL ||
+      numentries == NULL || maxentries < 0) {
+      dprintf("[fs_readdir] malformed arguments.\n");
+      return -1;
+   }
+
+   if (!fsi_inode_used(fs,dir)) {
+      dprintf("[fs_readdir] inode is not being used.\n");
+      return -1;
+   }
+
+   fs_inode_t* idir = fsi_inode(fs,dir);
+   if (idir->type != FS_DIR) {
+      dprintf("[fs_readdir] inode is not a directory.\n");
+      return -1;
+   }
+
+   char after[FS_MAX_FNAME_SZ] = "";
+   if (cookie != NULL) {
+      strncpy(after,cookie,FS_MAX_FNAME_SZ - 1);
+   }
+
+   // the entries following the cookie, in name order: along the leaves
+   // of the index, or sorted from the pages of a small directory
+   int num = idir->size / sizeof(fs_dentry_t);
+   fs_didx_entry_t* list = (fs_didx_entry_t*)
+      malloc(MAX(MIN(num,maxentries),1) * sizeof(fs_didx_entry_t));
+   int count = 0;
+   if (idir->reserved[INODE_DIDX] != 0) {
+      count = fsi_didx_list(fs,dir,after,list,maxentries);
+   } else {
+      FS_BLOCK_BUF(fs_dpage_t,page);
+      fs_didx_entry_t* all = (fs_didx_entry_t*)
+         malloc(MAX(num,1) * sizeof(fs_didx_entry_t));
+      unsigned blk;
+      for (int pos = 0; pos < num; pos++) {
+         if (pos % DIR_PAGE_ENTRIES == 0) {
+            fsi_inode_map(fs,idir,pos / DIR_PAGE_ENTRIES,0,&blk);
+            block_read(fs->blocks,blk,page->data);
+         }
+         fs_dentry_t* entry = &page->entry[pos % DIR_PAGE_ENTRIES];
+         if (strcmp(entry->name,after) > 0) {
+            strcpy(all[count].name,entry->name);
+            all[count++].ino = entry->inodeid;
+         }
+      }
+      qsort(all,count,sizeof(fs_didx_entry_t),fsi_didx_cmp);
+      count = MIN(count,maxentries);
+      memcpy(list,all,count * sizeof(fs_didx_entry_t));
+      free(all);
+   }
+
+   for (int i = 0; i < count; i++) {
+      strcpy(entries[i].name,list[i].name);
+      entries[i].type = fsi_inode(fs,FS_SNAP_CHILD(dir,list[i].ino))->type;
+   }
+   free(list);
+   *numentries = count;
+   return 0;
+}
+
+
+int fs_readdir(fs_t* fs, inodeid_t dir, char* cookie,
+   fs_file_name_t* entries, int maxentries, int* numentries)
+{
+   if (fs == NULL) {
+      dprintf("[fs_readdir] malformed arguments.\n");
+      return -1;
+   }
+
+   fsi_lock_set(fs,FS_LOCK_BIT(dir),0);
+   fsi_meta_lock(fs);
+   int status = fsi_readdir(fs,dir,cookie,entries,maxentries,numentries);
+   fsi_meta_unlock(fs);
+   fsi_unlock_set(fs,FS_LOCK_BIT(dir),0);
+   return status;
+}
+
+void fs_remove_file(fs_t* fs, inodeid_t entryid) {
+
+	fs_inode_t* ifile = fsi_inode(fs,entryid);
+
+	// the data not flushed yet is just dropped
+	fs_delay_t* d = fsi_delay_find(fs, entryid);
+	if (d != NULL)
+		fsi_delay_drop(fs, d);
+
+	fsi_inode_trunc(fs, ifile, 0);
+	fsi_inode_dirty(fs, entryid);
+
+	fsi_ino_free(fs, entryid);
+}
+
+
+/*
+ * fsi_file_unlink: drops a name of a file, whose entry in 'dir' is gone;
+ * the file is removed with its last name, and stops counting for the
+ * directories above 'dir' if its blocks counted there
+ */
+static void fsi_file_unlink(fs_t* fs, inodeid_t dir, inodeid_t entryid)
+{
+	fs_inode_t* ifile = fsi_inode(fs,entryid);
+	if (ifile->parent == dir) {
+		fsi_usage_add(fs, dir, -(int)ifile->nblocks);
+		ifile->parent = 0;
+	}
+
+	if (ifile->links > 0) {
+		ifile->links--;
+		fsi_inode_dirty(fs, entryid);
+		return;
+	}
+	fs_remove_file(fs, entryid);
+}
+
+
+/*
+ * fs_remove_dir: removes a directory and everything below it, walking
+ * the tree with an explicit stack of the directories still to remove;
+ * the metadata is left for the caller to store
+ */
+void fs_remove_dir(fs_t* fs, inodeid_t top) {
+
+	unsigned cap = 64, num = 0;
+	inodeid_t* stack = (inodeid_t*) malloc(cap * sizeof(inodeid_t));
+	FS_BLOCK_BUF(fs_dpage_t,page);
+	unsigned blk;
+
+	stack[num++] = top;
+	while (num > 0) {
+		inodeid_t dir = stack[--num];
+		fs_inode_t* idir = fsi_inode(fs,dir);
+		int left = idir->size / sizeof(fs_dentry_t);
+
+		// each page is read once, files go at once
+		for (unsigned i = 0; left > 0; i++) {
+			fsi_inode_map(fs, idir, i, 0, &blk);
+			block_read(fs->blocks, blk, page->data);
+			for (int j = 0; j < DIR_PAGE_ENTRIES && left > 0; j++, left--) {
+				inodeid_t entryid = page->entry[j].inodeid;
+				if (fsi_inode(fs,entryid)->type == FS_FILE) {
+					fsi_file_unlink(fs, dir, entryid);
+					continue;
+				}
+				if (num == cap) {
+					cap *= 2;
+					stack = (inodeid_t*) realloc(stack, cap * sizeof(inodeid_t));
+				}
+				stack[num++] = entryid;
+			}
+		}
+
+		fsi_dcache_purge(fs, dir);
+		fsi_didx_drop(fs, dir);
+		fsi_inode_trunc(fs, idir, 0);
+		fsi_inode_dirty(fs, dir);
+		fsi_ino_free(fs, dir);
+	}
+	free(stack);
+}
+
+
+	
+
+/*
+ * fsi_tree_locks: gets the set of locks of an inode and, for a
+ * directory, of all the inodes below it
+ */
+static fs_lockset_t fsi_tree_locks(fs_t* fs, inodeid_t ino)
+{
+	fs_lockset_t set = FS_LOCK_BIT(ino);
+	fs_inode_t* inode = fsi_inode(fs,ino);
+	if (inode->type != FS_DIR) {
+		return set;
+	}
+
+	int num = inode->size / sizeof(fs_dentry_t);
+	FS_BLOCK_BUF(fs_dpage_t,page);
+	unsigned blk;
+	for (unsigned i = 0; num > 0 && ~set != 0; i++) {
+		fsi_inode_map(fs, inode, i, 0, &blk);
+		block_read(fs->blocks, blk, page->data);
+		for (int j = 0; j < DIR_PAGE_ENTRIES && num > 0; j++, num--) {
+			set |= fsi_tree_locks(fs,
+				FS_SNAP_CHILD(ino, page->entry[j].inodeid));
+		}
+	}
+	return set;
+}
+
+
+static int fsi_remove(fs_t* fs, inodeid_t dir, char *name)
+{
+	//checks if the arguments are valid
+	if (fs == NULL || name == NULL) {
+		dprintf("[fs_remove] malformed arguments. \n");
+		return -1;
+	}
+
+	if (strlen(name) == 0 || strlen(name)+1 > FS_MAX_FNAME_SZ) {
+		dprintf("[fs_remove] file name size error\n");
+		return -1;
+	}
+
+	if (!fsi_inode_used(fs,dir)) {
+		dprintf("[fs_remove] inode is not being used.\n");
+		return -1;
+	}
+	
+	fs_inode_t* idir = fsi_inode(fs,dir);
+	if (idir->type != FS_DIR) {
+		dprintf("[fs_remove] inode is not a directory. \n");
+		return -1;
+	}
+
+	if (FS_SNAP_OF(dir) != 0) {
+		dprintf("[fs_remove] snapshots are read-only.\n");
+		return -1;
+	}
+
+	inodeid_t entryid = 0;
+	if (fsi_dir_del(fs, dir, name, &entryid) < 0) {
+		dprintf("[fs_remove] file/dir does not exist\n");
+		return -1;
+	}
+
+	// the whole subtree stops counting for the directories above; a file
+	// goes with its last name
+	fs_inode_t* ientry = fsi_inode(fs,entryid);
+	if (ientry->type == FS_FILE) {
+		fsi_file_unlink(fs, dir, entryid);
+	} else {
+		fsi_usage_add(fs, dir, -(int)ientry->tree_blocks);
+		ientry->parent = 0;
+		fs_remove_dir(fs, entryid);
+	}
+
+	// save the file system metadata
+	fsi_store_fsdata(fs);
+
+	return 0;
+}
+
+
+int fs_remove(fs_t* fs, inodeid_t dir, char *name)
+{
+	if (fs == NULL || name == NULL) {
+		dprintf("[fs_remove] malformed arguments. \n");
+		return -1;
+	}
+
+	// lock the directory and everything to be removed, finding out what
+	// that is until the locks held cover it
+	fs_lockset_t locks = FS_LOCK_BIT(dir);
+	while (1) {
+		fsi_lock_set(fs, 0, locks);
+		fsi_meta_lock(fs);
+		inodeid_t entryid;
+		if (!fsi_inode_used(fs,dir) || fsi_inode(fs,dir)->type != FS_DIR ||
+			fsi_dir_search(fs, dir, name, &entryid) < 0) {
+			break;
+		}
+		fs_lockset_t need = FS_LOCK_BIT(dir) | fsi_tree_locks(fs, entryid);
+		if ((need & ~locks) == 0) {
+			break;
+		}
+		fsi_meta_unlock(fs);
+		fsi_unlock_set(fs, 0, locks);
+		locks |= need;
+	}
+
+	int status = fsi_remove(fs, dir, name);
+	fsi_meta_unlock(fs);
+	fsi_unlock_set(fs, 0, locks);
+	return status;
+}
+
+
+// the blocks an entry counts for the directories above it
+static int fsi_entry_usage(fs_t* fs, inodeid_t ino)
+{
+   fs_inode_t* inode = fsi_inode(fs,ino);
+   return (inode->type == FS_FILE) ? inode->nblocks : inode->tree_blocks;
+}
+
+
+/*
+ * fsi_rename: moves an entry to another name, in the same or in another
+ * directory, replacing the entry of that name if there is one; only the
+ * pages holding the entries are written, the entry gets its new name
+ * before it loses the old one and a replaced entry is freed last
+ *   returns: 0 if successful, -1 otherwise (nothing is changed)
+ */
+static int fsi_rename(fs_t* fs, inodeid_t dir1, inodeid_t dir2,
+   char* name1, char* name2, inodeid_t* fileid)
+{
+   if (strlen(name1) == 0 || strlen(name1)+1 > FS_MAX_FNAME_SZ ||
+      strlen(name2) == 0 || strlen(name2)+1 > FS_MAX_FNAME_SZ) {
+      dprintf("[fs_rename] file name size error.\n");
+      return -1;
+   }
+
+   if (!fsi_inode_used(fs,dir1) || !fsi_inode_used(fs,dir2)) {
+      dprintf("[fs_rename] inode is not being used.\n");
+      return -1;
+   }
+
+   if (fsi_inode(fs,dir1)->type != FS_DIR ||
+      fsi_inode(fs,dir2)->type != FS_DIR) {
+      dprintf("[fs_rename] inode is not a directory.\n");
+      return -1;
+   }
+
+   if (FS_SNAP_OF(dir1) != 0 || FS_SNAP_OF(dir2) != 0) {
+      dprintf("[fs_rename] snapshots are read-only.\n");
+      return -1;
+   }
+
+   if (dir2 == 1 && strcmp(name2,FS_SNAP_DIR) == 0) {
+      dprintf("[fs_rename] file name is reserved.\n");
+      return -1;
+   }
+
+   inodeid_t ino, old = 0;
+   if (fsi_dir_search(fs,dir1,name1,&ino) < 0) {
+      dprintf("[fs_rename] file/dir does not exist.\n");
+      return -1;
+   }
+   fsi_dir_search(fs,dir2,name2,&old);
+   *fileid = ino;
+   if (old == ino) {
+      return 0;
+   }
+
+   // a directory cannot go below itself
+   fs_inode_t* inode = fsi_inode(fs,ino);
+   for (inodeid_t d = dir2; inode->type == FS_DIR && d != 0;
+      d = fsi_inode(fs,d)->parent) {
+      if (d == ino) {
+         dprintf("[fs_rename] a directory cannot go below itself.\n");
+         return -1;
+      }
+   }
+
+   // a replaced entry is of the same type, and empty if a directory
+   if (old != 0) {
+      fs_inode_t* iold = fsi_inode(fs,old);
+      if (iold->type != inode->type) {
+         dprintf("[fs_rename] the entry replaced is of another type.\n");
+         return -1;
+      }
+      if (iold->type == FS_DIR && iold->size != 0) {
+         dprintf("[fs_rename] the directory replaced is not empty.\n");
+         return -1;
+      }
+   }
+
+   // the entry of the new name first, then the old one goes
+   inodeid_t gone;
+   int status;
+   if (old == 0 && dir1 == dir2) {
+      status = fsi_dir_set(fs,dir1,name1,name2,ino);
+   } else {
+      status = (old != 0) ? fsi_dir_set(fs,dir2,name2,name2,ino) :
+         fsi_dir_add(fs,dir2,name2,ino);
+      if (status == 0 && fsi_dir_del(fs,dir1,name1,&gone) < 0) {
+         // the page of the new entry is not shared anymore
+         if (old != 0) {
+            fsi_dir_set(fs,dir2,name2,name2,old);
+         } else {
+            fsi_dir_del(fs,dir2,name2,&gone);
+         }
+         status = -1;
+      }
+   }
+   if (status < 0) {
+      dprintf("[fs_rename] there are no free blocks.\n");
+      fsi_store_fsdata(fs);
+      return -1;
+   }
+
+   // the subtree counts for the directories above its new place (a file
+   // with several names, if it counted for this one)
+   if (dir1 != dir2 && inode->parent == dir1) {
+      int blocks = fsi_entry_usage(fs,ino);
+      fsi_usage_add(fs,dir1,-blocks);
+      fsi_usage_add(fs,dir2,blocks);
+      inode->parent = dir2;
+      fsi_inode_dirty(fs,ino);
+   }
+   if (old != 0 && fsi_inode(fs,old)->type == FS_FILE) {
+      fsi_file_unlink(fs,dir2,old);
+   } else if (old != 0) {
+      fsi_usage_add(fs,dir2,-fsi_entry_usage(fs,old));
+      fsi_inode(fs,old)->parent = 0;
+      fs_remove_dir(fs,old);
+   }
+
+   fsi_store_fsdata(fs);
+   return 0;
+}
+
+
+int fs_rename(fs_t* fs, inodeid_t dir1, inodeid_t dir2, char* name1,
+   char* name2, inodeid_t* fileid)
+{
+   if (fs == NULL || name1 == NULL || name2 == NULL || fileid == NULL) {
+      dprintf("[fs_rename] malformed arguments.\n");
+      return -1;
+   }
+
+   // lock both directories, the entry moved and the one it replaces,
+   // finding out what they are until the locks held cover them
+   fs_lockset_t locks = FS_LOCK_BIT(dir1) | FS_LOCK_BIT(dir2);
+   while (1) {
+      fsi_lock_set(fs,0,locks);
+      fsi_meta_lock(fs);
+      inodeid_t ino, old;
+      fs_lockset_t need = locks;
+      if (fsi_inode_used(fs,dir1) && fsi_inode(fs,dir1)->type == FS_DIR &&
+         fsi_dir_search(fs,dir1,name1,&ino) == 0) {
+         need |= FS_LOCK_BIT(ino);
+      }
+      if (fsi_inode_used(fs,dir2) && fsi_inode(fs,dir2)->type == FS_DIR &&
+         fsi_dir_search(fs,dir2,name2,&old) == 0) {
+         need |= FS_LOCK_BIT(old);
+      }
+      if ((need & ~locks) == 0) {
+         break;
+      }
+      fsi_meta_unlock(fs);
+      fsi_unlock_set(fs,0,locks);
+      locks |= need;
+   }
+
+   int status = fsi_rename(fs,dir1,dir2,name1,name2,fileid);
+   fsi_meta_unlock(fs);
+   fsi_unlock_set(fs,0,locks);
+   return status;
+}
+
+
+/*
+ * fsi_link: gives a file another name, sharing the inode; a file whose
+ * blocks count for no directory (its name there being gone) counts for
+ * the directory of the new name
+ *   returns: 0 if successful, -1 otherwise
+ */
+static int fsi_link(fs_t* fs, inodeid_t dir1, inodeid_t dir2, char* name1,
+   char* name2, inodeid_t* fileid)
+{
+   if (strlen(name1) == 0 || strlen(name1)+1 > FS_MAX_FNAME_SZ ||
+      strlen(name2) == 0 || strlen(name2)+1 > FS_MAX_FNAME_SZ) {
+      dprintf("[fs_link] file name size error.\n");
+      return -1;
+   }
+
+   if (!fsi_inode_used(fs,dir1) || !fsi_inode_used(fs,dir2)) {
+      dprintf("[fs_link] inode is not being used.\n");
+      return -1;
+   }
+
+   if (fsi_inode(fs,dir1)->type != FS_DIR ||
+      fsi_inode(fs,dir2)->type != FS_DIR) {
+      dprintf("[fs_link] inode is not a directory.\n");
+      return -1;
+   }
+
+   // the inodes of a snapshot are not shared with the file system
+   if (FS_SNAP_OF(dir1) != 0 || FS_SNAP_OF(dir2) != 0) {
+      dprintf("[fs_link] snapshots are read-only.\n");
+      return -1;
+   }
+
+   if (dir2 == 1 && strcmp(name2,FS_SNAP_DIR) == 0) {
+      dprintf("[fs_link] file name is reserved.\n");
+      return -1;
+   }
+
+   inodeid_t ino, exists;
+   if (fsi_dir_search(fs,dir1,name1,&ino) < 0) {
+      dprintf("[fs_link] file does not exist.\n");
+      return -1;
+   }
+
+   fs_inode_t* ifile = fsi_inode(fs,ino);
+   if (ifile->type != FS_FILE) {
+      dprintf("[fs_link] inode is not a file.\n");
+      return -1;
+   }
+
+   if (fsi_dir_search(fs,dir2,name2,&exists) == 0) {
+      dprintf("[fs_link] file already exists.\n");
+      return -1;
+   }
+
+   if (fsi_dir_add(fs,dir2,name2,ino) < 0) {
+      dprintf("[fs_link] no free blocks to augment directory.\n");
+      fsi_store_fsdata(fs);
+      return -1;
+   }
+   ifile->links++;
+   if (ifile->parent == 0) {
+      ifile->parent = dir2;
+      fsi_usage_add(fs,dir2,ifile->nblocks);
+   }
+   fsi_inode_dirty(fs,ino);
+
+   *fileid = ino;
+   fsi_store_fsdata(fs);
+   return 0;
+}
+
+
+int fs_link(fs_t* fs, inodeid_t dir1, inodeid_t dir2, char* name1,
+   char* name2, inodeid_t* fileid)
+{
+   if (fs == NULL || name1 == NULL || name2 == NULL || fileid == NULL) {
+      dprintf("[fs_link] malformed arguments.\n");
+      return -1;
+   }
+
+   // lock both directories and the file, finding out what the file is
+   // until the locks held cover it
+   fs_lockset_t locks = FS_LOCK_BIT(dir1) | FS_LOCK_BIT(dir2);
+   while (1) {
+      fsi_lock_set(fs,0,locks);
+      fsi_meta_lock(fs);
+      inodeid_t ino;
+      if (!fsi_inode_used(fs,dir1) || fsi_inode(fs,dir1)->type != FS_DIR ||
+         fsi_dir_search(fs,dir1,name1,&ino) < 0 ||
+         (FS_LOCK_BIT(ino) & ~locks) == 0) {
+         break;
+      }
+      fsi_meta_unlock(fs);
+      fsi_unlock_set(fs,0,locks);
+      locks |= FS_LOCK_BIT(ino);
+   }
+
+   int status = fsi_link(fs,dir1,dir2,name1,name2,fileid);
+   fsi_meta_unlock(fs);
+   fsi_unlock_set(fs,0,locks);
+   return status;
+}
+
+/*
+ * fsi_file_share: makes an empty file a copy of another one, sharing
+ * its blocks; only the references of the inode (direct blocks and
+ * extending tables) get one more reference, the rest is copied when
+ * written
+ *   returns: 0 if successful, -1 otherwise (the copy is left empty)
+ */
+static int fsi_file_share(fs_t *fs, inodeid_t file1id, inodeid_t file2id) {
+
+	fs_inode_t* ifile1 = fsi_inode(fs,file1id);
+	fs_inode_t* ifile2 = fsi_inode(fs,file2id);
+	fsi_inode_dirty(fs, file2id);
+	if (INODE_INLINE(ifile1)) {
+		memcpy(ifile2->blocks, ifile1->blocks, INODE_INLINE_SZ);
+		ifile2->size = ifile1->size;
+		return 0;
+	}
+
+	// share the blocks referenced by the inode
+	unsigned* refs1[INODE_NUM_BLKS + 3];
+	unsigned* refs2[INODE_NUM_BLKS + 3];
+	int num = 0;
+	for (int i = 0; i < INODE_NUM_BLKS; i++) {
+		refs1[num] = &ifile1->blocks[i];
+		refs2[num++] = &ifile2->blocks[i];
+	}
+	refs1[num] = &ifile1->reserved[INODE_IND];
+	refs2[num++] = &ifile2->reserved[INODE_IND];
+	refs1[num] = &ifile1->reserved[INODE_DIND];
+	refs2[num++] = &ifile2->reserved[INODE_DIND];
+	refs1[num] = &ifile1->tail;
+	refs2[num++] = &ifile2->tail;
+
+	ifile2->reserved[INODE_FLAGS] &= ~INODE_F_INLINE;
+	for (int i = 0; i < num; i++) {
+		*refs2[i] = 0;
+		if (*refs1[i] != 0 && fsi_blk_share(fs, *refs1[i]) < 0) {
+			dprintf("[fs_copy] unable to share the file blocks.\n");
+			while (--i >= 0) {
+				if (*refs2[i] != 0)
+					fsi_blk_free(fs, *refs2[i]);
+				*refs2[i] = 0;
+			}
+			return -1;
+		}
+		*refs2[i] = *refs1[i];
+	}
+	ifile2->size = ifile1->size;
+	ifile2->nblocks = ifile1->nblocks;
+	ifile2->prealloc = ifile1->prealloc;
+	ifile2->tail_frag = ifile1->tail_frag;
+	return 0;
+}
+
+
+/*
+ * fsi_copy_file: copies a file sharing its blocks with the original; the
+ * metadata is left for the caller to store
+ *   returns: 0 if successful, -1 otherwise
+ */
+static int fsi_copy_file(fs_t *fs, inodeid_t dir2, inodeid_t file1id,
+	char* file2) {
+	
+	inodeid_t file2id;
+
+	// the blocks to share must be on the disk
+	if (fsi_delay_sync(fs, file1id, 1) < 0) {
+		dprintf("[fs_copy] there are no free blocks.\n");
+		return -1;
+	}
+
+	if (fsi_entry_new(fs, dir2, file2, FS_FILE, &file2id, "fs_copy") < 0)
+		return -1;
+
+	if (fsi_file_share(fs, file1id, file2id) < 0) {
+		fsi_remove(fs, dir2, file2);
+		return -1;
+	}
+	fsi_usage_add(fs, dir2, fsi_inode(fs,file2id)->nblocks);
+	return 0;
+}
+
+
+// a directory still to copy, and its copy
+typedef struct {
+	inodeid_t src;
+	inodeid_t dst;
+} fs_copy_dir_t;
+
+
+/*
+ * fsi_copy_page: copies the entries of a directory page into the same
+ * page of the copy of the directory; the page is filled in memory and
+ * written once, the directories in it are pushed to be copied later
+ * - blocks: the blocks used by the copied entries are added here [out]
+ *   returns: 0 if successful, -1 otherwise (the entries copied until
+ *   then are in the copy, for its removal to free them)
+ */
+static int fsi_copy_page(fs_t* fs, fs_copy_dir_t* cur, unsigned iblock,
+	fs_dpage_t* src, int num, fs_copy_dir_t** stack, unsigned* top,
+	unsigned* cap, unsigned* blocks)
+{
+	fs_inode_t* idst = fsi_inode(fs,cur->dst);
+	FS_BLOCK_BUF(fs_dpage_t,page);
+	int count = 0, status = 0;
+	unsigned blk, fblocks = 0;
+
+	memset(page, 0, BLOCK_SIZE);
+	for (; count < num; count++) {
+		inodeid_t entryid = FS_SNAP_CHILD(cur->src, src->entry[count].inodeid);
+		fs_inode_t* ientry = fsi_inode(fs,entryid);
+
+		// the blocks to share must be on the disk
+		unsigned ino;
+		if (ientry->type == FS_FILE && fsi_delay_sync(fs, entryid, 1) < 0) {
+			dprintf("[fs_copy] there are no free blocks.\n");
+			status = -1;
+			break;
+		}
+		if (fsi_ino_alloc(fs, &ino) < 0) {
+			dprintf("[fs_copy] there are no free inodes.\n");
+			status = -1;
+			break;
+		}
+		fsi_inode_init(fsi_inode(fs,ino), ientry->type, cur->dst);
+		fsi_inode_dirty(fs, ino);
+		strcpy(page->entry[count].name, src->entry[count].name);
+		page->entry[count].inodeid = ino;
+		if (ientry->type == FS_FILE) {
+			if (fsi_file_share(fs, entryid, ino) < 0) {
+				count++;
+				status = -1;
+				break;
+			}
+			fblocks += fsi_inode(fs,ino)->nblocks;
+		}
+	}
+	if (count == 0) {
+		return status;
+	}
+
+	unsigned used = idst->nblocks;
+	if (fsi_inode_map(fs, idst, iblock, 1, &blk) < 0) {
+		dprintf("[fs_copy] no free blocks to augment directory.\n");
+		fsi_inode_trunc(fs, idst, iblock);
+		for (int i = 0; i < count; i++) {
+			inodeid_t ino = page->entry[i].inodeid;
+			if (fsi_inode(fs,ino)->type == FS_FILE)
+				fs_remove_file(fs, ino);
+			else fsi_ino_free(fs, ino);
+		}
+		return -1;
+	}
+	*blocks += fblocks + idst->nblocks - used;
+	block_write(fs->blocks, blk, page->data);
+	idst->size += count * sizeof(fs_dentry_t);
+
+	for (int i = 0; i < count && status == 0; i++) {
+		inodeid_t ino = page->entry[i].inodeid;
+		if (fsi_inode(fs,ino)->type != FS_DIR)
+			continue;
+		if (*top == *cap) {
+			*cap *= 2;
+			*stack = (fs_copy_dir_t*) realloc(*stack,
+				*cap * sizeof(fs_copy_dir_t));
+		}
+		(*stack)[*top].src = FS_SNAP_CHILD(cur->src, src->entry[i].inodeid);
+		(*stack)[(*top)++].dst = ino;
+	}
+	return status;
+}
+
+
+/*
+ * fsi_copy_tree: copies a directory and everything below it, walking the
+ * tree with an explicit stack of the directories still to copy; each
+ * page of a copied directory is written once, its index built once and
+ * its usage propagated once, and the metadata is left for the caller to
+ * store; a copy that runs out of inodes or blocks is removed
+ *   returns: 0 if successful, -1 otherwise
+ */
+static int fsi_copy_tree(fs_t* fs, inodeid_t dir1id, inodeid_t dir2,
+	char* dirname)
+{
+	// a directory cannot be copied below itself
+	for (inodeid_t p = dir2; p != 0; p = fsi_inode(fs,p)->parent) {
+		if (p == dir1id) {
+			dprintf("[fs_copy] cannot copy a directory into itself\n");
+			return -1;
+		}
+	}
+
+	inodeid_t topdir;
+	if (fsi_entry_new(fs, dir2, dirname, FS_DIR, &topdir, "fs_copy") < 0)
+		return -1;
+
+	unsigned cap = 64, top = 0;
+	fs_copy_dir_t* stack = (fs_copy_dir_t*) malloc(cap * sizeof(fs_copy_dir_t));
+	FS_BLOCK_BUF(fs_dpage_t,page);
+	unsigned blk;
+	int status = 0;
+
+	stack[top].src = dir1id;
+	stack[top++].dst = topdir;
+	while (top > 0 && status == 0) {
+		fs_copy_dir_t cur = stack[--top];
+		int num = fsi_inode(fs,cur.src)->size / sizeof(fs_dentry_t);
+		unsigned blocks = 0;
+
+		for (unsigned i = 0; num > 0 && status == 0; i++) {
+			int count = MIN(num, DIR_PAGE_ENTRIES);
+			fsi_inode_map(fs, fsi_inode(fs,cur.src), i, 0, &blk);
+			block_read(fs->blocks, blk, page->data);
+			status = fsi_copy_page(fs, &cur, i, page, count, &stack, &top,
+				&cap, &blocks);
+			num -= count;
+		}
+
+		fsi_inode_dirty(fs, cur.dst);
+		fsi_usage_add(fs, cur.dst, blocks);
+		num = fsi_inode(fs,cur.dst)->size / sizeof(fs_dentry_t);
+		if (status == 0 && num > DIR_INDEX_MIN)
+			fsi_didx_build(fs, cur.dst);
+	}
+	free(stack);
+
+	if (status < 0)
+		fsi_remove(fs, dir2, dirname);
+	return status;
+}
+
+
+static int fsi_copy(fs_t *fs, inodeid_t dir1, inodeid_t dir2, char* file1,
+	char* file2)
+{
+	if (fs == NULL ||  file1 == NULL || file2 == NULL) {
+		dprintf("[fs_copy] malformed arguments\n");
+		return -1;
+	}
+
+	if (strlen(file1) == 0 || strlen(file1)+1 > FS_MAX_FNAME_SZ) {
+		dprintf("[fs_copy] source file name size error\n");
+		return -1;
+	}
+	
+	if (strlen(file2) == 0 || strlen(file2)+1 > FS_MAX_FNAME_SZ) {
+		dprintf("[fs_copy] source file name size error\n");
+		return -1;
+	}
+
+	if (!fsi_inode_used(fs,dir1)) {
+		dprintf("[fs_copy] inode (dir1) is not being used\n");
+		return -1;
+	}
+
+	if (!fsi_inode_used(fs,dir2)) {
+		dprintf("[fs_copy] inode (dir2) is not being used\n");
+		return -1;
+	}
+
+	fs_inode_t* idir1 = fsi_inode(fs,dir1);
+	if (idir1->type != FS_DIR) {
+		dprintf("[fs_copy] inode (dir1) is not a directory\n");
+		return -1;
+	}
+
+	fs_inode_t* idir2 = fsi_inode(fs,dir2);
+	if (idir2->type != FS_DIR) {
+		dprintf("[fs_copy] inode (dir2) is not a directory\n");
+		return -1;
+	}
+
+	if (FS_SNAP_OF(dir2) != 0) {
+		dprintf("[fs_copy] snapshots are read-only\n");
+		return -1;
+	}
+
+	inodeid_t fileid=0;
+	if (fsi_dir_search(fs, dir1, file1, &fileid) < 0) {
+		dprintf("[fs_copy] file does not exist\n");
+		return -1;
+	}
+
+	if (dir2 == 1 && strcmp(file2,FS_SNAP_DIR) == 0) {
+		dprintf("[fs_copy] file name is reserved\n");
+		return -1;
+	}
+
+	inodeid_t exists;
+	if (fsi_dir_search(fs, dir2, file2, &exists) == 0) {
+		dprintf("[fs_copy] file already exists\n");
+		return -1;
+	}
+
+	int status = (fsi_inode(fs,fileid)->type == FS_FILE) ?
+		fsi_copy_file(fs, dir2, fileid, file2) :
+		fsi_copy_tree(fs, fileid, dir2, file2);
+
+	// save the file system metadata, once for a whole tree
+	fsi_store_fsdata(fs);
+	return status;
+}
+
+
+int fs_copy(fs_t *fs, inodeid_t dir1, inodeid_t dir2, char* file1, char* file2)
+{
+	if (fs == NULL || file1 == NULL) {
+		dprintf("[fs_copy] malformed arguments\n");
+		return -1;
+	}
+
+	// the original, and all below it for a directory, is locked for
+	// reading, so that no write is halfway through its blocks when they
+	// get shared
+	fs_lockset_t rd = 0, wr = FS_LOCK_BIT(dir2);
+	while (1) {
+		fsi_lock_set(fs, rd, wr);
+		fsi_meta_lock(fs);
+		inodeid_t fileid;
+		if (!fsi_inode_used(fs,dir1) || fsi_inode(fs,dir1)->type != FS_DIR ||
+			fsi_dir_search(fs, dir1, file1, &fileid) < 0) {
+			break;
+		}
+		fs_lockset_t need = fsi_tree_locks(fs, fileid) & ~wr;
+		if ((need & ~rd) == 0) {
+			break;
+		}
+		fsi_meta_unlock(fs);
+		fsi_unlock_set(fs, rd, wr);
+		rd |= need;
+	}
+
+	int status = fsi_copy(fs, dir1, dir2, file1, file2);
+	fsi_meta_unlock(fs);
+	fsi_unlock_set(fs, rd, wr);
+	return status;
+}
+
+/*
+ * fsi_append_link: appends file2 to file1, whose size is a multiple of
+ * the block size, by sharing the data blocks (and tail) of file2 with
+ * file1
+ *   returns: 0 if successful, -1 if there are no free blocks
+ */
+static int fsi_append_link(fs_t* fs, fs_inode_t* ifile1, fs_inode_t* ifile2,
+   unsigned size2)
+{
+   unsigned first = ifile1->size / BLOCK_SIZE;
+   unsigned nblks = OFFSET_TO_BLOCKS(size2);
+   unsigned blks[EXT_INODE_NUM_BLKS];
+
+   if (first + nblks > INODE_MAX_BLKS) {
+      return -1;
+   }
+   if (INODE_INLINE(ifile1)) {
+      fsi_inode_promote(fs,ifile1);
+   }
+   for (unsigned i = 0; i < nblks; ) {
+      unsigned num = MIN(nblks - i, EXT_INODE_NUM_BLKS);
+      for (unsigned j = 0; j < num; j++) {
+         fsi_inode_map(fs,ifile2,i + j,0,&blks[j]);
+         if (blks[j] != 0 && fsi_blk_share(fs,blks[j]) < 0) {
+            num = j;
+            break;
+         }
+      }
+      int linked = (num > 0) ? fsi_inode_link(fs,ifile1,first + i,blks,num) : -1;
+      // release the blocks that were shared but not linked
+      for (unsigned j = MAX(linked,0); j < num; j++) {
+         if (blks[j] != 0) {
+            fsi_blk_free(fs,blks[j]);
+         }
+      }
+      if (linked < 0) {
+         fsi_inode_trunc(fs,ifile1,first);
+         return -1;
+      }
+      i += linked;
+   }
+   if (INODE_TAIL(ifile2)) {
+      if (fsi_blk_share(fs,ifile2->tail) < 0) {
+         fsi_inode_trunc(fs,ifile1,first);
+         return -1;
+      }
+      ifile1->tail = ifile2->tail;
+      ifile1->tail_frag = ifile2->tail_frag;
+   }
+   ifile1->size += size2;
+   return 0;
+}
+
+
+/*
+ * fsi_append_copy: appends file2 to file1 by copying its data, as many
+ * blocks at a time as fit in APPEND_BATCH_BLKS; the locks of the files
+ * are held, meta_lock is not
+ *   returns: 0 if successful, -1 otherwise
+ */
+static int fsi_append_copy(fs_t* fs, inodeid_t file1, inodeid_t file2,
+   unsigned size1, unsigned size2)
+{
+   char* buffer = (char*) malloc(APPEND_BATCH_BLKS * BLOCK_SIZE);
+   int nread;
+
+   for (unsigned done = 0; done < size2; done += nread) {
+      unsigned count = MIN(APPEND_BATCH_BLKS * BLOCK_SIZE, size2 - done);
+      if (fsi_read(fs,file2,done,count,buffer,&nread) < 0 || nread <= 0 ||
+         fsi_write(fs,file1,size1 + done,nread,buffer) < 0) {
+         // drop what was appended so far
+         fsi_meta_lock(fs);
+         fsi_delay_sync(fs,file1,1);
+         fs_inode_t* ifile1 = fsi_inode(fs,file1);
+         unsigned used = ifile1->nblocks;
+         if (!INODE_INLINE(ifile1)) {
+            fsi_inode_trunc(fs,ifile1,OFFSET_TO_BLOCKS(size1));
+         }
+         ifile1->size = size1;
+         ifile1->prealloc = 0;
+         fsi_inode_dirty(fs,file1);
+         fsi_usage_add(fs,ifile1->parent,ifile1->nblocks - used);
+         fsi_store_fsdata(fs);
+         fsi_meta_unlock(fs);
+         free(buffer);
+         return -1;
+      }
+   }
+   free(buffer);
+   return 0;
+}
 
-			if(i < INODE_NUM_BLKS)
-				blk = &ifile->blocks[i];
-	 
-			if (!fsi_bmap_find_free(fs->blk_bmap,block_num_blocks(fs->blocks),blk)) { // ITAB_SIZE
-				dprintf("[fs_write] there are no free blocks.\n");
-				return -1;
-			}
-			BMAP_SET(fs->blk_bmap, *blk);
-			dprintf("[fs_write] block %d allocated.\n", *blk);
-		}
-	}
-   
-	char block[BLOCK_SIZE];
-	int num = 0, pos;
-	int iblock = offset/BLOCK_SIZE;
-
-   	// write within the existent blocks
-	while (num < count && iblock < blks_used) {
-		if(iblock < INODE_NUM_BLKS) {
-			blk = ifile->blocks;
-			pos = iblock;
-		}
-      
-		block_read(fs->blocks, blk[pos], block);
 
-		int start = ((num == 0)?(offset % BLOCK_SIZE):0);
-		for (int i = start; i < BLOCK_SIZE && num < count; i++, num++) {
-			block[i] = buffer[num];
-		}
-		block_write(fs->blocks, blk[pos], block);
-		iblock++;
-	}
+// finds the files of an append, under meta_lock
+static int fsi_append_find(fs_t* fs, inodeid_t dir1, inodeid_t dir2,
+   char* file1, char* file2, inodeid_t* id1, inodeid_t* id2)
+{
+   if (!fsi_inode_used(fs,dir1) || !fsi_inode_used(fs,dir2)) {
+      dprintf("[fs_append] inode is not being used.\n");
+      return -1;
+   }
 
-	dprintf("[fs_write] written %d bytes within.\n", num);
+   if (fsi_inode(fs,dir1)->type != FS_DIR ||
+      fsi_inode(fs,dir2)->type != FS_DIR) {
+      dprintf("[fs_append] inode is not a directory.\n");
+      return -1;
+   }
 
-  	// write within the allocated blocks
-	while (num < count && iblock < blks_used + blks_req) {
-		if(iblock < INODE_NUM_BLKS) {
-			blk = ifile->blocks;
-			pos = iblock;
-		}
-      
-		for (int i = 0; i < BLOCK_SIZE && num < count; i++, num++) {
-			block[i] = buffer[num];
-		}
+   if (FS_SNAP_OF(dir1) != 0) {
+      dprintf("[fs_append] snapshots are read-only.\n");
+      return -1;
+   }
 
-		block_write(fs->blocks, blk[pos], block);
-		iblock++;
-	}
+   if (fsi_dir_search(fs,dir1,file1,id1) < 0 ||
+      fsi_dir_search(fs,dir2,file2,id2) < 0) {
+      dprintf("[fs_append] file does not exist.\n");
+      return -1;
+   }
 
-	if (num != count) {
-		printf("[fs_write] severe error: num=%d != count=%d!\n", num, count);
-		exit(-1);
-	}
+   if (fsi_inode(fs,*id1)->type != FS_FILE ||
+      fsi_inode(fs,*id2)->type != FS_FILE) {
+      dprintf("[fs_append] inode is not a file.\n");
+      return -1;
+   }
+   return 0;
+}
 
-	ifile->size = MAX(offset + count, ifile->size);
 
-   	// update the inode in disk
-	fsi_store_fsdata(fs);
+int fs_append(fs_t* fs, inodeid_t dir1, inodeid_t dir2, char* file1,
+   char* file2, unsigned* fsize)
+{
+   if (fs == NULL || file1 == NULL || file2 == NULL || fsize == NULL) {
+      dprintf("[fs_append] malformed arguments.\n");
+      return -1;
+   }
 
-	dprintf("[fs_write] written %d bytes, file size %d.\n", count, ifile->size);
-	return 0;
+   // file1 is locked for writing and file2 for reading
+   fs_lockset_t rd = 0, wr = 0;
+   inodeid_t id1, id2;
+   while (1) {
+      fsi_lock_set(fs,rd,wr);
+      fsi_meta_lock(fs);
+      if (fsi_append_find(fs,dir1,dir2,file1,file2,&id1,&id2) < 0) {
+         fsi_meta_unlock(fs);
+         fsi_unlock_set(fs,rd,wr);
+         return -1;
+      }
+      if ((wr & FS_LOCK_BIT(id1)) != 0 &&
+         ((rd | wr) & FS_LOCK_BIT(id2)) != 0) {
+         break;
+      }
+      fsi_meta_unlock(fs);
+      fsi_unlock_set(fs,rd,wr);
+      wr |= FS_LOCK_BIT(id1);
+      rd |= FS_LOCK_BIT(id2);
+   }
+
+   // the blocks of both files are to be on the disk
+   if (fsi_delay_sync(fs,id1,0) < 0 || fsi_delay_sync(fs,id2,1) < 0) {
+      fsi_store_fsdata(fs);
+      fsi_meta_unlock(fs);
+      fsi_unlock_set(fs,rd,wr);
+      dprintf("[fs_append] there are no free blocks.\n");
+      return -1;
+   }
+
+   // the size of file2 is taken first, file1 and file2 may be the same
+   fs_inode_t* ifile1 = fsi_inode(fs,id1);
+   fs_inode_t* ifile2 = fsi_inode(fs,id2);
+   unsigned size2 = ifile2->size;
+   unsigned used = ifile1->nblocks;
+   int status;
+
+   // block aligned files take the blocks of file2 without copying them,
+   // in place of the blocks file1 may have allocated past its size
+   if (ifile1->size % BLOCK_SIZE == 0 && !INODE_INLINE(ifile2)) {
+      if (ifile1->prealloc != 0) {
+         fsi_inode_trunc(fs,ifile1,ifile1->size / BLOCK_SIZE);
+         ifile1->prealloc = 0;
+      }
+      status = fsi_append_link(fs,ifile1,ifile2,size2);
+      fsi_inode_dirty(fs,id1);
+      fsi_usage_add(fs,ifile1->parent,ifile1->nblocks - used);
+      fsi_store_fsdata(fs);
+      fsi_meta_unlock(fs);
+   } else {
+      fsi_meta_unlock(fs);
+      status = fsi_append_copy(fs,id1,id2,ifile1->size,size2);
+   }
+   *fsize = ifile1->size;
+   fsi_unlock_set(fs,rd,wr);
+
+   if (status < 0) {
+      dprintf("[fs_append] there are no free blocks.\n");
+      return -1;
+   }
+   return 0;
 }
 
-int fs_create(fs_t* fs, inodeid_t dir, char* file, inodeid_t* fileid)
-{	
-   if (fs == NULL || dir >= ITAB_SIZE || file == NULL || fileid == NULL) {
-      printf("[fs_create] malformed arguments.\n");
+
+static int fsi_diskusage(fs_t* fs, inodeid_t dir, unsigned first,
+   fs_usage_entry_t* entries, int maxentries, int* numentries,
+   fs_usage_t* usage)
+{
+   if (fs == NULL || entries == NULL || numentries == NULL ||
+      usage == NULL || maxentries < 0) {
+      dprintf("[fs_diskusage] malformed arguments.\n");
       return -1;
    }
 
-   if (strlen(file) == 0 || strlen(file)+1 > FS_MAX_FNAME_SZ){
-      dprintf("[fs_create] file name size error.\n");
+   if (!fsi_inode_used(fs,dir)) {
+      dprintf("[fs_diskusage] inode is not being used.\n");
+      return -1;
+   }
+
+   fs_inode_t* idir = fsi_inode(fs,dir);
+   if (idir->type != FS_DIR) {
+      dprintf("[fs_diskusage] inode is not a directory.\n");
+      return -1;
+   }
+
+   usage->num_blocks = fs->sb.num_blocks;
+   sthread_mutex_lock(fs->alloc_lock);
+   fsi_bmap_load(fs);
+   usage->free_blocks = fs->sb.free_blocks - fs->delay_reserved;
+   usage->free_extents = fs->free_extents;
+   usage->largest_free = fs->free_tree[1].run;
+   sthread_mutex_unlock(fs->alloc_lock);
+   usage->dir_blocks = idir->nblocks;
+   usage->tree_blocks = idir->tree_blocks + fsi_delay_usage(fs,dir);
+   usage->num_entries = idir->size / sizeof(fs_dentry_t);
+
+   // fill in the entries starting at position 'first'
+   FS_BLOCK_BUF(fs_dpage_t,page);
+   unsigned pos = first, blk;
+   int ientry = 0;
+
+   while (pos < usage->num_entries && ientry < maxentries) {
+      fsi_inode_map(fs,idir,pos / DIR_PAGE_ENTRIES,0,&blk);
+      block_read(fs->blocks,blk,page->data);
+      do {
+         fs_dentry_t* entry = &page->entry[pos % DIR_PAGE_ENTRIES];
+         inodeid_t ino = FS_SNAP_CHILD(dir,entry->inodeid);
+         fs_inode_t* inode = fsi_inode(fs,ino);
+         strcpy(entries[ientry].name,entry->name);
+         entries[ientry].inodeid = ino;
+         entries[ientry].type = inode->type;
+         entries[ientry].blocks = ((inode->type == FS_DIR) ?
+            inode->tree_blocks : inode->nblocks) + fsi_delay_usage(fs,ino);
+         ientry++;
+         pos++;
+      } while (pos % DIR_PAGE_ENTRIES != 0 && pos < usage->num_entries &&
+         ientry < maxentries);
+   }
+   *numentries = ientry;
+   return 0;
+}
+
+
+int fs_diskusage(fs_t* fs, inodeid_t dir, unsigned first,
+   fs_usage_entry_t* entries, int maxentries, int* numentries,
+   fs_usage_t* usage)
+{
+   if (fs == NULL) {
+      dprintf("[fs_diskusage] malformed arguments.\n");
+      return -1;
+   }
+
+   fsi_lock_set(fs,FS_LOCK_BIT(dir),0);
+   fsi_meta_lock(fs);
+   int status = fsi_diskusage(fs,dir,first,entries,maxentries,numentries,
+      usage);
+   fsi_meta_unlock(fs);
+   fsi_unlock_set(fs,FS_LOCK_BIT(dir),0);
+   return status;
+}
+
+
+/*
+ * Defragmentation
+ * - moves the data blocks of each file (and directory) to the first free
+ *   run that holds them all, when the file is fragmented or the run lies
+ *   before its current blocks; extending tables are not moved
+ * - the work is split in steps of a bounded number of block moves and of
+ *   inodes visited, each one leaving the file system consistent, so that
+ *   other requests can be served in between; a run taken meanwhile makes
+ *   the file be skipped
+ * - the fragmentation is measured on each file as it is visited, before
+ *   and after moving its blocks, so that no step scans every file
+ */
+
+#define DEFRAG_STEP_INODES 64
+
+// checks if any block reached through an extending table is shared
+static int fsi_table_shared(fs_t* fs, unsigned tblk, int levels)
+{
+   fs_inode_ext_t refs[EXT_INODE_NUM_BLKS];
+
+   if (fsi_blk_shared(fs,tblk)) {
+      return 1;
+   }
+   memcpy(refs,fsi_icache_get(fs,tblk),sizeof(refs));
+   for (unsigned i = 0; i < EXT_INODE_NUM_BLKS; i++) {
+      if (refs[i] != 0 && ((levels == 1) ? fsi_blk_shared(fs,refs[i]) :
+            fsi_table_shared(fs,refs[i],levels-1))) {
+         return 1;
+      }
+   }
+   return 0;
+}
+
+
+/*
+ * fsi_defrag_inode: checks if the data blocks of an inode are to be
+ * relocated; blocks shared with copies stay where they are
+ */
+static int fsi_defrag_inode(fs_t* fs, fs_inode_t* inode)
+{
+   if ((inode->type != FS_FILE && inode->type != FS_DIR &&
+      inode->type != FS_DIR_INDEX) || INODE_INLINE(inode) || inode->size == 0) {
+      return 0;
+   }
+   if (fs->blk_refs == NULL) {
+      return 1;
+   }
+   for (int i = 0; i < INODE_NUM_BLKS; i++) {
+      if (inode->blocks[i] != 0 && fsi_blk_shared(fs,inode->blocks[i])) {
+         return 0;
+      }
+   }
+   return !(inode->reserved[INODE_IND] != 0 &&
+         fsi_table_shared(fs,inode->reserved[INODE_IND],1)) &&
+      !(inode->reserved[INODE_DIND] != 0 &&
+         fsi_table_shared(fs,inode->reserved[INODE_DIND],2));
+}
+
+
+/*
+ * fsi_frag_count: counts the data blocks of a file that follow another
+ * block of it, and the 'breaks' among them, those that do not follow the
+ * previous block of the file
+ */
+static void fsi_frag_count(fs_t* fs, fs_inode_t* inode, unsigned* blocks,
+   unsigned* breaks)
+{
+   unsigned prev = 0, blk;
+
+   for (unsigned i = 0; i < OFFSET_TO_BLOCKS(inode->size); i++) {
+      fsi_inode_map(fs,inode,i,0,&blk);
+      if (blk == 0) {
+         continue;
+      }
+      if (prev != 0) {
+         (*blocks)++;
+         *breaks += (blk != prev + 1);
+      }
+      prev = blk;
+   }
+}
+
+
+// fragmentation, as the percentage of the blocks that are breaks
+static unsigned fsi_frag(unsigned blocks, unsigned breaks)
+{
+   return (blocks == 0) ? 0 : (100 * breaks) / blocks;
+}
+
+
+/*
+ * fsi_defrag_target: chooses where to move the blocks of a file
+ *   returns: 1 if the file is to be moved, 0 otherwise
+ */
+static int fsi_defrag_target(fs_t* fs, fs_inode_t* inode, unsigned* target)
+{
+   unsigned num = 0, first = 0, prev = 0, blk;
+   int contiguous = 1;
+
+   for (unsigned i = 0; i < OFFSET_TO_BLOCKS(inode->size); i++) {
+      fsi_inode_map(fs,inode,i,0,&blk);
+      if (blk == 0) {
+         continue;
+      }
+      if (num++ == 0) {
+         first = blk;
+      } else if (blk != prev + 1) {
+         contiguous = 0;
+      }
+      prev = blk;
+   }
+
+   sthread_mutex_lock(fs->alloc_lock);
+   fsi_bmap_load(fs);
+   int found = fsi_ftree_find(fs,0,num,target);
+   sthread_mutex_unlock(fs->alloc_lock);
+   if (num == 0 || !found) {
+      return 0;
+   }
+   return !contiguous || *target < first;
+}
+
+
+// shrinks the index of a directory that lost most of its entries
+static void fsi_defrag_didx(fs_t* fs, inodeid_t dir)
+{
+   fs_inode_t* idir = fsi_inode(fs,dir);
+   if (idir->reserved[INODE_DIDX] == 0) {
+      return;
+   }
+
+   unsigned num = idir->size / sizeof(fs_dentry_t);
+   if (num <= DIR_INDEX_MIN) {
+      fsi_didx_drop(fs,dir);
+      return;
+   }
+   if (fsi_didx_sparse(fs,dir,2)) {
+      fsi_didx_build(fs,dir);
+   }
+}
+
+
+void fs_defrag_begin(fs_t* fs, fs_defrag_t* df)
+{
+   memset(df,0,sizeof(*df));
+}
+
+
+/*
+ * fsi_defrag_file: moves up to 'maxmoves' blocks of inode df->ino, whose
+ * lock is held along with meta_lock; moves on to the next inode once the
+ * blocks of this one are in place
+ *   returns: the number of blocks moved
+ */
+static unsigned fsi_defrag_file(fs_t* fs, fs_defrag_t* df, unsigned maxmoves)
+{
+   char block[BLOCK_SIZE];
+   unsigned moves = 0, blk;
+
+   if (!fsi_inode_used(fs,df->ino) ||
+      !fsi_defrag_inode(fs,fsi_inode(fs,df->ino)) ||
+      fsi_delay_sync(fs,df->ino,1) < 0) {
+      df->ino++;
+      df->moving = 0;
+      return 0;
+   }
+   fs_inode_t* inode = fsi_inode(fs,df->ino);
+
+   // choose the destination of the file blocks
+   if (!df->moving) {
+      if (inode->type == FS_DIR) {
+         fsi_defrag_didx(fs,df->ino);
+      }
+      fsi_frag_count(fs,inode,&df->blocks_before,&df->breaks_before);
+      if (!fsi_defrag_target(fs,inode,&df->target)) {
+         fsi_frag_count(fs,inode,&df->blocks_after,&df->breaks_after);
+         df->ino++;
+         return 0;
+      }
+      df->moving = 1;
+      df->iblock = 0;
+   }
+
+   // move the blocks, one at a time
+   int taken = 0;
+   while (moves < maxmoves && df->iblock < OFFSET_TO_BLOCKS(inode->size)) {
+      fsi_inode_map(fs,inode,df->iblock,0,&blk);
+      if (blk != 0 && blk != df->target) {
+         if (fsi_blk_take(fs,df->target) < 0) {
+            taken = 1;
+            break;
+         }
+         block_read(fs->blocks,blk,block);
+         block_write(fs->blocks,df->target,block);
+         fsi_inode_remap(fs,inode,df->iblock,df->target);
+         fsi_blk_free(fs,blk);
+         moves++;
+      }
+      if (blk != 0) {
+         df->target++;
+      }
+      df->iblock++;
+   }
+   fsi_inode_dirty(fs,df->ino);
+
+   if (taken || df->iblock >= OFFSET_TO_BLOCKS(inode->size)) {
+      fsi_frag_count(fs,inode,&df->blocks_after,&df->breaks_after);
+      df->ino++;
+      df->moving = 0;
+   }
+   return moves;
+}
+
+
+int fs_defrag_step(fs_t* fs, fs_defrag_t* df, unsigned maxmoves)
+{
+   if (fs == NULL || df == NULL || maxmoves == 0) {
+      dprintf("[fs_defrag] malformed arguments.\n");
+      return -1;
+   }
+
+   // one inode at a time, holding its lock
+   unsigned moves = 0, visits = 0;
+   int more = 1;
+   while (moves < maxmoves && visits++ < DEFRAG_STEP_INODES && more) {
+      inodeid_t ino = df->ino;
+      fsi_lock_set(fs,0,FS_LOCK_BIT(ino));
+      fsi_meta_lock(fs);
+      more = ino < fs->sb.num_inodes;
+      if (more) {
+         moves += fsi_defrag_file(fs,df,maxmoves - moves);
+      }
+      fsi_meta_unlock(fs);
+      fsi_unlock_set(fs,0,FS_LOCK_BIT(ino));
+   }
+   df->moved += moves;
+
+   // save the file system metadata
+   fsi_meta_lock(fs);
+   fsi_store_fsdata(fs);
+   more = df->ino < fs->sb.num_inodes;
+   if (!more) {
+      df->frag_before = fsi_frag(df->blocks_before,df->breaks_before);
+      df->frag_after = fsi_frag(df->blocks_after,df->breaks_after);
+   }
+   fsi_meta_unlock(fs);
+   return more;
+}
+
+
+/*
+ * Snapshots
+ */
+
+// checks if the blocks of an inode are kept by the snapshots
+static int fsi_snap_kept(fs_inode_t* inode)
+{
+   return inode->type == FS_FILE || inode->type == FS_DIR ||
+      inode->type == FS_DIR_INDEX;
+}
+
+
+/*
+ * fsi_inode_share: adds a reference to the blocks referenced by an inode
+ * (direct blocks, extending tables and fragment block)
+ *   returns: 0 if successful, -1 otherwise (no reference is added)
+ */
+static int fsi_inode_share(fs_t* fs, fs_inode_t* inode)
+{
+   unsigned refs[INODE_NUM_BLKS + 3];
+
+   if (INODE_INLINE(inode)) {
+      return 0;
+   }
+   memcpy(refs,inode->blocks,sizeof(inode->blocks));
+   refs[INODE_NUM_BLKS] = inode->reserved[INODE_IND];
+   refs[INODE_NUM_BLKS + 1] = inode->reserved[INODE_DIND];
+   refs[INODE_NUM_BLKS + 2] = inode->tail;
+   for (int i = 0; i < INODE_NUM_BLKS + 3; i++) {
+      if (refs[i] != 0 && fsi_blk_share(fs,refs[i]) < 0) {
+         while (--i >= 0) {
+            if (refs[i] != 0) {
+               fsi_blk_free(fs,refs[i]);
+            }
+         }
+         return -1;
+      }
+   }
+   return 0;
+}
+
+
+// drops the references held by an inode, leaving the inode as it is
+static void fsi_inode_release(fs_t* fs, fs_inode_t* inode)
+{
+   fs_inode_t copy = *inode;
+   fsi_inode_trunc(fs,&copy,0);
+}
+
+
+/*
+ * fsi_snap_release: drops the references held by the inodes of snapshot
+ * 's' below 'num' and by its inode table and free inode bitmap; the
+ * blocks no one else references are freed
+ */
+static void fsi_snap_release(fs_t* fs, int s, unsigned num)
+{
+   fs_snap_t* snap = &fs->snaps[s];
+
+   for (unsigned ino = 1; ino < num; ino++) {
+      inodeid_t id = FS_SNAP_CHILD(FS_SNAP_ROOT(s),ino);
+      if (fsi_inode_used(fs,id) && fsi_snap_kept(fsi_inode(fs,id))) {
+         fsi_inode_release(fs,fsi_inode(fs,id));
+      }
+   }
+   fsi_inode_release(fs,&snap->rec.ibmap);
+   fsi_inode_release(fs,&snap->rec.itab);
+}
+
+
+/*
+ * fsi_snap_undo: frees what a failed creation of snapshot 's' allocated
+ * for its record, the snapshots inode if 'created' for it, or else the
+ * record block past 'size', the former size of the snapshots inode
+ */
+static void fsi_snap_undo(fs_t* fs, int s, unsigned size, int created)
+{
+   fs_inode_t* isnaps = fsi_inode(fs,fs->sb.snaps);
+   if (created) {
+      fsi_inode_trunc(fs,isnaps,0);
+      fsi_inode_dirty(fs,fs->sb.snaps);
+      fsi_ino_free(fs,fs->sb.snaps);
+      fs->sb.snaps = 0;
+      fs->sb_dirty = 1;
+   } else if ((unsigned)s >= size / BLOCK_SIZE) {
+      fsi_inode_trunc(fs,isnaps,s);
+      isnaps->size = size;
+      fsi_inode_dirty(fs,fs->sb.snaps);
+   }
+   fsi_store_fsdata(fs);
+}
+
+
+static int fsi_snapshot_create(fs_t* fs, char* name, inodeid_t* root)
+{
+   if (fsi_snap_find(fs,name) >= 0) {
+      dprintf("[fs_snapshot_create] snapshot already exists.\n");
+      return -1;
+   }
+
+   int s = 0;
+   while (s < FS_MAX_SNAPSHOTS && fs->snaps[s].rec.name[0] != '\0') {
+      s++;
+   }
+   if (s == FS_MAX_SNAPSHOTS) {
+      dprintf("[fs_snapshot_create] too many snapshots.\n");
+      return -1;
+   }
+
+   // the data kept in memory goes to the snapshot too
+   for (int i = 0; i < DELAY_FILES; i++) {
+      if (fs->delay[i].ino != 0) {
+         fsi_delay_flush(fs,&fs->delay[i],1);
+      }
+   }
+
+   // the record of snapshot 's' is block 's' of the snapshot file
+   int created = (fs->sb.snaps == 0);
+   if (created) {
+      unsigned ino;
+      if (fsi_ino_alloc(fs,&ino) < 0) {
+         dprintf("[fs_snapshot_create] there are no free inodes.\n");
+         return -1;
+      }
+      fsi_inode_init(fsi_inode(fs,ino),FS_SNAPSHOTS,0);
+      fsi_inode_dirty(fs,ino);
+      fs->sb.snaps = ino;
+      fs->sb_dirty = 1;
+   }
+   fs_inode_t* isnaps = fsi_inode(fs,fs->sb.snaps);
+   unsigned size = isnaps->size;
+   FS_BLOCK_BUF(fs_snap_page_t,page);
+   unsigned blk;
+   if (fsi_inode_map(fs,isnaps,s,1,&blk) < 0 ||
+      (fs->blk_refs == NULL && fsi_refs_init(fs) < 0)) {
+      dprintf("[fs_snapshot_create] there are no free blocks.\n");
+      fsi_snap_undo(fs,s,size,created);
+      return -1;
+   }
+
+   // the record stays empty until the snapshot is complete
+   memset(page,0,BLOCK_SIZE);
+   block_write(fs->blocks,blk,page->data);
+   isnaps->size = MAX(isnaps->size, (unsigned)(s + 1) * BLOCK_SIZE);
+   fsi_inode_dirty(fs,fs->sb.snaps);
+
+   // the snapshot takes the inode table as written on the disk
+   fsi_ibmap_load(fs);
+   fsi_store_fsdata(fs);
+   for (unsigned i = 0; i < fs->sb.itab.size / BLOCK_SIZE; i++) {
+      if (fs->inode_tab_dirty[i]) {
+         dprintf("[fs_snapshot_create] there are no free blocks.\n");
+         fsi_snap_undo(fs,s,size,created);
+         return -1;
+      }
+   }
+   for (unsigned i = 0; i < fs->sb.ibmap.size / BLOCK_SIZE; i++) {
+      if (fs->inode_bmap_dirty[i]) {
+         dprintf("[fs_snapshot_create] there are no free blocks.\n");
+         fsi_snap_undo(fs,s,size,created);
+         return -1;
+      }
+   }
+   fs_snap_t* snap = &fs->snaps[s];
+   strcpy(snap->rec.name,name);
+   snap->rec.num_inodes = fs->sb.num_inodes;
+   snap->rec.itab = fs->sb.itab;
+   snap->rec.ibmap = fs->sb.ibmap;
+   snap->inode_tab = (fs_inode_t**) calloc(fs->sb.itab.size / BLOCK_SIZE,
+      sizeof(fs_inode_t*));
+   snap->inode_bmap = (char*) malloc(fs->sb.ibmap.size);
+   memcpy(snap->inode_bmap,fs->inode_bmap,fs->sb.ibmap.size);
+
+   // every block gets one more reference, held by the snapshot
+   int failed = 0;
+   if (fsi_inode_share(fs,&snap->rec.itab) < 0) {
+      failed = 1;
+   } else if (fsi_inode_share(fs,&snap->rec.ibmap) < 0) {
+      fsi_inode_release(fs,&snap->rec.itab);
+      failed = 1;
+   }
+   for (inodeid_t ino = 1; !failed && ino < fs->sb.num_inodes; ino++) {
+      fs_inode_t* inode = fsi_inode(fs,ino);
+      if (fsi_inode_used(fs,ino) && fsi_snap_kept(inode) &&
+         fsi_inode_share(fs,inode) < 0) {
+         fsi_snap_release(fs,s,ino);
+         failed = 1;
+      }
+   }
+   if (failed) {
+      dprintf("[fs_snapshot_create] unable to share the blocks.\n");
+      fsi_snap_free(fs,snap);
+      fsi_snap_undo(fs,s,size,created);
       return -1;
    }
 
-   if (!BMAP_ISSET(fs->inode_bmap,dir)) {
-      dprintf("[fs_create] inode is not being used.\n");
+   page->rec = snap->rec;
+   block_write(fs->blocks,blk,page->data);
+
+   // save the file system metadata
+   fsi_store_fsdata(fs);
+
+   *root = FS_SNAP_ROOT(s);
+   return 0;
+}
+
+
+int fs_snapshot_create(fs_t* fs, char* name, inodeid_t* root)
+{
+   if (fs == NULL || name == NULL || root == NULL) {
+      dprintf("[fs_snapshot_create] malformed arguments.\n");
       return -1;
    }
 
-   fs_inode_t* idir = &fs->inode_tab[dir];
-   if (idir->type != FS_DIR) {
-      dprintf("[fs_create] inode is not a directory.\n");
+   if (strlen(name) == 0 || strlen(name)+1 > FS_MAX_FNAME_SZ) {
+      dprintf("[fs_snapshot_create] snapshot name size error.\n");
       return -1;
    }
 
-   if (fsi_dir_search(fs,dir,file,fileid) == 0) {
-      dprintf("[fs_create] file already exists.\n");
+   // the files are locked for reading, so that no write is halfway
+   // through when the snapshot is taken
+   fsi_lock_set(fs,~(fs_lockset_t)0,0);
+   fsi_meta_lock(fs);
+   int status = fsi_snapshot_create(fs,name,root);
+   fsi_meta_unlock(fs);
+   fsi_unlock_set(fs,~(fs_lockset_t)0,0);
+   return status;
+}
+
+
+int fs_snapshot_delete(fs_t* fs, char* name)
+{
+   if (fs == NULL || name == NULL) {
+      dprintf("[fs_snapshot_delete] malformed arguments.\n");
       return -1;
    }
-   
-   // check if there are free inodes
-   unsigned finode;
-   if (!fsi_bmap_find_free(fs->inode_bmap,ITAB_SIZE,&finode)) {
-      dprintf("[fs_create] there are no free inodes.\n");
+
+   // the files are locked for writing, so that no one is reading the
+   // blocks of the snapshot when they are freed
+   fsi_lock_set(fs,0,~(fs_lockset_t)0);
+   fsi_meta_lock(fs);
+   int s = fsi_snap_find(fs,name);
+   if (s < 0) {
+      fsi_meta_unlock(fs);
+      fsi_unlock_set(fs,0,~(fs_lockset_t)0);
+      dprintf("[fs_snapshot_delete] snapshot does not exist.\n");
       return -1;
    }
-
-   // add a new block to the directory if necessary
-   if (idir->size % BLOCK_SIZE == 0) {
-      unsigned fblock;
-      if (!fsi_bmap_find_free(fs->blk_bmap,block_num_blocks(fs->blocks),&fblock)) {
-         dprintf("[fs_create] no free blocks to augment directory.\n");
-         return -1;
+   fsi_snap_release(fs,s,fs->snaps[s].rec.num_inodes);
+
+   // free the record
+   FS_BLOCK_BUF(fs_snap_page_t,page);
+   unsigned blk;
+   memset(page,0,BLOCK_SIZE);
+   fsi_inode_map(fs,fsi_inode(fs,fs->sb.snaps),s,0,&blk);
+   block_write(fs->blocks,blk,page->data);
+
+   // forget the directory entries of the snapshot
+   for (int i = 0; i < DCACHE_SIZE; i++) {
+      if (fs->dcache[i].dir != 0 && FS_SNAP_OF(fs->dcache[i].dir) == s + 1) {
+         fsi_dcache_unlink(fs,&fs->dcache[i]);
       }
-      BMAP_SET(fs->blk_bmap,fblock);
-      idir->blocks[idir->size / BLOCK_SIZE] = fblock;
    }
-
-   // add the entry to the directory
-   fs_dentry_t page[DIR_PAGE_ENTRIES];
-   block_read(fs->blocks,idir->blocks[idir->size/BLOCK_SIZE],(char*)page); //mete o resultado da leitura em (char*)page
-   fs_dentry_t* entry = &page[idir->size % BLOCK_SIZE / sizeof(fs_dentry_t)]; // entry: próxima posição vazia do bloco
-   strcpy(entry->name,file);
-   entry->inodeid = finode;
-   block_write(fs->blocks,idir->blocks[idir->size/BLOCK_SIZE],(char*)page);
-   idir->size += sizeof(fs_dentry_t);
-
-   // reserve and init the new file inode
-   BMAP_SET(fs->inode_bmap,finode);
-   fsi_inode_init(&fs->inode_tab[finode],FS_FILE);
+   fsi_snap_free(fs,&fs->snaps[s]);
 
    // save the file system metadata
    fsi_store_fsdata(fs);
-
-   *fileid = finode;
+   fsi_meta_unlock(fs);
+   fsi_unlock_set(fs,0,~(fs_lockset_t)0);
    return 0;
 }
 
-int fs_mkdir(fs_t* fs, inodeid_t dir, char* newdir, inodeid_t* newdirid)
+
+int fs_flush(fs_t* fs)
 {
-	if (fs==NULL || dir>=ITAB_SIZE || newdir==NULL || newdirid==NULL) {
-		printf("[fs_mkdir] malformed arguments.\n");
-		return -1;
-	}
+   if (fs == NULL) {
+      dprintf("[fs_flush] malformed arguments.\n");
+      return -1;
+   }
 
-	if (strlen(newdir) == 0 || strlen(newdir)+1 > FS_MAX_FNAME_SZ){
-		dprintf("[fs_mkdir] directory size error.\n");
-		return -1;
-	}
+   // the files are locked for reading, like for a snapshot
+   int status = 0;
+   fsi_lock_set(fs,~(fs_lockset_t)0,0);
+   fsi_meta_lock(fs);
+   for (int i = 0; i < DELAY_FILES; i++) {
+      if (fs->delay[i].ino != 0 && fsi_delay_flush(fs,&fs->delay[i],1) < 0) {
+         status = -1;
+      }
+   }
+   fsi_store_fsdata(fs);
+   fsi_meta_unlock(fs);
+   fsi_unlock_set(fs,~(fs_lockset_t)0,0);
+   return status;
+}
 
-	if (!BMAP_ISSET(fs->inode_bmap,dir)) {
-		dprintf("[fs_mkdir] inode is not being used.\n");
-		return -1;
-	}
 
-	fs_inode_t* idir = &fs->inode_tab[dir];
-	if (idir->type != FS_DIR) {
-		dprintf("[fs_mkdir] inode is not a directory.\n");
-		return -1;
-	}
 
-	if (fsi_dir_search(fs,dir,newdir,newdirid) == 0) {
-		dprintf("[fs_mkdir] directory already exists.\n");
-		return -1;
-	}
-   
-   	// check if there are free inodes
-	unsigned finode;
-	if (!fsi_bmap_find_free(fs->inode_bmap,ITAB_SIZE,&finode)) {
-		dprintf("[fs_mkdir] there are no free inodes.\n");
-		return -1;
-	}
+/*
+ * Consistency check
+ * - the inodes in use are split among FSCK_THREADS threads, which walk
+ *   them in two passes: the first finds the directory linking each inode
+ *   (and counts the names of each file),
+ *   the second counts the references to each block from the inodes
+ *   linked to the tree and from the snapshots
+ * - each thread keeps its own links and counts, merged after the pass;
+ *   only the claim of an extending table, walked once however many
+ *   references it has, is shared
+ * - the bitmaps, the reference counts and the free counters rebuilt from
+ *   the counts are then compared with those of the file system
+ */
 
-   	// add a new block to the directory if necessary
-	if (idir->size % BLOCK_SIZE == 0) {
-		unsigned fblock;
-		if (!fsi_bmap_find_free(fs->blk_bmap,block_num_blocks(fs->blocks),&fblock)) {
-			dprintf("[fs_mkdir] no free blocks to augment directory.\n");
-			return -1;
-		}
-		BMAP_SET(fs->blk_bmap,fblock);
-		idir->blocks[idir->size / BLOCK_SIZE] = fblock;
-	}
+#define FSCK_THREADS 4
+
+// states of an inode while finding if it is linked to the tree
+#define FSCK_LINKED 1
+#define FSCK_ORPHAN 2
+#define FSCK_WALKING 3
+
+typedef struct fs_fsck_ctx {
+   fs_t* fs;
+   int pass;                // 1 -> links, 2 -> block references
+   char* state;             // FSCK_* state of each inode (pass 2)
+   char* walked;            // bitmap of the extending tables walked
+   sthread_mutex_t lock;    // guards 'walked'
+} fs_fsck_ctx_t;
+
+// the work of one thread
+typedef struct fs_fsck_part {
+   fs_fsck_ctx_t* ctx;
+   int index;
+   inodeid_t* link;         // directory linking each inode (pass 1)
+   unsigned* names;         // entries linking each inode (pass 1)
+   unsigned* refs;          // references to each block (pass 2)
+   unsigned bad_refs;
+   unsigned bad_entries;
+} fs_fsck_part_t;
+
+
+// checks that a reference points to a block of the data area
+static int fsi_fsck_valid(fs_t* fs, unsigned blk)
+{
+   return blk >= fs->sb.bmap_start + fs->sb.bmap_blks &&
+      blk < fs->sb.num_blocks;
+}
 
-   	// add the entry to the directory
-	fs_dentry_t page[DIR_PAGE_ENTRIES];
-	block_read(fs->blocks,idir->blocks[idir->size/BLOCK_SIZE],(char*)page);
-	fs_dentry_t* entry = &page[idir->size % BLOCK_SIZE / sizeof(fs_dentry_t)];
-	strcpy(entry->name,newdir);
-	entry->inodeid = finode;
-	block_write(fs->blocks,idir->blocks[idir->size/BLOCK_SIZE],(char*)page);
-	idir->size += sizeof(fs_dentry_t);
 
-   	// reserve and init the new file inode
-	BMAP_SET(fs->inode_bmap,finode);
-	fsi_inode_init(&fs->inode_tab[finode],FS_DIR);
+// records the directory linking the entries of the pages under a
+// reference of a directory, 'left' entries still to go
+static void fsi_fsck_pages(fs_fsck_part_t* part, inodeid_t dir,
+   unsigned blk, int levels, int* left)
+{
+   fs_t* fs = part->ctx->fs;
+   if (blk == 0 || *left <= 0 || !fsi_fsck_valid(fs,blk)) {
+      return;
+   }
 
-   	// save the file system metadata
-	fsi_store_fsdata(fs);
+   if (levels > 0) {
+      FS_BLOCK_BUF(fs_inode_ext_t,refs);
+      block_read(fs->blocks,blk,(char*)refs);
+      for (unsigned i = 0; i < EXT_INODE_NUM_BLKS && *left > 0; i++) {
+         fsi_fsck_pages(part,dir,refs[i],levels - 1,left);
+      }
+      return;
+   }
 
-	*newdirid = finode;
-	return 0;
+   FS_BLOCK_BUF(fs_dpage_t,page);
+   block_read(fs->blocks,blk,page->data);
+   for (int j = 0; j < DIR_PAGE_ENTRIES && *left > 0; j++, (*left)--) {
+      inodeid_t ino = page->entry[j].inodeid;
+      if (ino <= 1 || ino >= fs->sb.num_inodes) {
+         part->bad_entries++;
+         continue;
+      }
+      // of the names of a file, the one of its parent is kept
+      if (part->link[ino] == 0 || fsi_inode(fs,ino)->parent == dir) {
+         part->link[ino] = dir;
+      }
+      part->names[ino]++;
+   }
 }
 
 
-int fs_readdir(fs_t* fs, inodeid_t dir, fs_file_name_t* entries, int maxentries,
-   int* numentries)
+// counts a reference to a block; an extending table is walked once
+static void fsi_fsck_count(fs_fsck_part_t* part, unsigned blk, int levels)
 {
-   if (fs == NULL || dir >= ITAB_SIZE || entries == NULL ||
-      numentries == NULL || maxentries < 0) {
-      dprintf("[fs_readdir] malformed arguments.\n");
-      return -1;
+   fs_fsck_ctx_t* ctx = part->ctx;
+   fs_t* fs = ctx->fs;
+   if (!fsi_fsck_valid(fs,blk)) {
+      part->bad_refs++;
+      return;
    }
-
-   if (!BMAP_ISSET(fs->inode_bmap,dir)) {
-      dprintf("[fs_readdir] inode is not being used.\n");
-      return -1;
+   part->refs[blk]++;
+   if (levels == 0) {
+      return;
    }
 
-   fs_inode_t* idir = &fs->inode_tab[dir];
-   if (idir->type != FS_DIR) {
-      dprintf("[fs_readdir] inode is not a directory.\n");
-      return -1;
+   sthread_mutex_lock(ctx->lock);
+   int walked = BMAP_ISSET(ctx->walked,blk);
+   BMAP_SET(ctx->walked,blk);
+   sthread_mutex_unlock(ctx->lock);
+   if (walked) {
+      return;
    }
 
-   // fill in the entries with the directory content
-   fs_dentry_t page[DIR_PAGE_ENTRIES];
-   int num = MIN(idir->size / sizeof(fs_dentry_t), maxentries);
-   int iblock = 0, ientry = 0;
-
-   while (num > 0) {
-      block_read(fs->blocks,idir->blocks[iblock++],(char*)page);
-      for (int i = 0; i < DIR_PAGE_ENTRIES && num > 0; i++, num--) {
-         strcpy(entries[ientry].name, page[i].name);
-         entries[ientry].type = fs->inode_tab[page[i].inodeid].type;
-         ientry++;
+   FS_BLOCK_BUF(fs_inode_ext_t,refs);
+   block_read(fs->blocks,blk,(char*)refs);
+   for (unsigned i = 0; i < EXT_INODE_NUM_BLKS; i++) {
+      if (refs[i] != 0) {
+         fsi_fsck_count(part,refs[i],levels - 1);
       }
    }
-   *numentries = ientry;
-   return 0;
-}
-
-/*
- * void search_dir_entry (fs_t* fs, inodei_t dir, inodeid_t fileid, int *num_dir_entry, char*page)
- *
- * searches an entry in a file system
- *
- * fs - reference to the filesystem
- * dir - directory to be searched
- * fileid - file id 
- * *num_dir_entry - number refering to the position of an entry in a block of a certain directory [out]
- * *page - array of entries [out]
- */
-void search_dir_entry (fs_t* fs, inodeid_t dir, inodeid_t fileid, int *num_dir_entry, int* block_num, char* page){
-	
-	fs_inode_t* idir = &fs->inode_tab[dir];
-	int num = idir->size / sizeof(fs_dentry_t); //número de entradas no directório
-	int iblock = 0;
-	fs_dentry_t ipage[DIR_PAGE_ENTRIES];
-
-	while (num > 0){
-		block_read(fs->blocks, idir->blocks[iblock++], (char*)ipage); //guarda um bloco em page
-		for (int i = 0; i < DIR_PAGE_ENTRIES && num > 0; i++, num--) {
-			if (ipage[i].inodeid == fileid){
-				num_dir_entry = &i;
-				block_num = &iblock;
-				page = (char *) ipage;
-				return;
-			}
-		}
-	}
-
-	return;
 }
 
-void fs_remove_file(fs_t* fs, inodeid_t entryid) {
 
-	fs_inode_t ifile = fs->inode_tab[entryid];
+// walks the references of an inode, in the pass of the thread
+static void fsi_fsck_inode(fs_fsck_part_t* part, inodeid_t ino,
+   fs_inode_t* inode)
+{
+   if (INODE_INLINE(inode)) {
+      return;
+   }
 
-	for(int i = 0; i < INODE_NUM_BLKS && ifile.blocks[i] != 0 ; i++) {
-		BMAP_CLR(fs->blk_bmap, ifile.blocks[i]);
-	}
+   if (part->ctx->pass == 2) {
+      for (int i = 0; i < INODE_NUM_BLKS; i++) {
+         if (inode->blocks[i] != 0) {
+            fsi_fsck_count(part,inode->blocks[i],0);
+         }
+      }
+      for (int l = 1; l <= 2; l++) {
+         unsigned blk = inode->reserved[l == 1 ? INODE_IND : INODE_DIND];
+         if (blk != 0) {
+            fsi_fsck_count(part,blk,l);
+         }
+      }
+      if (INODE_TAIL(inode)) {
+         fsi_fsck_count(part,inode->tail,0);
+      }
+      return;
+   }
 
-	BMAP_CLR(fs->inode_bmap, entryid);
+   if (inode->type != FS_DIR) {
+      return;
+   }
+   fs_t* fs = part->ctx->fs;
+   int left = inode->size / sizeof(fs_dentry_t);
+   for (int i = 0; i < INODE_NUM_BLKS; i++) {
+      fsi_fsck_pages(part,ino,inode->blocks[i],0,&left);
+   }
+   fsi_fsck_pages(part,ino,inode->reserved[INODE_IND],1,&left);
+   fsi_fsck_pages(part,ino,inode->reserved[INODE_DIND],2,&left);
+   inodeid_t idx = inode->reserved[INODE_DIDX];
+   if (idx != 0 && idx < fs->sb.num_inodes) {
+      part->link[idx] = ino;
+   }
 }
 
 
+static void* fsi_fsck_thread(void* arg)
+{
+   fs_fsck_part_t* part = (fs_fsck_part_t*) arg;
+   fs_fsck_ctx_t* ctx = part->ctx;
+   fs_t* fs = ctx->fs;
+
+   // the live inodes: all in use in the first pass, the linked ones
+   // (whether marked in use or not) in the second
+   unsigned num = fs->sb.num_inodes;
+   for (unsigned ino = num * part->index / FSCK_THREADS;
+      ino < num * (part->index + 1) / FSCK_THREADS; ino++) {
+      if (ino == 0 || (ctx->pass == 1 && !fsi_inode_used(fs,ino)) ||
+         (ctx->pass == 2 && ctx->state[ino] != FSCK_LINKED)) {
+         continue;
+      }
+      fsi_fsck_inode(part,ino,fsi_inode(fs,ino));
+   }
+   if (ctx->pass == 1) {
+      return NULL;
+   }
 
-void fs_remove_dir(fs_t* fs, inodeid_t dir) {
+   // the inodes kept by the snapshots
+   for (int s = 0; s < FS_MAX_SNAPSHOTS; s++) {
+      if (fs->snaps[s].rec.name[0] == '\0') {
+         continue;
+      }
+      num = fs->snaps[s].rec.num_inodes;
+      for (unsigned ino = num * part->index / FSCK_THREADS;
+         ino < num * (part->index + 1) / FSCK_THREADS; ino++) {
+         inodeid_t id = FS_SNAP_CHILD(FS_SNAP_ROOT(s),ino);
+         if (ino > 0 && fsi_inode_used(fs,id) &&
+            fsi_snap_kept(fsi_inode(fs,id))) {
+            fsi_fsck_inode(part,id,fsi_inode(fs,id));
+         }
+      }
+   }
+   return NULL;
+}
 
-	fs_inode_t idir = fs->inode_tab[dir];
-	int num = idir.size / sizeof(fs_dentry_t); // numero de entradas num directorio
-	fs_dentry_t page[DIR_PAGE_ENTRIES];
 
-	for(int i = 0; i < INODE_NUM_BLKS && idir.blocks[i] != 0; i++){
-		int num_dir_pg_entries;
-		while(num > 0){
-			block_read(fs->blocks, idir.blocks[i], (char*)page);
-			for(num_dir_pg_entries = 0; num_dir_pg_entries < DIR_PAGE_ENTRIES && num > 0; i++, num --){
-				inodeid_t entryid = page[num_dir_pg_entries].inodeid;
-				if (fs->inode_tab[entryid].type == FS_FILE)
-					fs_remove_file(fs, entryid);
-				else fs_remove_dir(fs, entryid);
-			}
-		}
-	}
+// runs a pass with all the threads
+static void fsi_fsck_pass(fs_fsck_ctx_t* ctx, fs_fsck_part_t* parts,
+   int pass)
+{
+   sthread_t threads[FSCK_THREADS];
+   ctx->pass = pass;
+   for (int t = 0; t < FSCK_THREADS; t++) {
+      threads[t] = sthread_create(fsi_fsck_thread,&parts[t]);
+   }
+   for (int t = 0; t < FSCK_THREADS; t++) {
+      sthread_join(threads[t],NULL);
+   }
+}
 
-	BMAP_CLR(fs->inode_bmap, dir);
 
-}
+// finds if an inode is linked to the tree, following the directories
+// linking it up to one whose state is known
+static void fsi_fsck_reach(fs_t* fs, inodeid_t* link, char* state,
+   inodeid_t ino)
+{
+   inodeid_t p = ino;
+   while (state[p] == 0) {
+      state[p] = FSCK_WALKING;
+      inodeid_t dir = link[p];
+      if (dir == 0 || !fsi_inode_used(fs,dir) ||
+         fsi_inode(fs,dir)->type != FS_DIR) {
+         break;
+      }
+      p = dir;
+   }
 
+   // a cycle, or no directory, leaves the walk orphan
+   char found = (state[p] == FSCK_LINKED) ? FSCK_LINKED : FSCK_ORPHAN;
+   for (p = ino; state[p] == FSCK_WALKING; p = link[p]) {
+      state[p] = found;
+   }
+}
 
-	
 
-int fs_remove(fs_t* fs, inodeid_t dir, char *name)
+/*
+ * fsi_fsck: checks the file system, which is frozen; the blocks of the
+ * inodes not linked to the tree are not counted, so that the repair
+ * frees them along with the inodes
+ *   returns: the number of mismatches found
+ */
+static int fsi_fsck(fs_t* fs, int repair, fs_fsck_t* report)
 {
-	//checks if the arguments are valid
-	if (fs == NULL || dir>=ITAB_SIZE || name == NULL) {
-		dprintf("[fs_remove] malformed arguments. \n");
-		return -1;
-	}
+   unsigned ninodes = fs->sb.num_inodes;
+   unsigned nblocks = fs->sb.num_blocks;
+   memset(report,0,sizeof(fs_fsck_t));
 
-	if (strlen(name) == 0 || strlen(name)+1 > FS_MAX_FNAME_SZ) {
-		dprintf("[fs_remove] file name size error\n");
-		return -1;
-	}
+   // load the inode tables, which the threads then only read
+   for (unsigned ino = 0; ino < ninodes; ino += ITAB_BLK_INODES) {
+      fsi_inode(fs,ino);
+   }
+   for (int s = 0; s < FS_MAX_SNAPSHOTS; s++) {
+      if (fs->snaps[s].rec.name[0] == '\0') {
+         continue;
+      }
+      for (unsigned ino = 0; ino < fs->snaps[s].rec.num_inodes;
+         ino += ITAB_BLK_INODES) {
+         fsi_inode(fs,FS_SNAP_CHILD(FS_SNAP_ROOT(s),ino));
+      }
+   }
 
-	if (!BMAP_ISSET(fs->inode_bmap, dir)) {
-		dprintf("[fs_remove] inode is not being used.\n");
-		return -1;
-	}
-	
-	inodeid_t entryid = 0;
-	if (!fsi_dir_search(fs, dir, name, &entryid) == 0) {
-		dprintf("[fs_remove] file/dir does not exist\n");
-		return -1;
-	}
-	
-	fs_inode_t* idir = &fs->inode_tab[dir];
-	if (idir->type != FS_DIR) {
-		dprintf("[fs_remove] inode is not a directory. \n");
-		return -1;
-	}
+   fs_fsck_ctx_t ctx;
+   fs_fsck_part_t parts[FSCK_THREADS];
+   ctx.fs = fs;
+   ctx.state = (char*) calloc(ninodes,1);
+   ctx.walked = (char*) calloc((nblocks + 7) / 8,1);
+   ctx.lock = sthread_mutex_init();
+   for (int t = 0; t < FSCK_THREADS; t++) {
+      memset(&parts[t],0,sizeof(parts[t]));
+      parts[t].ctx = &ctx;
+      parts[t].index = t;
+      parts[t].link = (inodeid_t*) calloc(ninodes,sizeof(inodeid_t));
+      parts[t].names = (unsigned*) calloc(ninodes,sizeof(unsigned));
+      parts[t].refs = (unsigned*) calloc(nblocks,sizeof(unsigned));
+   }
 
-	fs_dentry_t page[DIR_PAGE_ENTRIES];	
-	int num_dir_entry = 0, block_num = 0;
-	
-	search_dir_entry(fs, dir, entryid, &num_dir_entry, &block_num, (char*)page);
-		
-	fs_dentry_t last_page[DIR_PAGE_ENTRIES]; // array de entradas do ultimo bloco
-	int last_entry_index = (idir->size % BLOCK_SIZE / sizeof(fs_dentry_t)) -1;
-	block_read(fs->blocks,idir->blocks[idir->size/BLOCK_SIZE],(char *)last_page);
-	fs_dentry_t* last_entry	= &last_page[last_entry_index]; // ponteiro p/ última posição ocupada do dir
-	
-	page[num_dir_entry] = *last_entry; // mete a ultima entrada na posição da que vai ser removida
-	block_write(fs->blocks, idir->blocks[block_num], (char*)page); // escreve o bloco (page) no disco
-	idir->size -= sizeof(fs_dentry_t); // diminui o tamanho do directório em uma entrada
+   // first pass: the directory linking each inode
+   fsi_fsck_pass(&ctx,parts,1);
+   inodeid_t* link = parts[0].link;
+   unsigned* names = parts[0].names;
+   for (int t = 1; t < FSCK_THREADS; t++) {
+      for (unsigned ino = 0; ino < ninodes; ino++) {
+         if (parts[t].link[ino] != 0 && (link[ino] == 0 ||
+            fsi_inode(fs,ino)->parent == parts[t].link[ino])) {
+            link[ino] = parts[t].link[ino];
+         }
+         names[ino] += parts[t].names[ino];
+      }
+   }
+   ctx.state[0] = FSCK_LINKED;
+   ctx.state[1] = FSCK_LINKED;
+   if (fs->sb.snaps != 0) {
+      ctx.state[fs->sb.snaps] = FSCK_LINKED;
+   }
+   for (unsigned ino = 2; ino < ninodes; ino++) {
+      if (fsi_inode_used(fs,ino) || link[ino] != 0) {
+         fsi_fsck_reach(fs,link,ctx.state,ino);
+      }
+   }
 
-	int i, j;
+   // the parents and the link counts recorded in the inodes; a file may
+   // have no parent, if the name its blocks counted for is gone
+   for (unsigned ino = 2; ino < ninodes; ino++) {
+      fs_inode_t* inode = fsi_inode(fs,ino);
+      if (ctx.state[ino] != FSCK_LINKED || ino == fs->sb.snaps) {
+         continue;
+      }
+      if (inode->parent != link[ino] &&
+         !(inode->type == FS_FILE && inode->parent == 0)) {
+         report->bad_parents++;
+         if (repair) {
+            inode->parent = link[ino];
+            fsi_inode_dirty(fs,ino);
+         }
+      }
+      if (inode->type == FS_FILE && inode->links + 1 != names[ino]) {
+         report->bad_links++;
+         if (repair) {
+            inode->links = names[ino] - 1;
+            fsi_inode_dirty(fs,ino);
+         }
+      }
+   }
 
-	if (last_entry_index == 0) { //se for a primeira entrada do bloco, elimina esse bloco
-		for(i = 0, j = 1; idir->blocks[j] != 0; i++, j++);
-		BMAP_CLR(fs->blk_bmap, idir->blocks[i]); 
-		idir->blocks[i] = 0;
-	}
+   // second pass: the references to each block, the metadata inodes
+   // being counted once the threads are done
+   fsi_fsck_pass(&ctx,parts,2);
+   ctx.pass = 2;
+   fsi_fsck_inode(&parts[0],0,&fs->sb.itab);
+   fsi_fsck_inode(&parts[0],0,&fs->sb.ibmap);
+   fsi_fsck_inode(&parts[0],0,&fs->sb.refs);
+   if (fs->sb.frag_blk != 0) {
+      fsi_fsck_count(&parts[0],fs->sb.frag_blk,0);
+   }
+   for (int s = 0; s < FS_MAX_SNAPSHOTS; s++) {
+      if (fs->snaps[s].rec.name[0] != '\0') {
+         fsi_fsck_inode(&parts[0],0,&fs->snaps[s].rec.itab);
+         fsi_fsck_inode(&parts[0],0,&fs->snaps[s].rec.ibmap);
+      }
+   }
+   unsigned* refs = parts[0].refs;
+   for (int t = 0; t < FSCK_THREADS; t++) {
+      for (unsigned b = 0; t > 0 && b < nblocks; b++) {
+         refs[b] += parts[t].refs[b];
+      }
+      report->bad_refs += parts[t].bad_refs;
+      report->bad_entries += parts[t].bad_entries;
+   }
 
-	fs_inode_t ientry = fs->inode_tab[entryid]; // vai buscar o inode do ficheiro/directorio à tabela de inodes
-	
-	if(ientry.type == FS_FILE)
-		fs_remove_file(fs, entryid);
-	else 
-		fs_remove_dir(fs, entryid);
-	
-	BMAP_CLR(fs->inode_bmap, entryid);
+   // the inode bitmap
+   for (unsigned ino = 0; ino < ninodes; ino++) {
+      int used = (ctx.state[ino] == FSCK_LINKED);
+      report->inodes += used;
+      if (used == (BMAP_ISSET(fs->inode_bmap,ino) != 0)) {
+         continue;
+      }
+      if (used) {
+         report->lost_inodes++;
+      } else {
+         report->orphan_inodes++;
+      }
+      if (repair) {
+         if (used) {
+            BMAP_SET(fs->inode_bmap,ino);
+         } else {
+            BMAP_CLR(fs->inode_bmap,ino);
+         }
+         fs->inode_bmap_dirty[ino / BMAP_BLK_BITS] = 1;
+      }
+   }
 
-	return 0;
-}
+   // the block bitmap and the reference counts
+   int refs_missing = 0;
+   for (unsigned b = 0; b < nblocks; b++) {
+      int used = (b < fs->sb.bmap_start + fs->sb.bmap_blks || refs[b] > 0);
+      unsigned shared = (refs[b] > 1) ? MIN(refs[b] - 1, REFS_MAX) : 0;
+      report->blocks += used;
+      if (used != (BMAP_ISSET(fs->blk_bmap,b) != 0)) {
+         if (used) {
+            report->lost_blocks++;
+         } else {
+            report->leaked_blocks++;
+         }
+         if (repair) {
+            if (used) {
+               BMAP_SET(fs->blk_bmap,b);
+            } else {
+               BMAP_CLR(fs->blk_bmap,b);
+            }
+            fs->blk_bmap_dirty[b / BMAP_BLK_BITS] = 1;
+         }
+      }
+      if (shared != (fs->blk_refs != NULL ? fs->blk_refs[b] : 0)) {
+         report->bad_refcounts++;
+         if (repair && fs->blk_refs != NULL) {
+            fs->blk_refs[b] = shared;
+            fs->blk_refs_dirty[b / REFS_BLK_ENTRIES] = 1;
+         }
+         refs_missing |= (fs->blk_refs == NULL);
+      }
+   }
 
-void fs_copy_file(fs_t *fs, inodeid_t dir2, inodeid_t file1id, char* file2) {
-	
-	inodeid_t file2id;
-	fs_inode_t ifile1 = fs->inode_tab[file1id];
+   // the free counters
+   if (fs->sb.free_inodes != ninodes - report->inodes) {
+      report->bad_counters++;
+   }
+   if (fs->sb.free_blocks != nblocks - report->blocks) {
+      report->bad_counters++;
+   }
+   if (repair) {
+      fs->sb.free_inodes = ninodes - report->inodes;
+      fs->sb.free_blocks = nblocks - report->blocks;
+      fs->sb_dirty = 1;
+      fs->inode_hint = 0;
+      fsi_ftree_build(fs);
+
+      // a missing table of reference counts is created now that the
+      // block bitmap is right
+      if (refs_missing && fsi_refs_init(fs) == 0) {
+         for (unsigned b = 0; b < nblocks; b++) {
+            fs->blk_refs[b] = (refs[b] > 1) ? MIN(refs[b] - 1, REFS_MAX) : 0;
+         }
+      }
+      fsi_store_fsdata(fs);
+   }
 
-	fs_create(fs, dir2, file2, &file2id);
-	
-	fs_inode_t ifile2 = fs->inode_tab[file2id];
-
-	for (int i = 0; i < INODE_NUM_BLKS && ifile1.blocks[i] != 0; i++) {
-		char new_block[BLOCK_SIZE];
-		unsigned blockid = 0;
-		block_read(fs->blocks,ifile1.blocks[i], new_block);
-		fsi_bmap_find_free(fs->blk_bmap, BLOCK_SIZE, &blockid);
-		block_write(fs->blocks, blockid, new_block);
-		ifile2.blocks[i] = blockid;
-		//ifile2.blocks[i]=ifile1.blocks[i];
-	}
-}
-
-void fs_copy_dir(fs_t *fs, inodeid_t dir1id, inodeid_t dir2id, char* dirname)
-{
-	fs_inode_t idir1 = fs->inode_tab[dir1id];
-	inodeid_t idir2;
-	int dirsize = idir1.size / sizeof(fs_dentry_t); //numero de entradas do directório a ser copiado
-	fs_dentry_t page[DIR_PAGE_ENTRIES];
-
-	fs_mkdir(fs, dir2id, dirname, &idir2);
-
-	for (int i = 0; i < INODE_NUM_BLKS && idir1.blocks[i] != 0; i++) {
-		int num_dir_pg_entries;
-		while (dirsize > 0) { // enquanto houver entradas no directório
-			block_read(fs->blocks, idir1.blocks[i], (char*) page);
-			for(num_dir_pg_entries = 0; num_dir_pg_entries < DIR_PAGE_ENTRIES && dirsize > 0; i++, dirsize--) {
-				inodeid_t entryid = page[num_dir_pg_entries].inodeid;
-				if (fs->inode_tab[entryid].type == FS_FILE)
-					fs_copy_file(fs, dir2id, entryid, page[num_dir_pg_entries].name);
-				if (fs->inode_tab[entryid].type == FS_DIR)
-					fs_copy_dir(fs, entryid, idir2, page[num_dir_pg_entries].name);
-			}
-		}
-	}
+   for (int t = 0; t < FSCK_THREADS; t++) {
+      free(parts[t].link);
+      free(parts[t].names);
+      free(parts[t].refs);
+   }
+   free(ctx.state);
+   free(ctx.walked);
+   sthread_mutex_free(ctx.lock);
+
+   return report->bad_refs + report->bad_entries + report->bad_parents +
+      report->bad_links + report->orphan_inodes + report->lost_inodes +
+      report->leaked_blocks + report->lost_blocks + report->bad_refcounts +
+      report->bad_counters;
 }
 
-int fs_copy(fs_t *fs, inodeid_t dir1, inodeid_t dir2, char* file1, char* file2)
-{
-	if (fs == NULL || dir1>=ITAB_SIZE || dir2>=ITAB_SIZE || file1 == NULL || file2 == NULL) {
-		dprintf("[fs_copy] malformed arguments\n");
-		return -1;
-	}
-
-	if (strlen(file1) == 0 || strlen(file1)+1 > FS_MAX_FNAME_SZ) {
-		dprintf("[fs_copy] source file name size error\n");
-		return -1;
-	}
-	
-	if (strlen(file2) == 0 || strlen(file2)+1 > FS_MAX_FNAME_SZ) {
-		dprintf("[fs_copy] source file name size error\n");
-		return -1;
-	}
 
-	if (!BMAP_ISSET(fs->inode_bmap, dir1)) {
-		dprintf("[fs_copy] inode (dir1) is not being used");
-		return -1;
-	}
+int fs_fsck(fs_t* fs, int repair, fs_fsck_t* report)
+{
+   if (fs == NULL || report == NULL) {
+      dprintf("[fs_fsck] malformed arguments.\n");
+      return -1;
+   }
 
-	if (!BMAP_ISSET(fs->inode_bmap, dir2)) {
-		dprintf("[fs_copy] inode (dir2) is not being used");
-		return -1;
-	}
+   // freeze the file system, with the delayed writes allocated
+   fsi_lock_set(fs,0,~(fs_lockset_t)0);
+   fsi_meta_lock(fs);
+   for (int i = 0; i < DELAY_FILES; i++) {
+      if (fs->delay[i].ino != 0) {
+         fsi_delay_flush(fs,&fs->delay[i],1);
+      }
+   }
+   fsi_ibmap_load(fs);
+   sthread_mutex_lock(fs->alloc_lock);
+   fsi_bmap_load(fs);
+   sthread_mutex_unlock(fs->alloc_lock);
+   int status = fsi_fsck(fs,repair,report);
+   fsi_meta_unlock(fs);
+   fsi_unlock_set(fs,0,~(fs_lockset_t)0);
+   return status;
+}
 
-	inodeid_t fileid=0;
-	if (!fsi_dir_search(fs, dir1, file1, &fileid)==0) {
-		dprintf("[fs_copy] file does not exist\n");
-		return -1;
-	}
-	
-	fs_inode_t* idir1 = &fs->inode_tab[dir1];
-	if (idir1->type != FS_DIR) {
-		dprintf("[fs_copy] inode (dir1) is not a directory");
-		return -1;
-	}
 
-	fs_inode_t* idir2 = &fs->inode_tab[dir2];
-	if (idir2->type != FS_DIR) {
-		dprintf("[fs_copy] inode (dir2) is not a directory");
-		return -1;
-	}
+int fs_fsck_image(char* file, int repair, fs_fsck_t* report)
+{
+   if (file == NULL || report == NULL) {
+      dprintf("[fs_fsck] malformed arguments.\n");
+      return -1;
+   }
 
-//	fs_dentry_t page[DIR_PAGE_ENTRIES];
-//	int num_dir_entry = 0, block_num = 0;
+   blocks_t* bks = block_load(file);
+   if (bks == NULL) {
+      dprintf("[fs_fsck] unable to load the image '%s'.\n",file);
+      return -1;
+   }
+   fs_t* fs = (fs_t*) calloc(1,sizeof(fs_t));
+   fs->blocks = bks;
+   fsi_locks_init(fs);
+
+   int status = -1;
+   if (fsi_load_fsdata(fs) < 0) {
+      dprintf("[fs_fsck] the image holds no file system.\n");
+   } else {
+      status = fs_fsck(fs,repair,report);
+      if (repair && status > 0 && block_store(bks,file) < 0) {
+         dprintf("[fs_fsck] unable to store the image '%s'.\n",file);
+         status = -1;
+      }
+   }
 
-	fs_copy_file(fs, dir2,fileid, file2);		
-	
-	return 0;
+   fsi_free_fsdata(fs);
+   fsi_locks_free(fs);
+   block_free(bks);
+   free(fs);
+   return status;
 }
 
+
 void fs_dump(fs_t* fs)
 {
+   fsi_meta_lock(fs);
+   fsi_ibmap_load(fs);
+   sthread_mutex_lock(fs->alloc_lock);
+   fsi_bmap_load(fs);
+   printf("Superblock:\n");
+   printf("- Block size: %u\n", fs->sb.block_size);
+   printf("- Num blocks: %u (%u free)\n", fs->sb.num_blocks, fs->sb.free_blocks);
+   printf("- Free extents: %u (longest %u blocks)\n", fs->free_extents,
+      fs->free_tree[1].run);
+   printf("- Num inodes: %u (%u free)\n", fs->sb.num_inodes, fs->sb.free_inodes);
+
    printf("Free block bitmap:\n");
-   fsi_dump_bmap(fs->blk_bmap,BLOCK_SIZE);
+   fsi_dump_bmap(fs->blk_bmap,fs->sb.bmap_blks*BLOCK_SIZE);
    printf("\n");
    
    printf("Free inode table bitmap:\n");
-   fsi_dump_bmap(fs->inode_bmap,BLOCK_SIZE);
+   fsi_dump_bmap(fs->inode_bmap,fs->sb.ibmap.size);
    printf("\n");
+   sthread_mutex_unlock(fs->alloc_lock);
+   fsi_meta_unlock(fs);
 }
-
- 
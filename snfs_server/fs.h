@@ -23,12 +23,22 @@
 // maximum size of a file name used in messages
 #define MAX_PATH_NAME_SIZE 200
 
+// directory of the root where the snapshots appear, by name
+#define FS_SNAP_DIR ".snapshot"
+
+// block sizes (powers of two) a file system can be formatted with
+#define FS_MIN_BLOCK_SIZE 512
+#define FS_MAX_BLOCK_SIZE (64*1024)
+
+// default block size
+#define FS_BLOCK_SIZE 512
+
 // type of the inode: directory or file
 typedef enum {FS_DIR = 1, FS_FILE = 2} fs_itype_t;
 
 
 // type of inode identifier
-typedef unsigned short inodeid_t;
+typedef unsigned int inodeid_t;
 
 
 // attributes of a file
@@ -47,24 +57,44 @@ typedef struct {
 } fs_file_name_t;
 
 
-// file system structure (the implementation is hidden)
+// file system structure (the implementation is hidden); the functions
+// below can be called by several threads at the same time, except fs_new,
+// fs_mount and fs_format, which must run before any other
 typedef struct fs_ fs_t;
 
 
 /*
- * fs_new: allocates storage - blocks - and memory for the fs structure
- * - num_blocks - number of blocks
- *   returns: the fs structure
+ * fs_new: allocates storage - blocks - and memory for the fs structure;
+ * the storage must be formatted before use
+ * - image - file where the storage is kept, created or emptied, or NULL
+ *   to keep it in memory
+ * - num_blocks - size of the storage, in blocks of FS_MIN_BLOCK_SIZE
+ *   returns: the fs structure, NULL if error
+ */
+fs_t* fs_new(char* image, unsigned num_blocks, int disk_delay);
+
+
+/*
+ * fs_mount: opens the file system kept in an image file (see fs_new),
+ * without formatting it; only the superblock, which is checked, the block
+ * reference counts and the records of the snapshots are read, the
+ * bitmaps and the inode table being loaded on first use
+ * - image - the image file
+ *   returns: the fs structure, NULL if the image holds no file system
  */
-fs_t* fs_new(unsigned num_blocks, int disk_delay);
+fs_t* fs_mount(char* image, int disk_delay);
 
 
 /*
- * fs_format: formats the file system
+ * fs_format: formats the file system; the storage keeps its size, in
+ * blocks of the size chosen, and only the metadata is written, the data
+ * blocks being left as they are until allocated
  * - fs: reference to file system
+ * - block_sz: the block size, a power of two from FS_MIN_BLOCK_SIZE to
+ *   FS_MAX_BLOCK_SIZE
  *   returns: 0 if successful, -1 otherwise
  */
-int fs_format(fs_t* fs);
+int fs_format(fs_t* fs, unsigned block_sz);
 
 
 /*
@@ -102,7 +132,9 @@ int fs_read(fs_t* fs, inodeid_t file, unsigned offset, unsigned count,
 
 
 /*
- * fs_write: write data to file
+ * fs_write: write data to file; data written past the last block of the
+ * file may be kept in memory, and only get disk blocks (all in one run)
+ * when it is flushed
  * - fs: reference to file system
  * - file: node id of the file
  * - offset: starting position for writing
@@ -114,6 +146,45 @@ int fs_write(fs_t* fs, inodeid_t file, unsigned offset, unsigned count,
    char* buffer);
 
 
+/*
+ * fs_fallocate: allocates the blocks of a range of a file ahead of the
+ * writes that fill it, in one contiguous run when possible
+ * - fs: reference to file system
+ * - file: node id of the file
+ * - offset: start of the range
+ * - len: length of the range
+ * - keep_size: if 0 the file grows to cover the range, reading as zeros
+ *   past its previous end, otherwise its size is left as it is
+ *   returns: 0 if successful, -1 otherwise (some of the blocks may have
+ *   been allocated)
+ */
+int fs_fallocate(fs_t* fs, inodeid_t file, unsigned offset, unsigned len,
+   int keep_size);
+
+
+/*
+ * fs_truncate: sets the size of a file, freeing its blocks past the new
+ * end; a file that grows reads as zeros past its previous end
+ * - fs: reference to file system
+ * - file: node id of the file
+ * - size: the new size of the file
+ *   returns: 0 if successful, -1 otherwise
+ */
+int fs_truncate(fs_t* fs, inodeid_t file, unsigned size);
+
+
+/*
+ * fs_punch_hole: frees the blocks of a range of a file, which then reads
+ * as zeros; the size of the file is left as it is
+ * - fs: reference to file system
+ * - file: node id of the file
+ * - offset: start of the range
+ * - len: length of the range
+ *   returns: 0 if successful, -1 otherwise
+ */
+int fs_punch_hole(fs_t* fs, inodeid_t file, unsigned offset, unsigned len);
+
+
 /*
  * fs_create: create a file in a specified directory
  * - fs: reference to file system
@@ -125,6 +196,20 @@ int fs_write(fs_t* fs, inodeid_t file, unsigned offset, unsigned count,
 int fs_create(fs_t* fs, inodeid_t dir, char* file, inodeid_t* fileid);
 
 
+/*
+ * fs_create_many: create several files in a directory at once, faster
+ * than creating them one by one; either all or none are created
+ * - fs: reference to file system
+ * - dir: the directory where to create the files
+ * - names: the names of the files, neither repeated nor existing
+ * - count: the number of files
+ * - fileids: the inode ids of the files, in the order of the names [out]
+ *   returns: 0 if successful, -1 otherwise
+ */
+int fs_create_many(fs_t* fs, inodeid_t dir, char** names, int count,
+   inodeid_t* fileids);
+
+
 /*
  * fs_mkdir: create a subdirectory in a specified directory
  * - fs: reference to file system
@@ -137,19 +222,239 @@ int fs_mkdir(fs_t* fs, inodeid_t dir, char* newdir, inodeid_t* newdirid);
 
 
 /*
- * fs_readdir: read the contents of a directory
+ * fs_readdir: read the contents of a directory, in name order, starting
+ * after a given name so that a large directory is read in parts
  * - fs: reference to file system
  * - dir: the directory
+ * - cookie: the last name read (NULL or "" -> from the first entry)
  * - entries: where to write the entries of the directory [out]
  * - maxentries: maximum number of entries to write in 'entries'
- * - numentries: number of entries written [out]
+ * - numentries: number of entries written, fewer than 'maxentries' at
+ *   the end of the directory [out]
  *   returns: 0 if successful, -1 otherwise
  */
-int fs_readdir(fs_t* fs, inodeid_t dir, fs_file_name_t* entries, int maxentries,
+int fs_readdir(fs_t* fs, inodeid_t dir, char* cookie,
+   fs_file_name_t* entries, int maxentries,
    int* numentries);
 
 int fs_remove(fs_t* fs, inodeid_t dir, char* name);
 
+
+/*
+ * fs_rename: move a file or a directory to another name, in the same or
+ * in another directory, without touching its data; an entry of the new
+ * name is replaced if it is of the same type (and an empty directory)
+ * - fs: reference to file system
+ * - dir1: the directory of the entry
+ * - dir2: the directory where the entry goes
+ * - name1: the name of the entry
+ * - name2: the new name of the entry
+ * - fileid: the inode of the entry [out]
+ *   returns: 0 if successful, -1 otherwise (nothing is changed)
+ */
+int fs_rename(fs_t* fs, inodeid_t dir1, inodeid_t dir2, char* name1,
+   char* name2, inodeid_t* fileid);
+
+
+/*
+ * fs_link: give a file another name, in the same or in another
+ * directory, sharing its data; the file is removed with its last name,
+ * and its blocks count for the disk usage of one of its directories only
+ * - fs: reference to file system
+ * - dir1: the directory of the file
+ * - dir2: the directory of the new name
+ * - name1: the name of the file
+ * - name2: the new name
+ * - fileid: the inode of the file [out]
+ *   returns: 0 if successful, -1 otherwise
+ */
+int fs_link(fs_t* fs, inodeid_t dir1, inodeid_t dir2, char* name1,
+   char* name2, inodeid_t* fileid);
+
+
+/*
+ * fs_copy: copy a file, or a directory with everything below it; the
+ * copied files share the blocks of the originals until one of them is
+ * written (copy-on-write)
+ * - fs: reference to file system
+ * - dir1: the directory of the original
+ * - dir2: the directory where to create the copy
+ * - file1: the name of the original
+ * - file2: the name of the copy
+ *   returns: 0 if successful, -1 otherwise
+ */
+int fs_copy(fs_t* fs, inodeid_t dir1, inodeid_t dir2, char* file1,
+   char* file2);
+
+
+/*
+ * fs_append: append the data of a file to the end of another file; when
+ * the size of file1 is a multiple of the block size the blocks of file2
+ * are shared, otherwise its data is copied
+ * - fs: reference to file system
+ * - dir1: the directory of the file that grows
+ * - dir2: the directory of the file appended
+ * - file1: the name of the file that grows
+ * - file2: the name of the file appended
+ * - fsize: the new size of file1 [out]
+ *   returns: 0 if successful, -1 otherwise
+ */
+int fs_append(fs_t* fs, inodeid_t dir1, inodeid_t dir2, char* file1,
+   char* file2, unsigned* fsize);
+
+
+// disk usage of an entry of a directory
+typedef struct {
+   char name[FS_MAX_FNAME_SZ];
+   inodeid_t inodeid;
+   fs_itype_t type;
+   unsigned blocks;      // blocks used (by the whole subtree, if a directory)
+} fs_usage_entry_t;
+
+
+// disk usage of a directory and of the file system
+typedef struct {
+   unsigned num_blocks;   // blocks of the file system
+   unsigned free_blocks;  // free blocks of the file system (not reserved
+                          // for data kept in memory)
+   unsigned free_extents; // runs of free blocks of the file system
+   unsigned largest_free; // blocks of the longest run of free blocks
+   unsigned dir_blocks;   // blocks used by the directory itself
+   unsigned tree_blocks;  // blocks used by the directory and its subtree
+   unsigned num_entries;  // number of entries of the directory
+} fs_usage_t;
+
+
+/*
+ * fs_diskusage: gets the blocks used by the entries of a directory; the
+ * usage is kept up to date by every operation, so no file is scanned
+ * (the fragment blocks holding the tails of small files are counted in
+ * the free blocks of the file system only)
+ * - fs: reference to file system
+ * - dir: the directory
+ * - first: position of the first entry to report
+ * - entries: the usage of the entries [out]
+ * - maxentries: maximum number of entries to write in 'entries'
+ * - numentries: number of entries written [out]
+ * - usage: the totals of the directory and of the file system [out]
+ *   returns: 0 if successful, -1 otherwise
+ */
+int fs_diskusage(fs_t* fs, inodeid_t dir, unsigned first,
+   fs_usage_entry_t* entries, int maxentries, int* numentries,
+   fs_usage_t* usage);
+
+
+// state of an ongoing defragmentation
+typedef struct {
+   inodeid_t ino;          // inode being defragmented
+   int moving;             // set if the blocks of 'ino' are being moved
+   unsigned iblock;        // next block of 'ino' to move
+   unsigned target;        // where to move that block
+   unsigned moved;         // number of blocks moved so far
+   unsigned blocks_before; // blocks of the files visited following another
+   unsigned breaks_before; // those not following the previous block
+   unsigned blocks_after;  // the same, after the moves
+   unsigned breaks_after;
+   unsigned frag_before;   // fragmentation (%) before the moves
+   unsigned frag_after;    // fragmentation (%) after the moves
+} fs_defrag_t;
+
+
+/*
+ * fs_defrag_begin: starts the defragmentation of the file system
+ * - fs: reference to file system
+ * - df: the defragmentation state [out]
+ */
+void fs_defrag_begin(fs_t* fs, fs_defrag_t* df);
+
+
+/*
+ * fs_defrag_step: moves data blocks so that files get contiguous and
+ * packed at the beginning of the disk, and shrinks the index of
+ * directories that lost most of their entries; the file system is left
+ * consistent after each step
+ * - fs: reference to file system
+ * - df: the defragmentation state
+ * - maxmoves: maximum number of blocks moved in this step, which also
+ *   visits at most a fixed number of inodes
+ *   returns: 1 if there is more work to do, 0 if the defragmentation is
+ *   complete (df->frag_before and df->frag_after are set), -1 otherwise
+ */
+int fs_defrag_step(fs_t* fs, fs_defrag_t* df, unsigned maxmoves);
+
+/*
+ * fs_snapshot_create: takes a read-only snapshot of the whole file
+ * system; the snapshot shares all blocks with the file system, which
+ * copies them as it writes them (copy-on-write); the snapshot is also
+ * reached by looking up "/.snapshot/<name>"
+ * - fs: reference to file system
+ * - name: the name of the snapshot
+ * - root: the inode id of the root directory of the snapshot [out]
+ *   returns: 0 if successful, -1 otherwise
+ */
+int fs_snapshot_create(fs_t* fs, char* name, inodeid_t* root);
+
+
+/*
+ * fs_snapshot_delete: deletes a snapshot, freeing the blocks that no
+ * longer belong to the file system or to other snapshots
+ * - fs: reference to file system
+ * - name: the name of the snapshot
+ *   returns: 0 if successful, -1 otherwise
+ */
+int fs_snapshot_delete(fs_t* fs, char* name);
+
+
+/*
+ * fs_flush: writes to the disk the data that writes kept in memory,
+ * packing the short last blocks of the files in fragment blocks; until
+ * then, the disk holds the files at their size before those writes
+ * - fs: reference to file system
+ *   returns: 0 if successful, -1 otherwise (some data could not be
+ *   written for lack of free blocks)
+ */
+int fs_flush(fs_t* fs);
+
+
+// what a consistency check found
+typedef struct {
+   unsigned inodes;         // inodes in use
+   unsigned blocks;         // blocks in use
+   unsigned bad_refs;       // references to blocks out of the data area
+   unsigned bad_entries;    // directory entries of inodes out of the table
+   unsigned bad_parents;    // inodes not recording the directory linking them
+   unsigned bad_links;      // files whose link count is not their names
+   unsigned orphan_inodes;  // inodes marked in use, not linked to the tree
+   unsigned lost_inodes;    // inodes linked to the tree, marked free
+   unsigned leaked_blocks;  // blocks marked in use, not referenced
+   unsigned lost_blocks;    // blocks referenced, marked free
+   unsigned bad_refcounts;  // blocks whose reference count is wrong
+   unsigned bad_counters;   // free block or inode counters that are wrong
+} fs_fsck_t;
+
+
+/*
+ * fs_fsck: checks the consistency of the file system, rebuilding the
+ * block and inode bitmaps, the block reference counts and the free
+ * counters from the inode table and the directory tree, walked by
+ * several threads; the file system is frozen meanwhile
+ * - fs: reference to file system
+ * - repair: if set, the mismatches are fixed, orphan inodes being freed
+ *   with their blocks (bad references and entries are only reported)
+ * - report: what was found [out]
+ *   returns: the number of mismatches found, -1 if error
+ */
+int fs_fsck(fs_t* fs, int repair, fs_fsck_t* report);
+
+
+/*
+ * fs_fsck_image: fs_fsck on an image of the storage kept in a file (see
+ * block_store), which is stored back if repaired
+ *   returns: the number of mismatches found, -1 if error
+ */
+int fs_fsck_image(char* file, int repair, fs_fsck_t* report);
+
+
 /*
  * fd_dump: dump the contents of a file system
  */
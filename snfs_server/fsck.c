@@ -0,0 +1,52 @@
+/*
+ * SNFS File System Checker
+ *
+ * fsck.c
+ *
+ * Checks the consistency of the file system in an image of the storage
+ * (see block_store), optionally repairing it.
+ *
+ * Usage: fsck [-r] <image>
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <sthread.h>
+#include "block.h"
+#include "fs.h"
+
+
+int main(int argc, char **argv)
+{
+   int repair = (argc > 2 && strcmp(argv[1],"-r") == 0);
+   if (argc != 2 + repair) {
+      printf("Usage: %s [-r] <image>\n",argv[0]);
+      return 2;
+   }
+
+   sthread_init();
+
+   fs_fsck_t report;
+   int found = fs_fsck_image(argv[1 + repair],repair,&report);
+   if (found < 0) {
+      printf("[fsck] unable to check '%s'.\n",argv[1 + repair]);
+      return 2;
+   }
+
+   printf("[fsck] %u inodes and %u blocks in use.\n",report.inodes,
+      report.blocks);
+   printf("[fsck] bad block references: %u\n",report.bad_refs);
+   printf("[fsck] bad directory entries: %u\n",report.bad_entries);
+   printf("[fsck] bad parents: %u\n",report.bad_parents);
+   printf("[fsck] bad link counts: %u\n",report.bad_links);
+   printf("[fsck] orphan inodes: %u\n",report.orphan_inodes);
+   printf("[fsck] lost inodes: %u\n",report.lost_inodes);
+   printf("[fsck] leaked blocks: %u\n",report.leaked_blocks);
+   printf("[fsck] lost blocks: %u\n",report.lost_blocks);
+   printf("[fsck] bad reference counts: %u\n",report.bad_refcounts);
+   printf("[fsck] bad free counters: %u\n",report.bad_counters);
+   printf("[fsck] %d mismatches%s.\n",found,
+      (repair && found > 0) ? " repaired" : "");
+   return found > 0;
+}
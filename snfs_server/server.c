@@ -20,6 +20,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <signal.h>
 #include <sthread.h>
 #ifdef USE_PTHREADS
 #include <pthread.h>
@@ -54,13 +55,16 @@ typedef struct _req* req_t;
  * service handlers are implemented in snfs.c
  */
 
-#define NUM_REQ_HANDLERS 13
+#define NUM_REQ_HANDLERS 20
 #define NUM_TC 5		// max number of active threads
 #define RING_SIZE 10
 
 
 static sthread_mon_t mon = NULL;
 static int available_reqs; // buffer requests not yet consumed 
+static int serving;        // requests being served
+static int stopping;       // no more requests are served
+static volatile sig_atomic_t stop_signal; // SIGINT or SIGTERM received
 req_t ring[RING_SIZE];
 int sockfd;
 
@@ -80,7 +84,14 @@ struct {
   {REQ_APPEND, snfs_append},
   {REQ_DEFRAG, snfs_defrag},
   {REQ_DISKUSAGE, snfs_diskusage},
-  {REQ_DUMPCACHE, snfs_dumpcache}
+  {REQ_DUMPCACHE, snfs_dumpcache},
+  {REQ_SNAPSHOT, snfs_snapshot},
+  {REQ_FALLOCATE, snfs_fallocate},
+  {REQ_TRUNCATE, snfs_truncate},
+  {REQ_PUNCHHOLE, snfs_punchhole},
+  {REQ_CREATE_BATCH, snfs_create_batch},
+  {REQ_RENAME, snfs_rename},
+  {REQ_LINK, snfs_link}
 };
 
 /*
@@ -105,22 +116,51 @@ void put_req(req_t req) {
 	return;
 }
 
+void srv_shutdown();
+
 int my_recvfrom(snfs_msg_req_t* req, struct sockaddr_un* cliaddr, socklen_t* clilen) {
 	int reqsz;
 	
 	*clilen = sizeof(*cliaddr);
 	
 	do {
+		if (stop_signal)
+			srv_shutdown();
 		sthread_yield();
 		errno = 0;
 		reqsz = recvfrom(sockfd, (void*)req, sizeof(*req), MSG_DONTWAIT,
 							(struct sockaddr *)cliaddr, clilen);
-	} while(errno == EAGAIN);
+	} while(errno == EAGAIN || errno == EINTR);
 	
 	return reqsz;
 }
 
 
+/*
+ * stopping the server: the signal only sets a flag, the receiver thread
+ * then waits for the requests being served and writes the data kept in
+ * memory to the storage before exiting
+ */
+
+void srv_stop_signal(int sig) {
+	stop_signal = 1;
+}
+
+void srv_shutdown() {
+	printf("[snfs_srv] shutting down.\n");
+
+	sthread_monitor_enter(mon);
+	stopping = 1;
+	while (serving > 0) sthread_monitor_wait(mon);
+	sthread_monitor_exit(mon);
+
+	snfs_shutdown();
+	close(sockfd);
+	unlink(SERVER_SOCK);
+	exit(0);
+}
+
+
 /* receives a Server Id, from the main function argv */
 
 void srv_init_socket(struct sockaddr_un* servaddr)
@@ -192,10 +232,11 @@ void* thread_consumer() {
 	while(1) {
 		sthread_monitor_enter(mon);
 		// get request from queue
-		while (!available_reqs) sthread_monitor_wait(mon);
+		while (!available_reqs || stopping) sthread_monitor_wait(mon);
 		
 		req_d = get_req();
 		available_reqs--;
+		serving++;
 		sthread_monitor_signal(mon); 
 		sthread_monitor_exit(mon); 
 
@@ -226,6 +267,11 @@ void* thread_consumer() {
 		
 		// free stuff
 		free(req_d); req_d = NULL;
+
+		sthread_monitor_enter(mon);
+		serving--;
+		sthread_monitor_signalall(mon);
+		sthread_monitor_exit(mon);
 		
 		// force request processing
 		sthread_yield();
@@ -290,6 +336,10 @@ int main(int argc, char **argv)
                 	
 	// initialize communications
 	srv_init_socket(&servaddr);
+
+	// stop cleanly on SIGINT and SIGTERM
+	signal(SIGINT, srv_stop_signal);
+	signal(SIGTERM, srv_stop_signal);
 			
 	// initialize  monitor
         mon = sthread_monitor_init();
@@ -13,28 +13,67 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <sthread.h>
 #include <snfs_proto.h>
 #include "block.h"
 #include "fs.h"
 
 
 #ifndef NUM_BLOCKS
-// default storage of 8 MB (8*1024*2 blocks * 512 bytes/block)
+// default storage of 8 MB (8*1024*2 blocks * FS_MIN_BLOCK_SIZE bytes/block)
 #define NUM_BLOCKS (8*1024*2)
 #endif
 
 #define DEFAULT_DISK_DELAY 10000
 
+// maximum number of blocks moved by the defragmenter at a time
+#define DEFRAG_STEP_BLKS 16
+
 static fs_t* FS;
 
 
+// server arguments: [-m <image> | -f <image>] [disk delay (usecs) [block
+// size (bytes)]]; the storage is kept in memory unless an image file is
+// given: -m mounts the file system in it, as left by an earlier server,
+// and -f formats a new one; the data kept in memory reaches the image
+// when the server stops on SIGINT or SIGTERM (see snfs_shutdown)
 void snfs_init(int argc, char **argv)
 {
   int disk_delay = DEFAULT_DISK_DELAY;
+  unsigned block_size = FS_BLOCK_SIZE;
+  char* image = NULL;
+  int mount = 0;
+  if (argc > 2 && (strcmp(argv[1], "-m") == 0 || strcmp(argv[1], "-f") == 0)) {
+    mount = (argv[1][1] == 'm');
+    image = argv[2];
+    argc -= 2;
+    argv += 2;
+  }
   if (argc > 1)
     sscanf(argv[1], "%d", &disk_delay);
-  FS = fs_new(NUM_BLOCKS, disk_delay);
-  fs_format(FS);
+  if (argc > 2)
+    sscanf(argv[2], "%u", &block_size);
+  if (mount) {
+    FS = fs_mount(image, disk_delay);
+    if (FS == NULL) {
+      printf("[snfs] unable to mount the file system in '%s'.\n", image);
+      exit(-1);
+    }
+    return;
+  }
+  FS = fs_new(image, NUM_BLOCKS, disk_delay);
+  if (FS == NULL || fs_format(FS, block_size) < 0) {
+    printf("[snfs] unable to format the file system.\n");
+    exit(-1);
+  }
+}
+
+
+void snfs_shutdown()
+{
+  if (fs_flush(FS) < 0) {
+    printf("[snfs] unable to write all the data to the storage.\n");
+  }
 }
 
 
@@ -183,6 +222,11 @@ void snfs_readdir(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res,
    // get input arguments
    inodeid_t dir = (inodeid_t)req->body.readdir.dir;
    unsigned maxentries = req->body.readdir.cmax;
+   char* cookie = req->body.readdir.cookie;
+   cookie[MAX_FILE_NAME_SIZE-1] = '\0';
+   if (maxentries > MAX_READDIR_ENTRIES) {
+      maxentries = MAX_READDIR_ENTRIES;
+   }
    
    // format the response
    *ressz = sizeof(*res) - sizeof(res->body) + sizeof(res->body.readdir);
@@ -192,7 +236,7 @@ void snfs_readdir(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res,
    // handle request
    fs_file_name_t entries[MAX_READDIR_ENTRIES];
    int numentries;
-   if (!fs_readdir(FS,dir,entries,maxentries,&numentries)) {
+   if (!fs_readdir(FS,dir,cookie,entries,maxentries,&numentries)) {
       res->status = RES_OK;
       res->body.readdir.count = numentries;
       for (int i = 0; i < numentries; i++) {
@@ -260,23 +304,96 @@ void snfs_copy(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, int* ressz)
 
 void snfs_append(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, int* ressz)
 {
+	printf("[snfs] handling an 'append' request.\n");
+	char name1[MAX_FILE_NAME_SIZE];
+	char name2[MAX_FILE_NAME_SIZE];
 
-// IMPLEMENT
+	// get input arguments
+	inodeid_t dir1 = (inodeid_t)req->body.append.dir1;
+	inodeid_t dir2 = (inodeid_t)req->body.append.dir2;
+	strcpy(name1, req->body.append.name1);
+	strcpy(name2, req->body.append.name2);
+
+	// format the response to the client
+	*ressz = sizeof(*res) - sizeof(res->body) + sizeof(res->body.append);
+	res->type = REQ_APPEND;
+	res->status = RES_ERROR;
 
+	unsigned fsize;
+	if (fs_append(FS, dir1, dir2, name1, name2, &fsize) == 0) {
+		res->status = RES_OK;
+		res->body.append.fsize = fsize;
+	}
 }	   
 		   
 void snfs_defrag(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, int* ressz)
 {
+	printf("[snfs] handling a 'defrag' request.\n");
 
-// IMPLEMENT
+	// format the response to the client
+	*ressz = sizeof(*res) - sizeof(res->body) + sizeof(res->body.defrag);
+	res->type = REQ_DEFRAG;
+	res->status = RES_ERROR;
+
+	// defragment in small steps, letting other requests through
+	fs_defrag_t df;
+	int status;
+	fs_defrag_begin(FS, &df);
+	while ((status = fs_defrag_step(FS, &df, DEFRAG_STEP_BLKS)) > 0) {
+		sthread_yield();
+	}
 
+	if (status == 0) {
+		printf("[snfs] defrag moved %u blocks, fragmentation %u%% -> %u%%.\n",
+			df.moved, df.frag_before, df.frag_after);
+		res->status = RES_OK;
+		res->body.defrag.moved = df.moved;
+		res->body.defrag.frag_before = df.frag_before;
+		res->body.defrag.frag_after = df.frag_after;
+	}
 }	   
 		   
 void snfs_diskusage(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, int* ressz)
 {
+	// get input arguments
+	inodeid_t dir = (inodeid_t)req->body.diskusage.dir;
+	unsigned first = req->body.diskusage.first;
 
-// IMPLEMENT
+	// format the response to the client
+	*ressz = sizeof(*res) - sizeof(res->body) + sizeof(res->body.diskusage);
+	res->type = REQ_DISKUSAGE;
+	res->status = RES_ERROR;
 
+	// handle request
+	fs_usage_entry_t entries[MAX_DISKUSAGE_ENTRIES];
+	fs_usage_t usage;
+	int numentries;
+	if (fs_diskusage(FS, dir, first, entries, MAX_DISKUSAGE_ENTRIES,
+		&numentries, &usage) < 0) {
+		return;
+	}
+
+	printf("[snfs] disk usage of directory %u: %u blocks (%u used, %u free "
+		"in %u runs, the longest of %u).\n", dir, usage.tree_blocks,
+		usage.num_blocks - usage.free_blocks, usage.free_blocks,
+		usage.free_extents, usage.largest_free);
+	snfs_msg_res_diskusage_t* du = &res->body.diskusage;
+	du->num_blocks = usage.num_blocks;
+	du->free_blocks = usage.free_blocks;
+	du->free_extents = usage.free_extents;
+	du->largest_free = usage.largest_free;
+	du->dir_blocks = usage.dir_blocks;
+	du->tree_blocks = usage.tree_blocks;
+	du->num_entries = usage.num_entries;
+	du->count = numentries;
+	for (int i = 0; i < numentries; i++) {
+		strncpy(du->list[i].name, entries[i].name, MAX_FILE_NAME_SIZE);
+		du->list[i].type = (entries[i].type == FS_DIR) ? SNFS_DIR : SNFS_FILE;
+		du->list[i].blocks = entries[i].blocks;
+		printf("[snfs] - %-13s %u blocks\n", entries[i].name,
+			entries[i].blocks);
+	}
+	res->status = RES_OK;
 }	   
 		   
 void snfs_dumpcache(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, int* ressz)
@@ -284,5 +401,185 @@ void snfs_dumpcache(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, int* re
 
 // IMPLEMENT
 
+}
+
+void snfs_snapshot(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, int* ressz)
+{
+	printf("[snfs] handling a 'snapshot' request.\n");
+	char name[MAX_FILE_NAME_SIZE];
+
+	// get input arguments
+	strncpy(name, req->body.snapshot.name, MAX_FILE_NAME_SIZE);
+	name[MAX_FILE_NAME_SIZE-1] = '\0';
+
+	// format the response to the client
+	*ressz = sizeof(*res) - sizeof(res->body) + sizeof(res->body.snapshot);
+	res->type = REQ_SNAPSHOT;
+	res->status = RES_ERROR;
+
+	inodeid_t root;
+	switch (req->body.snapshot.op) {
+		case SNAPSHOT_CREATE:
+			if (fs_snapshot_create(FS, name, &root) == 0) {
+				res->status = RES_OK;
+				res->body.snapshot.root = root;
+			}
+			break;
+		case SNAPSHOT_DELETE:
+			if (fs_snapshot_delete(FS, name) == 0) {
+				res->status = RES_OK;
+			}
+			break;
+		default:
+			printf("[snfs] unknown snapshot operation.\n");
+	}
+}
+
+void snfs_fallocate(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, int* ressz)
+{
+	printf("[snfs] handling a 'fallocate' request.\n");
+
+	// get input arguments
+	inodeid_t file = (inodeid_t)req->body.fallocate.fhandle;
+	unsigned offset = req->body.fallocate.offset;
+	unsigned len = req->body.fallocate.len;
+	int keep_size = (req->body.fallocate.flags & FALLOC_KEEP_SIZE) != 0;
+
+	// format the response to the client
+	*ressz = sizeof(*res) - sizeof(res->body) + sizeof(res->body.fallocate);
+	res->type = REQ_FALLOCATE;
+	res->status = RES_ERROR;
+
+	if (fs_fallocate(FS, file, offset, len, keep_size) == 0) {
+		fs_file_attrs_t attrs;
+		if (fs_get_attrs(FS, file, &attrs) == 0) {
+			res->status = RES_OK;
+			res->body.fallocate.fsize = attrs.size;
+		}
+	}
 }	   
 		   
+
+
+void snfs_truncate(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, int* ressz)
+{
+	printf("[snfs] handling a 'truncate' request.\n");
+
+	// get input arguments
+	inodeid_t file = (inodeid_t)req->body.truncate.fhandle;
+	unsigned size = req->body.truncate.size;
+
+	// format the response to the client
+	*ressz = sizeof(*res) - sizeof(res->body) + sizeof(res->body.truncate);
+	res->type = REQ_TRUNCATE;
+	res->status = RES_ERROR;
+
+	if (fs_truncate(FS, file, size) == 0) {
+		res->status = RES_OK;
+		res->body.truncate.fsize = size;
+	}
+}
+
+
+void snfs_punchhole(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, int* ressz)
+{
+	printf("[snfs] handling a 'punchhole' request.\n");
+
+	// get input arguments
+	inodeid_t file = (inodeid_t)req->body.punchhole.fhandle;
+	unsigned offset = req->body.punchhole.offset;
+	unsigned len = req->body.punchhole.len;
+
+	// format the response to the client
+	*ressz = sizeof(*res) - sizeof(res->body) + sizeof(res->body.punchhole);
+	res->type = REQ_PUNCHHOLE;
+	res->status = RES_ERROR;
+
+	if (fs_punch_hole(FS, file, offset, len) == 0) {
+		fs_file_attrs_t attrs;
+		if (fs_get_attrs(FS, file, &attrs) == 0) {
+			res->status = RES_OK;
+			res->body.punchhole.fsize = attrs.size;
+		}
+	}
+}
+
+
+void snfs_create_batch(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, int* ressz)
+{
+	printf("[snfs] handling a 'create batch' request.\n");
+
+	// get input arguments
+	inodeid_t dir = (inodeid_t)req->body.create_batch.dir;
+	unsigned count = req->body.create_batch.count;
+
+	// format the response to the client
+	*ressz = sizeof(*res) - sizeof(res->body) + sizeof(res->body.create_batch);
+	res->type = REQ_CREATE_BATCH;
+	res->status = RES_ERROR;
+
+	if (count > MAX_CREATE_BATCH)
+		return;
+
+	char* names[MAX_CREATE_BATCH];
+	inodeid_t fileids[MAX_CREATE_BATCH];
+	for (unsigned i = 0; i < count; i++) {
+		req->body.create_batch.names[i][MAX_FILE_NAME_SIZE-1] = '\0';
+		names[i] = req->body.create_batch.names[i];
+	}
+
+	if (fs_create_many(FS, dir, names, count, fileids) == 0) {
+		res->status = RES_OK;
+		res->body.create_batch.count = count;
+		for (unsigned i = 0; i < count; i++)
+			res->body.create_batch.files[i] = (snfs_fhandle_t)fileids[i];
+	}
+}
+
+
+void snfs_rename(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, int* ressz)
+{
+	printf("[snfs] handling a 'rename' request.\n");
+
+	// get input arguments
+	inodeid_t dir1 = (inodeid_t)req->body.rename.src_dir;
+	inodeid_t dir2 = (inodeid_t)req->body.rename.dst_dir;
+	req->body.rename.src_name[MAX_FILE_NAME_SIZE-1] = '\0';
+	req->body.rename.dst_name[MAX_FILE_NAME_SIZE-1] = '\0';
+
+	// format the response to the client
+	*ressz = sizeof(*res) - sizeof(res->body) + sizeof(res->body.rename);
+	res->type = REQ_RENAME;
+	res->status = RES_ERROR;
+
+	inodeid_t file;
+	if (fs_rename(FS, dir1, dir2, req->body.rename.src_name,
+		req->body.rename.dst_name, &file) == 0) {
+		res->status = RES_OK;
+		res->body.rename.file = (snfs_fhandle_t)file;
+	}
+}
+
+
+void snfs_link(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, int* ressz)
+{
+	printf("[snfs] handling a 'link' request.\n");
+
+	// get input arguments
+	inodeid_t dir1 = (inodeid_t)req->body.link.src_dir;
+	inodeid_t dir2 = (inodeid_t)req->body.link.dst_dir;
+	req->body.link.src_name[MAX_FILE_NAME_SIZE-1] = '\0';
+	req->body.link.dst_name[MAX_FILE_NAME_SIZE-1] = '\0';
+
+	// format the response to the client
+	*ressz = sizeof(*res) - sizeof(res->body) + sizeof(res->body.link);
+	res->type = REQ_LINK;
+	res->status = RES_ERROR;
+
+	inodeid_t file;
+	if (fs_link(FS, dir1, dir2, req->body.link.src_name,
+		req->body.link.dst_name, &file) == 0) {
+		res->status = RES_OK;
+		res->body.link.file = (snfs_fhandle_t)file;
+	}
+}
@@ -33,6 +33,13 @@ typedef void (*snfs_handler_t)(snfs_msg_req_t *req, int reqsz,
 void snfs_init(int argc, char **argv);
 
 
+/*
+ * snfs_shutdown: writes to the storage the data the file system keeps in
+ * memory, before the server exits
+ */
+void snfs_shutdown();
+
+
 /*
  * SNFS Handlers
  *
@@ -86,5 +93,26 @@ void snfs_diskusage(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res,
 		   
 void snfs_dumpcache(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
 	       int* ressz);		   
+
+void snfs_snapshot(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
+	       int* ressz);
+
+void snfs_fallocate(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
+	       int* ressz);
+
+void snfs_truncate(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
+	       int* ressz);
+
+void snfs_punchhole(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
+	       int* ressz);
+
+void snfs_create_batch(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
+	       int* ressz);
+
+void snfs_rename(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
+	       int* ressz);
+
+void snfs_link(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
+	       int* ressz);
 		   
 #endif
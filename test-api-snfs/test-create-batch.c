@@ -0,0 +1,108 @@
+/*
+ * SNFS API Layer
+ *
+ * test-create-batch
+ *
+ * Tests the SNFS services:
+ * - mkdir: creates a directory
+ * - create_batch: creates many files in the directory at once
+ * - lookup: finds the files created
+ * - readdir: lists the files created
+ * - create_batch: fails with an existing or a repeated name, creating
+ *   none of the files
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the SNFS API interface
+#include <snfs_api.h>
+
+
+#ifndef CLIENT_SOCK
+#define CLIENT_SOCK "/tmp/client.socket"
+#endif
+
+#ifndef SERVER_SOCK
+#define SERVER_SOCK "/tmp/server.socket"
+#endif
+
+#define ROOT_FHANDLE 1
+
+
+int main(int argc, char **argv)
+{
+   // initialize the SNFS API layer
+   if (snfs_init(CLIENT_SOCK,SERVER_SOCK) < 0) {
+      printf("[test] unable to initialize SNFS API.\n");
+      return -1;
+   } else {
+      printf("[test] SNFS API initialized.\n");
+   }
+
+   // invoke the 'mkdir' service to create directory 'd1' in root dir
+   snfs_fhandle_t dir_fh;
+   if (snfs_mkdir(ROOT_FHANDLE,"d1",&dir_fh) != STAT_OK) {
+      printf("[test] error creating a directory in server.\n");
+      return -1;
+   }
+
+   // create files 'f-0' to 'f-63' in 'd1' at once
+   char buffer[MAX_CREATE_BATCH][MAX_FILE_NAME_SIZE];
+   char* names[MAX_CREATE_BATCH];
+   snfs_fhandle_t files[MAX_CREATE_BATCH];
+   for (int i = 0; i < MAX_CREATE_BATCH; i++) {
+      sprintf(buffer[i],"f-%d",i);
+      names[i] = buffer[i];
+   }
+   if (snfs_create_batch(dir_fh,names,MAX_CREATE_BATCH,files) != STAT_OK) {
+      printf("[test] error creating the files in server.\n");
+      return -1;
+   }
+   printf("[test] %d files created.\n",MAX_CREATE_BATCH);
+
+   // the files are found with the file handles returned
+   char path[MAX_PATH_NAME_SIZE];
+   for (int i = 0; i < MAX_CREATE_BATCH; i += 7) {
+      snfs_fhandle_t file_fh;
+      unsigned fsize;
+      sprintf(path,"/d1/%s",names[i]);
+      if (snfs_lookup(path,&file_fh,&fsize) != STAT_OK ||
+         file_fh != files[i] || fsize != 0) {
+         printf("[test] error looking up file '%s'.\n",path);
+         return -1;
+      }
+   }
+
+   // bad batches: an existing name, a name repeated
+   strcpy(buffer[0],"new");
+   strcpy(buffer[1],"f-40");
+   if (snfs_create_batch(dir_fh,names,2,files) == STAT_OK) {
+      printf("[test] error: an existing file was created.\n");
+      return -1;
+   }
+   strcpy(buffer[1],"new");
+   if (snfs_create_batch(dir_fh,names,2,files) == STAT_OK) {
+      printf("[test] error: a repeated file was created.\n");
+      return -1;
+   }
+
+   // the directory holds the files of the first batch only
+   snfs_dir_entry_t list[MAX_READDIR_ENTRIES];
+   unsigned count;
+   if (snfs_readdir(dir_fh,NULL,MAX_READDIR_ENTRIES,list,&count) != STAT_OK ||
+      count != MAX_CREATE_BATCH) {
+      printf("[test] error listing the directory.\n");
+      return -1;
+   }
+   for (unsigned i = 0; i < count; i++) {
+      if (strcmp(list[i].name,"new") == 0 || list[i].type != SNFS_FILE) {
+         printf("[test] error: unexpected entry '%s'.\n",list[i].name);
+         return -1;
+      }
+   }
+
+   printf("[test] PASSED.\n");
+   return 0;
+}
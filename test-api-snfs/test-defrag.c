@@ -5,9 +5,10 @@
  *
  * Tests the SNFS services:
  * - create: creates 2 files
+ * - defrag: writes the files to the disk
  * - remove: removes the first file 
  * - defrag: defragments file system
- * - diskusage: dumps FS's occupied data blocks
+ * - diskusage: gets the blocks used by the remaining file
  * 
  * Atention: in current release, only the root directory exists
  * which corresponds to the file handler 1.
@@ -96,6 +97,14 @@ int main(int argc, char **argv)
       printf("[test] error: sizes differ %d!=%d.\n",fsize,DATA_SIZE);
       return -1;
    }
+   //the writes are kept in memory until their blocks are allocated, so a
+   //first defrag puts them on the disk, "f1" before "f2"
+   unsigned moved, frag_before, frag_after;
+   if (snfs_defrag(&moved,&frag_before,&frag_after) != STAT_OK) {
+      printf("[test] error defragmenting server's file system.\n");
+      return -1;
+   }
+
    //removing file "f1" means that the first  data block (11th) of FS will be emptied as the following block
    //keeps storing file "f2" data (12th).   
    if (snfs_remove(ROOT_FHANDLE, "f1", &file_fh1) != STAT_OK) {
@@ -103,17 +112,29 @@ int main(int argc, char **argv)
       return -1;
    }   
    //defragmenting the FS
-   if (snfs_defrag() != STAT_OK) {
+   if (snfs_defrag(&moved,&frag_before,&frag_after) != STAT_OK) {
       printf("[test] error defragmenting server's file system.\n");
       return -1;
    }   
-   //Dumping FS diskusage
-   if (snfs_diskusage() != STAT_OK) {
-      printf("[test] error dumping server's file system.\n");
+   printf("[test] defrag moved %u blocks, fragmentation %u%% -> %u%%.\n",
+      moved,frag_before,frag_after);
+   if (moved == 0) {
+      printf("[test] error: no block was moved.\n");
+      return -1;
+   }
+
+   //Getting FS diskusage
+   snfs_msg_res_diskusage_t usage;
+   if (snfs_diskusage(ROOT_FHANDLE,0,&usage) != STAT_OK) {
+      printf("[test] error getting server's disk usage.\n");
       return -1;
    }   
-   
-   printf("[test] File system was successfully defragmented only if occupied data block is \n      - the first one (the 11th) storing file 'f2' data\n    \n(Please check diskusage dumping on the server terminal).\n\n");
+   if (usage.count != 1 || usage.list[0].blocks != 1) {
+      printf("[test] error: only 'f2' should remain, using 1 block.\n");
+      return -1;
+   }
+
+   printf("[test] File system was successfully defragmented.\n\n");
 
    return 0;
 }
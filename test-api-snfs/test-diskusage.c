@@ -5,7 +5,7 @@
  *
  * Tests the SNFS services:
  * - create: creates 2 files
- * - diskusage: dumps occupied data blocks
+ * - diskusage: gets the blocks used by each file
  * 
  * Atention: in current release, only the root directory exists
  * which corresponds to the file handler 1.
@@ -96,13 +96,30 @@ int main(int argc, char **argv)
       printf("[test] error: sizes differ %d!=%d.\n",fsize,DATA_SIZE);
       return -1;
    }
-   //Dumping FS diskusage
-   if (snfs_diskusage() != STAT_OK) {
-      printf("[test] error dumping occupied data blocks.\n");
+   //Getting FS diskusage
+   snfs_msg_res_diskusage_t usage;
+   if (snfs_diskusage(ROOT_FHANDLE,0,&usage) != STAT_OK) {
+      printf("[test] error getting occupied data blocks.\n");
       return -1;
    }   
-   
-   printf("\n[test] File system data blocks usage was successfully dumped only if occupied blocks are: \n      - the first one (the 11th) storing file 'f1' data and \n      - the second one (the 12th) storing file 'f2' data\n    \n(Please check diskusage dumping on the server terminal).\n\n");
+
+   // each file uses one data block
+   if (usage.count != 2) {
+      printf("[test] error: %u entries listed, expected 2.\n",usage.count);
+      return -1;
+   }
+   for (unsigned i = 0; i < usage.count; i++) {
+      printf("[test] '%s' uses %u blocks.\n",usage.list[i].name,
+         usage.list[i].blocks);
+      if (usage.list[i].blocks != 1) {
+         printf("[test] error: '%s' should use 1 block.\n",usage.list[i].name);
+         return -1;
+      }
+   }
+   printf("[test] root tree uses %u blocks, %u of %u blocks free.\n",
+      usage.tree_blocks,usage.free_blocks,usage.num_blocks);
+
+   printf("\n[test] File system data blocks usage was successfully obtained.\n\n");
    
    return 0;
 }
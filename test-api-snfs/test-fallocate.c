@@ -0,0 +1,107 @@
+/*
+ * SNFS API Layer
+ *
+ * test-fallocate
+ *
+ * Tests the SNFS services:
+ * - create: creates a file
+ * - fallocate: allocates the blocks of the file, keeping its size
+ * - diskusage: checks that the blocks are in use
+ * - write/read: fills the allocated blocks
+ * - fallocate: grows the file, which reads as zeros past the data
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the SNFS API interface
+#include <snfs_api.h>
+
+
+#ifndef CLIENT_SOCK
+#define CLIENT_SOCK "/tmp/client.socket"
+#endif
+
+#ifndef SERVER_SOCK
+#define SERVER_SOCK "/tmp/server.socket"
+#endif
+
+#define ROOT_FHANDLE 1
+
+#define BLOCK_SIZE 512
+#define ALLOC_SIZE (64 * BLOCK_SIZE)
+#define DATA_SIZE 1000
+
+
+int main(int argc, char **argv)
+{
+   // initialize the SNFS API layer
+   if (snfs_init(CLIENT_SOCK,SERVER_SOCK) < 0) {
+      printf("[test] unable to initialize SNFS API.\n");
+      return -1;
+   } else {
+      printf("[test] SNFS API initialized.\n");
+   }
+
+   // invoke the 'create' service to create file 'f1' in root dir
+   snfs_fhandle_t file_fh;
+   if (snfs_create(ROOT_FHANDLE,"f1",&file_fh) != STAT_OK) {
+      printf("[test] error creating a file in server.\n");
+      return -1;
+   }
+   printf("[test] file created with file handle %d.\n",file_fh);
+
+   // allocate the blocks, the file stays empty
+   unsigned fsize;
+   if (snfs_fallocate(file_fh,0,ALLOC_SIZE,FALLOC_KEEP_SIZE,&fsize) !=
+      STAT_OK || fsize != 0) {
+      printf("[test] error allocating the file blocks.\n");
+      return -1;
+   }
+
+   snfs_msg_res_diskusage_t usage;
+   if (snfs_diskusage(ROOT_FHANDLE,0,&usage) != STAT_OK) {
+      printf("[test] error getting the disk usage.\n");
+      return -1;
+   }
+   for (unsigned i = 0; i < usage.count; i++) {
+      if (strcmp(usage.list[i].name,"f1") == 0 &&
+         usage.list[i].blocks < ALLOC_SIZE / BLOCK_SIZE) {
+         printf("[test] error: the blocks are not allocated.\n");
+         return -1;
+      }
+   }
+
+   // write and read back some 'A' chars
+   char data[DATA_SIZE];
+   char buffer[DATA_SIZE];
+   int nread;
+   memset(data,'A',DATA_SIZE);
+   if (snfs_write(file_fh,0,DATA_SIZE,data,&fsize) != STAT_OK ||
+      fsize != DATA_SIZE) {
+      printf("[test] error writing to file.\n");
+      return -1;
+   }
+   if (snfs_read(file_fh,0,DATA_SIZE,buffer,&nread) != STAT_OK ||
+      nread != DATA_SIZE || memcmp(buffer,data,DATA_SIZE) != 0) {
+      printf("[test] error reading from file.\n");
+      return -1;
+   }
+
+   // grow the file, past the data it reads as zeros
+   if (snfs_fallocate(file_fh,0,ALLOC_SIZE,0,&fsize) != STAT_OK ||
+      fsize != ALLOC_SIZE) {
+      printf("[test] error growing the file.\n");
+      return -1;
+   }
+   memset(data,0,DATA_SIZE);
+   if (snfs_read(file_fh,ALLOC_SIZE - DATA_SIZE,DATA_SIZE,buffer,&nread) !=
+      STAT_OK || nread != DATA_SIZE || memcmp(buffer,data,DATA_SIZE) != 0) {
+      printf("[test] error: the file does not read as zeros.\n");
+      return -1;
+   }
+
+   printf("[test] PASSED.\n");
+   return 0;
+}
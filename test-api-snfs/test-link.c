@@ -0,0 +1,96 @@
+/*
+ * SNFS API Layer
+ *
+ * test-link
+ *
+ * Tests the SNFS services:
+ * - create, write: creates a file with some data
+ * - link: gives the file a second name in another directory
+ * - write, read: writes through one name and reads through the other
+ * - link: fails giving a directory, or an existing name, another name
+ * - remove: removes the first name, the data is still found by the second
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the SNFS API interface
+#include <snfs_api.h>
+
+
+#ifndef CLIENT_SOCK
+#define CLIENT_SOCK "/tmp/client.socket"
+#endif
+
+#ifndef SERVER_SOCK
+#define SERVER_SOCK "/tmp/server.socket"
+#endif
+
+#define ROOT_FHANDLE 1
+
+
+int main(int argc, char **argv)
+{
+   // initialize the SNFS API layer
+   if (snfs_init(CLIENT_SOCK,SERVER_SOCK) < 0) {
+      printf("[test] unable to initialize SNFS API.\n");
+      return -1;
+   } else {
+      printf("[test] SNFS API initialized.\n");
+   }
+
+   // 'f1' in the root directory, and directory 'd1'
+   snfs_fhandle_t dir_fh, file_fh, linked_fh;
+   unsigned fsize;
+   char data[] = "shared data";
+   if (snfs_create(ROOT_FHANDLE,"f1",&file_fh) != STAT_OK ||
+      snfs_write(file_fh,0,6,"shared",&fsize) != STAT_OK ||
+      snfs_mkdir(ROOT_FHANDLE,"d1",&dir_fh) != STAT_OK) {
+      printf("[test] error creating the files in server.\n");
+      return -1;
+   }
+
+   // 'd1/f2' names the same file
+   if (snfs_link(ROOT_FHANDLE,"f1",dir_fh,"f2",&linked_fh) != STAT_OK ||
+      linked_fh != file_fh) {
+      printf("[test] error linking 'f1' in server.\n");
+      return -1;
+   }
+
+   // directories and existing names are not linked
+   if (snfs_link(ROOT_FHANDLE,"d1",ROOT_FHANDLE,"d2",&linked_fh) == STAT_OK ||
+      snfs_link(ROOT_FHANDLE,"f1",dir_fh,"f2",&linked_fh) == STAT_OK) {
+      printf("[test] error: a directory or an existing name was linked.\n");
+      return -1;
+   }
+
+   // written through 'd1/f2', read through 'f1'
+   snfs_fhandle_t fh;
+   char buffer[sizeof(data)];
+   int nread;
+   if (snfs_lookup("/d1/f2",&fh,&fsize) != STAT_OK || fh != file_fh ||
+      snfs_write(fh,0,sizeof(data),data,&fsize) != STAT_OK ||
+      snfs_lookup("/f1",&fh,&fsize) != STAT_OK || fsize != sizeof(data) ||
+      snfs_read(fh,0,sizeof(buffer),buffer,&nread) != STAT_OK ||
+      nread != sizeof(data) || memcmp(buffer,data,sizeof(data)) != 0) {
+      printf("[test] error reading the file through its other name.\n");
+      return -1;
+   }
+
+   // the file outlives its first name
+   if (snfs_remove(ROOT_FHANDLE,"f1",&fh) != STAT_OK ||
+      snfs_lookup("/f1",&fh,&fsize) == STAT_OK) {
+      printf("[test] error removing 'f1' in server.\n");
+      return -1;
+   }
+   if (snfs_lookup("/d1/f2",&fh,&fsize) != STAT_OK || fh != file_fh ||
+      snfs_read(fh,0,sizeof(buffer),buffer,&nread) != STAT_OK ||
+      nread != sizeof(data) || memcmp(buffer,data,sizeof(data)) != 0) {
+      printf("[test] error reading the file after removing a name.\n");
+      return -1;
+   }
+
+   printf("[test] PASSED.\n");
+   return 0;
+}
@@ -0,0 +1,151 @@
+/*
+ * SNFS API Layer
+ *
+ * test-readdir
+ *
+ * Tests the SNFS services:
+ * - mkdir: creates a directory
+ * - create_batch: fills the directory with many files
+ * - readdir: lists the directory in parts, each resuming after the last
+ *   name of the previous one, getting every file once and in name order
+ * - remove, create: change the directory between two parts, the parts
+ *   still resuming where they stopped
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the SNFS API interface
+#include <snfs_api.h>
+
+
+#ifndef CLIENT_SOCK
+#define CLIENT_SOCK "/tmp/client.socket"
+#endif
+
+#ifndef SERVER_SOCK
+#define SERVER_SOCK "/tmp/server.socket"
+#endif
+
+#define ROOT_FHANDLE 1
+
+#define NUM_FILES 1024
+
+
+// lists the whole directory, checking the order of the names
+static int list_dir(snfs_fhandle_t dir, int* seen, int* total)
+{
+   snfs_dir_entry_t list[MAX_READDIR_ENTRIES];
+   char cookie[MAX_FILE_NAME_SIZE] = "";
+   unsigned count;
+
+   *total = 0;
+   do {
+      if (snfs_readdir(dir,cookie,MAX_READDIR_ENTRIES,list,&count) !=
+         STAT_OK) {
+         printf("[test] error listing the directory.\n");
+         return -1;
+      }
+      for (unsigned i = 0; i < count; i++) {
+         if (strcmp(list[i].name,cookie) <= 0) {
+            printf("[test] error: '%s' listed after '%s'.\n",list[i].name,
+               cookie);
+            return -1;
+         }
+         strcpy(cookie,list[i].name);
+         int k = atoi(&list[i].name[2]);
+         if (k >= 0 && k < NUM_FILES) {
+            seen[k]++;
+         }
+      }
+      *total += count;
+   } while (count == MAX_READDIR_ENTRIES);
+   return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+   // initialize the SNFS API layer
+   if (snfs_init(CLIENT_SOCK,SERVER_SOCK) < 0) {
+      printf("[test] unable to initialize SNFS API.\n");
+      return -1;
+   } else {
+      printf("[test] SNFS API initialized.\n");
+   }
+
+   // invoke the 'mkdir' service to create directory 'd1' in root dir
+   snfs_fhandle_t dir_fh;
+   if (snfs_mkdir(ROOT_FHANDLE,"d1",&dir_fh) != STAT_OK) {
+      printf("[test] error creating a directory in server.\n");
+      return -1;
+   }
+
+   // create files 'f-0' to 'f-1023' in 'd1', in batches
+   char buffer[MAX_CREATE_BATCH][MAX_FILE_NAME_SIZE];
+   char* names[MAX_CREATE_BATCH];
+   snfs_fhandle_t files[MAX_CREATE_BATCH];
+   for (int i = 0; i < NUM_FILES; i += MAX_CREATE_BATCH) {
+      for (int j = 0; j < MAX_CREATE_BATCH; j++) {
+         sprintf(buffer[j],"f-%d",i + j);
+         names[j] = buffer[j];
+      }
+      if (snfs_create_batch(dir_fh,names,MAX_CREATE_BATCH,files) !=
+         STAT_OK) {
+         printf("[test] error creating the files in server.\n");
+         return -1;
+      }
+   }
+   printf("[test] %d files created.\n",NUM_FILES);
+
+   // every file is listed once
+   int seen[NUM_FILES], total;
+   memset(seen,0,sizeof(seen));
+   if (list_dir(dir_fh,seen,&total) < 0) {
+      return -1;
+   }
+   for (int i = 0; i < NUM_FILES; i++) {
+      if (seen[i] != 1) {
+         printf("[test] error: 'f-%d' listed %d times.\n",i,seen[i]);
+         return -1;
+      }
+   }
+   printf("[test] %d files listed in order.\n",total);
+
+   // remove a file already listed and one not listed yet between two
+   // parts: the listing resumes after the cookie
+   snfs_dir_entry_t list[MAX_READDIR_ENTRIES];
+   unsigned count;
+   if (snfs_readdir(dir_fh,"",MAX_READDIR_ENTRIES,list,&count) != STAT_OK ||
+      count != MAX_READDIR_ENTRIES) {
+      printf("[test] error listing the directory.\n");
+      return -1;
+   }
+   char cookie[MAX_FILE_NAME_SIZE];
+   snfs_fhandle_t file_fh;
+   strcpy(cookie,list[count - 1].name);
+   if (snfs_remove(dir_fh,list[0].name,&file_fh) != STAT_OK ||
+      snfs_remove(dir_fh,"f-999",&file_fh) != STAT_OK) {
+      printf("[test] error removing the files.\n");
+      return -1;
+   }
+   if (snfs_readdir(dir_fh,cookie,MAX_READDIR_ENTRIES,list,&count) !=
+      STAT_OK || count != MAX_READDIR_ENTRIES ||
+      strcmp(list[0].name,cookie) <= 0) {
+      printf("[test] error resuming the listing.\n");
+      return -1;
+   }
+
+   memset(seen,0,sizeof(seen));
+   if (list_dir(dir_fh,seen,&total) < 0) {
+      return -1;
+   }
+   if (total != NUM_FILES - 2 || seen[999] != 0) {
+      printf("[test] error: %d files listed after the removals.\n",total);
+      return -1;
+   }
+
+   printf("[test] PASSED.\n");
+   return 0;
+}
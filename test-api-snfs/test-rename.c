@@ -0,0 +1,96 @@
+/*
+ * SNFS API Layer
+ *
+ * test-rename
+ *
+ * Tests the SNFS services:
+ * - create, write: creates a file with some data
+ * - rename: renames the file in its directory
+ * - rename: moves the file to another directory, replacing a file there
+ *   (the write-temp-then-rename pattern)
+ * - rename: fails moving a directory below itself
+ * - lookup, read: finds the file by its new name only, with its data
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the SNFS API interface
+#include <snfs_api.h>
+
+
+#ifndef CLIENT_SOCK
+#define CLIENT_SOCK "/tmp/client.socket"
+#endif
+
+#ifndef SERVER_SOCK
+#define SERVER_SOCK "/tmp/server.socket"
+#endif
+
+#define ROOT_FHANDLE 1
+
+
+int main(int argc, char **argv)
+{
+   // initialize the SNFS API layer
+   if (snfs_init(CLIENT_SOCK,SERVER_SOCK) < 0) {
+      printf("[test] unable to initialize SNFS API.\n");
+      return -1;
+   } else {
+      printf("[test] SNFS API initialized.\n");
+   }
+
+   // directory 'd1' with 'tmp' in it, and 'cur' in the root directory
+   snfs_fhandle_t dir_fh, file_fh, cur_fh, moved_fh;
+   unsigned fsize;
+   char data[] = "new version";
+   if (snfs_mkdir(ROOT_FHANDLE,"d1",&dir_fh) != STAT_OK ||
+      snfs_create(dir_fh,"tmp",&file_fh) != STAT_OK ||
+      snfs_write(file_fh,0,sizeof(data),data,&fsize) != STAT_OK ||
+      snfs_create(ROOT_FHANDLE,"cur",&cur_fh) != STAT_OK ||
+      snfs_write(cur_fh,0,3,"old",&fsize) != STAT_OK) {
+      printf("[test] error creating the files in server.\n");
+      return -1;
+   }
+
+   // rename in the same directory
+   if (snfs_rename(dir_fh,"tmp",dir_fh,"tmp2",&moved_fh) != STAT_OK ||
+      moved_fh != file_fh) {
+      printf("[test] error renaming 'tmp' in server.\n");
+      return -1;
+   }
+
+   // move to the root directory, replacing 'cur'
+   if (snfs_rename(dir_fh,"tmp2",ROOT_FHANDLE,"cur",&moved_fh) != STAT_OK ||
+      moved_fh != file_fh) {
+      printf("[test] error moving 'tmp2' over 'cur' in server.\n");
+      return -1;
+   }
+
+   // a directory cannot go below itself
+   if (snfs_rename(ROOT_FHANDLE,"d1",dir_fh,"d2",&moved_fh) == STAT_OK) {
+      printf("[test] error: a directory was moved below itself.\n");
+      return -1;
+   }
+
+   // the old names are gone, the new one has the data of the file moved
+   snfs_fhandle_t fh;
+   if (snfs_lookup("/d1/tmp",&fh,&fsize) == STAT_OK ||
+      snfs_lookup("/d1/tmp2",&fh,&fsize) == STAT_OK) {
+      printf("[test] error: an old name is still found.\n");
+      return -1;
+   }
+   char buffer[sizeof(data)];
+   int nread;
+   if (snfs_lookup("/cur",&fh,&fsize) != STAT_OK || fh != file_fh ||
+      fsize != sizeof(data) ||
+      snfs_read(fh,0,sizeof(buffer),buffer,&nread) != STAT_OK ||
+      nread != sizeof(data) || memcmp(buffer,data,sizeof(data)) != 0) {
+      printf("[test] error reading the file moved.\n");
+      return -1;
+   }
+
+   printf("[test] PASSED.\n");
+   return 0;
+}
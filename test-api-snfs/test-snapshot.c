@@ -0,0 +1,106 @@
+/* 
+ * SNFS API Layer
+ * 
+ * test-snapshot
+ *
+ * Tests the SNFS services:
+ * - create: creates a file
+ * - write: writes data to the file
+ * - snapshot: takes a snapshot of the file system
+ * - write: overwrites the file
+ * - lookup/read: reads the old data from the snapshot
+ * - snapshot: deletes the snapshot
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the SNFS API interface
+#include <snfs_api.h>
+
+
+#ifndef CLIENT_SOCK
+#define CLIENT_SOCK "/tmp/client.socket"
+#endif
+
+#ifndef SERVER_SOCK
+#define SERVER_SOCK "/tmp/server.socket"
+#endif
+
+#define ROOT_FHANDLE 1
+
+#define DATA_SIZE 512
+
+
+int main(int argc, char **argv)
+{
+   // initialize the SNFS API layer
+   if (snfs_init(CLIENT_SOCK,SERVER_SOCK) < 0) {
+      printf("[test] unable to initialize SNFS API.\n");
+      return -1;
+   } else {
+      printf("[test] SNFS API initialized.\n");
+   }
+
+   // invoke the 'create' service to create file 'f1' in root dir
+   snfs_fhandle_t file_fh;
+   if (snfs_create(ROOT_FHANDLE,"f1",&file_fh) != STAT_OK) {
+      printf("[test] error creating a file in server.\n");
+      return -1;
+   }
+   printf("[test] file created with file handle %d.\n",file_fh);
+
+   // write a block of 'A' chars
+   char data[DATA_SIZE];
+   unsigned fsize;
+   memset(data,'A',DATA_SIZE);
+   if (snfs_write(file_fh,0,DATA_SIZE,data,&fsize) != STAT_OK) {
+      printf("[test] error writing to file.\n");
+      return -1;
+   }
+
+   // take the snapshot
+   snfs_fhandle_t root_fh;
+   if (snfs_snapshot_create("s1",&root_fh) != STAT_OK) {
+      printf("[test] error creating a snapshot.\n");
+      return -1;
+   }
+   printf("[test] snapshot created with root handle %d.\n",root_fh);
+
+   // overwrite the file with 'B' chars
+   memset(data,'B',DATA_SIZE);
+   if (snfs_write(file_fh,0,DATA_SIZE,data,&fsize) != STAT_OK) {
+      printf("[test] error writing to file.\n");
+      return -1;
+   }
+
+   // the snapshot still holds the 'A' chars
+   snfs_fhandle_t snap_fh;
+   char buffer[DATA_SIZE];
+   int nread;
+   if (snfs_lookup("/.snapshot/s1/f1",&snap_fh,&fsize) != STAT_OK ||
+      snfs_read(snap_fh,0,DATA_SIZE,buffer,&nread) != STAT_OK) {
+      printf("[test] error reading the file of the snapshot.\n");
+      return -1;
+   }
+   memset(data,'A',DATA_SIZE);
+   if (nread != DATA_SIZE || memcmp(buffer,data,DATA_SIZE) != 0) {
+      printf("[test] error: the snapshot changed.\n");
+      return -1;
+   }
+
+   // the snapshot is read-only
+   if (snfs_write(snap_fh,0,DATA_SIZE,data,&fsize) == STAT_OK) {
+      printf("[test] error: the snapshot was written.\n");
+      return -1;
+   }
+
+   if (snfs_snapshot_delete("s1") != STAT_OK) {
+      printf("[test] error deleting the snapshot.\n");
+      return -1;
+   }
+
+   printf("[test] PASSED.\n");
+   return 0;
+}
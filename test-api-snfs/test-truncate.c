@@ -0,0 +1,123 @@
+/*
+ * SNFS API Layer
+ *
+ * test-truncate
+ *
+ * Tests the SNFS services:
+ * - create: creates a file
+ * - write: writes data to the file
+ * - punchhole: frees a range in the middle of the file
+ * - read: the range reads as zeros, the rest is kept
+ * - truncate: shrinks the file
+ * - lookup: checks the new size
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the SNFS API interface
+#include <snfs_api.h>
+
+
+#ifndef CLIENT_SOCK
+#define CLIENT_SOCK "/tmp/client.socket"
+#endif
+
+#ifndef SERVER_SOCK
+#define SERVER_SOCK "/tmp/server.socket"
+#endif
+
+#define ROOT_FHANDLE 1
+
+#define DATA_SIZE 2048
+#define HOLE_OFFSET 300
+#define HOLE_SIZE 1000
+#define NEW_SIZE 700
+
+#ifndef MIN
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#endif
+
+// the data goes in requests of at most this size
+#define CHUNK_SIZE MIN(MAX_WRITE_DATA,MAX_READ_DATA)
+
+
+// reads the file from the start, in chunks, up to DATA_SIZE bytes
+static int read_file(snfs_fhandle_t fh, char* buffer, int* nread)
+{
+   int n;
+   *nread = 0;
+   do {
+      if (snfs_read(fh,*nread,CHUNK_SIZE,&buffer[*nread],&n) != STAT_OK) {
+         return -1;
+      }
+      *nread += n;
+   } while (n == CHUNK_SIZE && *nread < DATA_SIZE);
+   return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+   // initialize the SNFS API layer
+   if (snfs_init(CLIENT_SOCK,SERVER_SOCK) < 0) {
+      printf("[test] unable to initialize SNFS API.\n");
+      return -1;
+   } else {
+      printf("[test] SNFS API initialized.\n");
+   }
+
+   // invoke the 'create' service to create file 'f1' in root dir
+   snfs_fhandle_t file_fh;
+   if (snfs_create(ROOT_FHANDLE,"f1",&file_fh) != STAT_OK) {
+      printf("[test] error creating a file in server.\n");
+      return -1;
+   }
+   printf("[test] file created with file handle %d.\n",file_fh);
+
+   // write 'A' chars
+   char data[DATA_SIZE];
+   unsigned fsize;
+   memset(data,'A',DATA_SIZE);
+   for (unsigned off = 0; off < DATA_SIZE; off += CHUNK_SIZE) {
+      if (snfs_write(file_fh,off,MIN(CHUNK_SIZE,DATA_SIZE - off),&data[off],
+         &fsize) != STAT_OK) {
+         printf("[test] error writing to file.\n");
+         return -1;
+      }
+   }
+
+   // punch a hole, the size stays
+   if (snfs_punchhole(file_fh,HOLE_OFFSET,HOLE_SIZE) != STAT_OK) {
+      printf("[test] error punching a hole in the file.\n");
+      return -1;
+   }
+   char buffer[DATA_SIZE];
+   int nread;
+   memset(&data[HOLE_OFFSET],0,HOLE_SIZE);
+   if (read_file(file_fh,buffer,&nread) < 0 || nread != DATA_SIZE ||
+      memcmp(buffer,data,DATA_SIZE) != 0) {
+      printf("[test] error: the hole does not read as zeros.\n");
+      return -1;
+   }
+
+   // shrink the file
+   if (snfs_truncate(file_fh,NEW_SIZE) != STAT_OK) {
+      printf("[test] error truncating the file.\n");
+      return -1;
+   }
+   snfs_fhandle_t fh;
+   if (snfs_lookup("/f1",&fh,&fsize) != STAT_OK || fsize != NEW_SIZE) {
+      printf("[test] error: the file size is not %d.\n",NEW_SIZE);
+      return -1;
+   }
+   if (read_file(file_fh,buffer,&nread) < 0 || nread != NEW_SIZE ||
+      memcmp(buffer,data,NEW_SIZE) != 0) {
+      printf("[test] error reading from file.\n");
+      return -1;
+   }
+
+   printf("[test] PASSED.\n");
+   return 0;
+}